@@ -0,0 +1,93 @@
+// Benchmark harness: runs a Tcl script in an embedded interpreter, with
+// vecexpr linked in and an extra timing command:
+//
+//   bench::run words count
+//
+// evaluates the command given by the list words count times, straight
+// through Tcl_EvalObjv (no script parsing), and returns the mean time per
+// call in nanoseconds. The variable bench::harness is set to 1.
+//
+// usage: bench/harness script ?arg ...?   (see bench/operators.tcl)
+
+#include <tcl.h>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+extern "C" int Vecexpr_Init(Tcl_Interp *interp);
+
+static int obj_run(ClientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+{
+  Tcl_Obj **words;
+  int       nwords;
+  int       count;
+
+  if (argc != 3) {
+    Tcl_WrongNumArgs(interp, 1, objv, (char *)"words count");
+    return TCL_ERROR;
+  }
+  if (Tcl_ListObjGetElements(interp, objv[1], &nwords, &words) != TCL_OK
+      || Tcl_GetIntFromObj(interp, objv[2], &count) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (nwords < 1 || count < 1) {
+    Tcl_SetResult(interp, (char *) "bench::run: empty command or count < 1", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  // The list may lose its internal rep while the command runs
+  std::vector<Tcl_Obj *> held(words, words + nwords);
+  for (int i = 0; i < nwords; i++) Tcl_IncrRefCount(held[i]);
+
+  int result = TCL_OK;
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count && result == TCL_OK; i++) {
+    // Frees the result of the previous call before the next one runs
+    Tcl_ResetResult(interp);
+    result = Tcl_EvalObjv(interp, nwords, held.data(), 0);
+  }
+  const std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+
+  for (int i = 0; i < nwords; i++) Tcl_DecrRefCount(held[i]);
+  if (result != TCL_OK) {
+    return result;
+  }
+  const double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+  Tcl_SetObjResult(interp, Tcl_NewDoubleObj(ns / count));
+  return TCL_OK;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s script ?arg ...?\n", argv[0]);
+    return 2;
+  }
+  Tcl_FindExecutable(argv[0]);
+  Tcl_Interp *interp = Tcl_CreateInterp();
+  if (Tcl_Init(interp) != TCL_OK) {
+    // Only the script library is missing: the built-in commands still work
+    fprintf(stderr, "warning: %s\n", Tcl_GetStringResult(interp));
+  }
+  if (Vecexpr_Init(interp) != TCL_OK) {
+    fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+    return 1;
+  }
+  Tcl_CreateObjCommand(interp, "bench::run", obj_run, NULL, NULL);
+  Tcl_SetVar2Ex(interp, "bench::harness", NULL, Tcl_NewIntObj(1), TCL_GLOBAL_ONLY);
+
+  Tcl_Obj *args = Tcl_NewListObj(0, NULL);
+  for (int i = 2; i < argc; i++) {
+    Tcl_ListObjAppendElement(NULL, args, Tcl_NewStringObj(argv[i], -1));
+  }
+  Tcl_SetVar2Ex(interp, "argv0", NULL, Tcl_NewStringObj(argv[1], -1), TCL_GLOBAL_ONLY);
+  Tcl_SetVar2Ex(interp, "argv", NULL, args, TCL_GLOBAL_ONLY);
+  Tcl_SetVar2Ex(interp, "argc", NULL, Tcl_NewIntObj(argc - 2), TCL_GLOBAL_ONLY);
+
+  int status = 0;
+  if (Tcl_EvalFile(interp, argv[1]) != TCL_OK) {
+    fprintf(stderr, "%s\n", Tcl_GetVar2(interp, "errorInfo", NULL, TCL_GLOBAL_ONLY));
+    status = 1;
+  }
+  Tcl_DeleteInterp(interp);
+  return status;
+}
@@ -0,0 +1,57 @@
+#!/bin/tclsh
+
+# Speed of matmult and transp on square matrices, from 3x3 up to 4096x4096.
+#
+# usage: tclsh bench/matmult.tcl ?library? ?maxsize?
+#
+# Each size is timed for at least 0.2 s. The matrices are built with vecexpr
+# itself (concat and add), so that no large Tcl lists are needed.
+
+set lib [expr {[llength $argv] > 0 ? [lindex $argv 0] : "./vecexpr.so"}]
+set maxsize [expr {[llength $argv] > 1 ? [lindex $argv 1] : 4096}]
+
+load $lib Vecexpr
+
+# n x n matrix with elements (i + 2 j) mod 7 - 3
+proc matrix { n } {
+  set row {}
+  set col {}
+  for { set i 0 } { $i < $n } { incr i } {
+    lappend row [expr {(2 * $i) % 7 - 3}]
+    lappend col [expr {$i % 7}]
+  }
+  # n copies of row, by doubling
+  set m $row
+  set rows 1
+  while { 2 * $rows <= $n } {
+    set m [vecexpr $m dup concat]
+    set rows [expr {2 * $rows}]
+  }
+  while { $rows < $n } {
+    set m [vecexpr $m $row concat]
+    incr rows
+  }
+  return [vecexpr $col $m add]
+}
+
+# Time script, repeated until it has run for at least 0.2 s; returns ms per run
+proc timeit { script } {
+  set runs 1
+  while 1 {
+    set us [lindex [uplevel 1 [list time $script $runs]] 0]
+    if { $us * $runs >= 200000 } { return [expr {$us / 1000.0}] }
+    set runs [expr {$runs * 4}]
+  }
+}
+
+puts "library: $lib, isa [set vecexpr::isa]"
+puts [format "%6s %12s %10s %12s %10s" size "matmult ms" GFLOP/s "transp ms" GB/s]
+foreach n { 3 4 8 16 32 64 128 256 512 1024 2048 4096 } {
+  if { $n > $maxsize } break
+  set m [matrix $n]
+  set tm [timeit { vecexpr $m $m $n matmult }]
+  set tt [timeit { vecexpr $m $n transp }]
+  # transp reads and writes each element once
+  puts [format "%6d %12.4f %10.2f %12.4f %10.2f" $n $tm [expr {2e-6 * $n * $n * $n / $tm}] \
+          $tt [expr {16e-6 * $n * $n / $tt}]]
+}
@@ -0,0 +1,294 @@
+#!/bin/tclsh
+
+# Speed of every vecexpr operator over vector sizes from 1 to 10^8, against
+# equivalent Tcl loops calling expr.
+#
+# usage: bench/harness bench/operators.tcl ?option value ...?     (make bench)
+#        tclsh bench/operators.tcl ?option value ...?
+#
+# options:
+#   -lib path       library loaded under tclsh (default ./vecexpr.so)
+#   -min n -max n   range of sizes, powers of 10 (default 1 and 1e8)
+#   -exprmax n      largest size timed with expr loops (default 1e5)
+#   -ops list       operators to time (default: all)
+#   -mintime ms     minimum time of each measurement (default 100)
+#   -output file    write the results to file instead of stdout
+#
+# Output is CSV, one line per operator, size and implementation:
+#   operator,size,impl,calls,ns_per_call,ns_per_element,gb_per_s
+# where size is the number of elements per operand (matrices: k*k with k the
+# square root of the size, rounded down; packed 3-vectors: the size rounded
+# down to a multiple of 3), and GB/s counts the bytes of the operands read and
+# of the results written, 8 bytes per element.
+# Under bench/harness, vecexpr is timed by bench::run (Tcl_EvalObjv with a
+# nanosecond clock); under tclsh, by [time].
+# Size 10^8 needs about 5 GB of memory (x, y and the copies of the operands on
+# the stack); use -max 1e7 on smaller machines.
+
+array set opt {
+  -lib ./vecexpr.so -min 1 -max 1e8 -exprmax 1e5 -ops {} -mintime 100 -output {}
+}
+foreach {name value} $argv {
+  if { ![info exists opt($name)] } {
+    error "unknown option \"$name\", should be one of: [lsort [array names opt]]"
+  }
+  set opt($name) $value
+}
+if { ![info exists bench::harness] } {
+  load $opt(-lib) Vecexpr
+}
+set out stdout
+if { $opt(-output) ne "" } {
+  set out [open $opt(-output) w]
+}
+set tmpfile [file join [expr {[info exists env(TMPDIR)] ? $env(TMPDIR) : "/tmp"}] vecexpr_bench_[pid].f64]
+
+# operator  vecexpr words  operand vectors read  result vectors written  expr equivalent
+# In the words and loops, x and y are vectors, m a k*k matrix, p packed
+# 3-vectors (with c a cutoff giving about 14 neighbors per point), and xl yl
+# ml the same data as plain lists. "-" means no expr equivalent; size 0 that the
+# operator does not depend on the size (timed once, with size 1).
+set operators {
+  <varName   {<::x}                 1 1   -
+  >varName   {$x >::result}         1 1   -
+  &varName   {$x &::result}         1 1   -
+  <file:     {<file:f64:$tmpfile}   1 1   -
+  >file:     {$x >file:f64:$tmpfile} 1 1  -
+  abs        {$x abs}               1 1   {lmap a $xl {expr {abs($a)}}}
+  add        {$x $y add}            2 1   {lmap a $xl b $yl {expr {$a + $b}}}
+  argsort    {$x argsort}           1 1   {lsort -indices -real $xl}
+  atan2      {$y $x atan2}          2 1   {lmap a $yl b $xl {expr {atan2($a, $b)}}}
+  bin        {$x 0 0.01 100 bin}    1 0   {
+    set h [lrepeat 100 0]
+    foreach a $xl {
+      set b [expr {int(floor(($a - 0) / 0.01))}]
+      if { $b >= 0 && $b < 100 } { lset h $b [expr {[lindex $h $b] + 1}] }
+    }
+    set h
+  }
+  binnd      {$p {0 0 0} 0.1 10 binnd}  1 0  -
+  blockavg   {$x 10 blockavg}       1 0.1 {
+    set r {}
+    for { set i 0 } { $i + 10 <= [llength $xl] } { incr i 10 } {
+      set s 0.0
+      foreach a [lrange $xl $i [expr {$i + 9}]] {set s [expr {$s + $a}]}
+      lappend r [expr {$s / 10}]
+    }
+    set r
+  }
+  col        {$m $k 1 col sum}      1 0   -
+  com3       {$p 1 com3}            1 0   -
+  concat     {$x $y concat}         2 2   {list {*}$xl {*}$yl}
+  cos        {$x cos}               1 1   {lmap a $xl {expr {cos($a)}}}
+  count      {$x count}             1 1   -
+  cross3     {$p $p cross3}         2 1   -
+  cumprod    {$x cumprod}           1 1   {set s 1.0; lmap a $xl {set s [expr {$s * $a}]}}
+  cumsum     {$x cumsum}            1 1   {set s 0.0; lmap a $xl {set s [expr {$s + $a}]}}
+  diff       {$x diff}              1 1   {lmap a [lrange $xl 1 end] b [lrange $xl 0 end-1] {expr {$a - $b}}}
+  div        {$x $y div}            2 1   {lmap a $xl b $yl {expr {$a / $b}}}
+  dot        {$x $y dot}            2 0   {set s 0.0; foreach a $xl b $yl {set s [expr {$s + $a * $b}]}; set s}
+  dot3       {$p $p dot3}           2 0.33 -
+  dup        {$x dup}               1 1   -
+  exp        {$x exp}               1 1   {lmap a $xl {expr {exp($a)}}}
+  f32        {$x f32}               1 0.5 -
+  f64        {$x f64}               1 1   -
+  floor      {$x floor}             1 1   {lmap a $xl {expr {floor($a)}}}
+  height     {height}               0 0   -
+  i64        {$x i64}               1 1   -
+  log        {$x log}               1 1   {lmap a $xl {expr {log($a)}}}
+  matmult    {$m $m $k matmult}     2 1   {
+    set r {}
+    for { set i 0 } { $i < $k } { incr i } {
+      for { set j 0 } { $j < $k } { incr j } {
+        set s 0.0
+        for { set l 0 } { $l < $k } { incr l } {
+          set s [expr {$s + [lindex $ml [expr {$i * $k + $l}]] * [lindex $ml [expr {$l * $k + $j}]]}]
+        }
+        lappend r $s
+      }
+    }
+    set r
+  }
+  max        {$x max}               1 0   {set s -Inf; foreach a $xl {if {$a > $s} {set s $a}}; set s}
+  mean       {$x mean}              1 0   {set s 0.0; foreach a $xl {set s [expr {$s + $a}]}; expr {$s / [llength $xl]}}
+  median     {$x median}            1 0   {lindex [lsort -real $xl] [expr {[llength $xl] / 2}]}
+  min        {$x min}               1 0   {set s Inf; foreach a $xl {if {$a < $s} {set s $a}}; set s}
+  min_ew     {$m $k min_ew}         1 0   {
+    set r [lrange $ml 0 [expr {$k - 1}]]
+    for { set i 1 } { $i < $k } { incr i } {
+      for { set j 0 } { $j < $k } { incr j } {
+        set a [lindex $ml [expr {$i * $k + $j}]]
+        if { $a < [lindex $r $j] } { lset r $j $a }
+      }
+    }
+    set r
+  }
+  mult       {$x $y mult}           2 1   {lmap a $xl b $yl {expr {$a * $b}}}
+  neighbors3 {$p $p 0 $c neighbors3} 2 0.33 -
+  norm3      {$p norm3}             1 0.33 -
+  normalize3 {$p normalize3}        1 1   -
+  pairhist3  {$p $p 0 $c 100 pairhist3} 2 0 -
+  pairs3     {$p $p 0 $c pairs3}    2 0   -
+  percentile {$x {10 50 90} percentile} 1 0 -
+  pi         {pi}                   0 0   {expr {acos(-1)}}
+  pop        {$x $y pop}            2 1   -
+  recall     {$x store recall}      1 2   -
+  round      {$x round}             1 1   {lmap a $xl {expr {round($a)}}}
+  row        {$m $k 1 row sum}      1 0   -
+  selfneighbors3 {$p 0 $c selfneighbors3} 1 0.33 -
+  selfpairhist3 {$p 0 $c 100 selfpairhist3} 1 0 -
+  selfpairs3 {$p 0 $c selfpairs3}   1 0   -
+  sin        {$x sin}               1 1   {lmap a $xl {expr {sin($a)}}}
+  slice      {$x 1 1 slice}         1 0   -
+  sort       {$x sort}              1 1   {lsort -real $xl}
+  sq         {$x sq}                1 1   {lmap a $xl {expr {$a * $a}}}
+  sqrt       {$x sqrt}              1 1   {lmap a $xl {expr {sqrt($a)}}}
+  stats      {$x stats}             1 0   -
+  store      {$x store}             1 1   -
+  stride     {$p 1 3 stride sum}    1 0   -
+  sub        {$x $y sub}            2 1   {lmap a $xl b $yl {expr {$a - $b}}}
+  sum        {$x sum}               1 0   {set s 0.0; foreach a $xl {set s [expr {$s + $a}]}; set s}
+  swap       {$x $y swap}           2 1   -
+  tan        {$x tan}               1 1   {lmap a $xl {expr {tan($a)}}}
+  transform3 {$p {0 1 0 -1 0 0 0 0 1} {1 2 3} transform3} 1 1 -
+  transp     {$m $k transp}         1 1   {
+    set r {}
+    for { set j 0 } { $j < $k } { incr j } {
+      for { set i 0 } { $i < $k } { incr i } {
+        lappend r [lindex $ml [expr {$i * $k + $j}]]
+      }
+    }
+    set r
+  }
+  unique     {$x unique}            1 1   {lsort -real -unique $xl}
+  wbinnd     {$x $x 0 0.01 100 wbinnd} 2 0  -
+  wmax       {$x 10 wmax}           1 1   {
+    set r {}
+    for { set i 0 } { $i + 10 <= [llength $xl] } { incr i } {
+      lappend r [tcl::mathfunc::max {*}[lrange $xl $i [expr {$i + 9}]]]
+    }
+    set r
+  }
+  wmean      {$x 10 wmean}          1 1   -
+  wmin       {$x 10 wmin}           1 1   -
+  wsum       {$x 10 wsum}           1 1   {
+    set r {}
+    for { set i 0 } { $i + 10 <= [llength $xl] } { incr i } {
+      set s 0.0
+      foreach a [lrange $xl $i [expr {$i + 9}]] {set s [expr {$s + $a}]}
+      lappend r $s
+    }
+    set r
+  }
+}
+
+foreach { op template nin nout loop } $operators {
+  if { $loop ne "-" } {
+    proc loop_$op { xl yl ml k } $loop
+  }
+}
+
+# Data: 10^4 random numbers in (0.01, 1], larger sizes repeat them
+expr {srand(1)}
+set seed_x [lmap i [lrepeat 10000 0] {expr {0.01 + 0.99 * rand()}}]
+set seed_y [lmap i [lrepeat 10000 0] {expr {0.01 + 0.99 * rand()}}]
+
+# Vector of n elements (a power of 10) made of copies of the seed
+proc make_vector { seed n } {
+  if { $n <= [llength $seed] } {
+    return [vecexpr [lrange $seed 0 [expr {$n - 1}]]]
+  }
+  set p [make_vector $seed [expr {$n / 10}]]
+  return [vecexpr $p dup concat dup concat dup concat $p concat $p concat]
+}
+
+# Call "command ?arg ...? calls" with more and more calls, until they take
+# -mintime ms; returns {calls ns_per_call}
+proc measure { args } {
+  global opt
+  {*}$args 1
+  set calls 1
+  while 1 {
+    set ns [{*}$args $calls]
+    if { $ns * $calls >= 1e6 * $opt(-mintime) } {
+      return [list $calls $ns]
+    }
+    set calls [expr {$calls * 4}]
+  }
+}
+
+# Time calls of vecexpr with the given words; returns ns per call
+proc time_vecexpr { words calls } {
+  if { [info exists ::bench::harness] } {
+    return [bench::run [list vecexpr {*}$words] $calls]
+  }
+  return [expr {[lindex [time {vecexpr {*}$words} $calls] 0] * 1000.0}]
+}
+
+# Time calls of the expr loop of op (proc loop_$op)
+proc time_loop { op calls } {
+  global xl yl ml k
+  return [expr {[lindex [time {loop_$op $xl $yl $ml $k} $calls] 0] * 1000.0}]
+}
+
+proc report { op size impl calls ns bytes } {
+  global out
+  set per [expr {$size > 0 ? $ns / $size : $ns}]
+  puts $out [format "%s,%d,%s,%d,%.1f,%.4f,%.3f" $op $size $impl $calls $ns $per [expr {$bytes / $ns}]]
+  flush $out
+}
+
+puts $out "operator,size,impl,calls,ns_per_call,ns_per_element,gb_per_s"
+for { set n [expr {int($opt(-min))}] } { $n <= $opt(-max) } { set n [expr {$n * 10}] } {
+  set x [make_vector $seed_x $n]
+  set y [make_vector $seed_y $n]
+  set k [expr {int(sqrt($n))}]
+  set kk [expr {$k * $k}]
+  set n3 [expr {$n / 3 * 3}]
+  set c [expr {$n3 >= 3 ? 1.5 * pow($n3 / 3.0, -1 / 3.0) : 1}]
+  vecexpr $x >file:f64:$tmpfile
+  set xl {}
+  if { $n <= $opt(-exprmax) } {
+    # Plain lists, built apart so that x y m keep their native arrays
+    set xl [lrepeat [expr {$n / min($n, 10000)}] {*}[lrange $seed_x 0 [expr {min($n, 10000) - 1}]]]
+    set yl [lrepeat [expr {$n / min($n, 10000)}] {*}[lrange $seed_y 0 [expr {min($n, 10000) - 1}]]]
+    set ml [lrange $xl 0 [expr {$kk - 1}]]
+  }
+  foreach { op template nin nout loop } $operators {
+    if { $opt(-ops) ne "" && $op ni $opt(-ops) } continue
+    set size [expr {[string match {*$[xy]*} $template] || [string match "<*" $op] ? $n
+                    : [string match {*$m*} $template] ? $kk : [string match {*$p*} $template] ? $n3 : 0}]
+    if { $size == 0 && $n > $opt(-min) } continue
+    if { $op in {matmult transp min_ew} && $k < 1 } continue
+    # Element 1 of x, line 1 of a k x k matrix
+    if { $op eq "slice" && $n < 2 || $op in {row col} && $k < 2 } continue
+    # Windows of 10 elements, differences of neighbours
+    if { $op in {blockavg wmax wmean wmin wsum} && $n < 10 || $op eq "diff" && $n < 2 } continue
+    if { [string match {*$p*} $template] && $n3 < 3 } continue
+    # The matrix and the 3-vectors only live while they are used, to leave room for 10^8
+    if { [string match {*$m*} $template] } {
+      set m [vecexpr <file:f64,0,$kk:$tmpfile]
+    }
+    if { [string match {*$p*} $template] } {
+      set p [vecexpr <file:f64,0,$n3:$tmpfile]
+    }
+    # Words naming a variable are replaced by its value itself: [subst] would
+    # return a copy as a string, parsed by vecexpr on every call, and [expr]
+    # would make one to check whether the vector is a number
+    set words [lmap w $template {
+      if { [string match {$?} $w] } { set [string index $w 1] } else { subst $w }
+    }]
+    lassign [measure time_vecexpr $words] calls ns
+    report $op $size vecexpr $calls $ns [expr {8.0 * ($nin + $nout) * $size}]
+    unset -nocomplain m p words
+    if { $loop eq "-" || $xl eq "" } continue
+    if { $op eq "matmult" && $k * $kk > $opt(-exprmax) } continue
+    lassign [measure time_loop $op] calls ns
+    report $op $size expr $calls $ns [expr {8.0 * ($nin + $nout) * $size}]
+  }
+  unset x y
+}
+file delete $tmpfile
+if { $out ne "stdout" } {
+  close $out
+}
@@ -0,0 +1,84 @@
+#!/bin/tclsh
+
+# Per-call overhead of vecexpr for short programs on small vectors.
+#
+# usage: tclsh bench/overhead.tcl ?library? ?iterations?
+#
+# Each program is timed twice:
+#  - "uncached": the operator words are rebuilt from strings on every call,
+#    so they must be parsed and looked up each time (the cost before
+#    programs were compiled and cached)
+#  - "cached": the same words as script literals, compiled once
+# To compare two builds, run the script once with each library.
+
+set lib [expr {[llength $argv] > 0 ? [lindex $argv 0] : "./vecexpr.so"}]
+set iter [expr {[llength $argv] > 1 ? [lindex $argv 1] : 200000}]
+
+load $lib Vecexpr
+
+set x {1 2 3 5}
+set y {0 1 2 3}
+set z {9 8 7 6}
+
+proc uncached { args } {
+  # Fresh, unshared Tcl_Objs with no internal rep
+  set words {}
+  foreach w $args { lappend words [string range "$w " 0 end-1] }
+  return $words
+}
+
+proc bench { label script } {
+  global iter
+  set t [lindex [uplevel 1 [list time $script $iter]] 0]
+  puts [format "%-40s %8.3f us/call" $label $t]
+}
+
+puts "library: $lib, $iter iterations"
+
+bench "x y sub (uncached)" {
+  vecexpr $x $y {*}[uncached sub]
+}
+bench "x y sub (cached)" {
+  vecexpr $x $y sub
+}
+
+bench "test.tcl program (uncached)" {
+  vecexpr $x $y {*}[uncached sub store] $z 0.5 {*}[uncached mult recall add dup mult]
+}
+bench "test.tcl program (cached)" {
+  vecexpr $x $y sub store $z 0.5 mult recall add dup mult
+}
+# Multi-operator arguments are not supported by older builds
+if { ![catch { vecexpr $x $y {sub store} }] } {
+  bench "test.tcl program (cached, grouped)" {
+    vecexpr $x $y {sub store} $z 0.5 {mult recall add dup mult}
+  }
+}
+
+# A batch of 100 vectors, per vector; not supported by older builds
+set batch [lrepeat 100 $x]
+if { ![catch { vecexpr -map $batch sum }] } {
+  proc per_item { label script } {
+    global iter
+    set t [lindex [uplevel 1 [list time $script [expr {$iter / 100}]]] 0]
+    puts [format "%-40s %8.3f us/call" $label [expr {$t / 100.0}]]
+  }
+  per_item "x y sub sq sum (loop of 100)" {
+    foreach v $batch { vecexpr $v $y sub sq sum }
+  }
+  per_item "x y sub sq sum (-map of 100)" {
+    vecexpr -map $batch $y sub sq sum
+  }
+}
+
+bench "scalar pi 180 div (uncached)" {
+  vecexpr {*}[uncached pi 180 div]
+}
+bench "scalar pi 180 div (cached)" {
+  vecexpr pi 180 div
+}
+
+# Cost of building the fresh words alone, included in the uncached timings
+bench "word construction only" {
+  uncached sub store mult recall add dup mult
+}
@@ -0,0 +1,57 @@
+#!/bin/tclsh
+
+# Scaling of vecexpr with the number of threads, on large vectors.
+#
+# usage: tclsh bench/threads.tcl ?library? ?size? ?maxthreads?
+#
+# Each program is timed with 1, 2, 4 ... maxthreads threads (default: up to
+# 8). The speedup is relative to the single-threaded time, and cannot
+# exceed the number of cores available.
+
+set lib [expr {[llength $argv] > 0 ? [lindex $argv 0] : "./vecexpr.so"}]
+set n [expr {[llength $argv] > 1 ? [lindex $argv 1] : 4000000}]
+set maxthreads [expr {[llength $argv] > 2 ? [lindex $argv 2] : 8}]
+
+load $lib Vecexpr
+
+expr {srand(1)}
+set x {}
+for { set i 0 } { $i < $n } { incr i } { lappend x [expr {rand() * 10.0 - 5.0}] }
+# Convert once, so that parsing the list is not timed
+set x [vecexpr $x]
+
+# Square matrix of about n / 8 elements
+set dim [expr {int(sqrt($n / 8))}]
+set m [lrange $x 0 [expr {$dim * $dim - 1}]]
+set m [vecexpr $m]
+
+proc bench { label script } {
+  global maxthreads
+  set ref 0
+  for { set t 1 } { $t <= $maxthreads } { set t [expr {$t * 2}] } {
+    vecexpr::configure -threads $t
+    uplevel 1 $script
+    set us [lindex [uplevel 1 [list time $script 5]] 0]
+    if { $t == 1 } { set ref $us }
+    puts [format "%-28s %2d threads %10.1f ms  speedup %5.2f" $label $t [expr {$us / 1000.0}] [expr {$ref / $us}]]
+  }
+  vecexpr::configure -threads 1
+}
+
+puts "library: $lib, $n elements, isa [set vecexpr::isa]"
+
+bench "exp" {
+  vecexpr $x exp
+}
+bench "sin 2 mult 1 add sqrt" {
+  vecexpr $x sin 2 mult 1 add sqrt
+}
+bench "exp sum" {
+  vecexpr $x exp sum
+}
+bench "bin (100 bins)" {
+  vecexpr $x -5 0.1 100 bin
+}
+bench "matmult ${dim}x${dim}" {
+  vecexpr $m $m $dim matmult
+}
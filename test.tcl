@@ -11,8 +11,12 @@ proc test { cmd } {
 }
 
 test "{1 2 3 5} {0 1 2 3} sub store {9 8 7 6} 0.5 mult recall add dup mult"
+test "-decimals 3 {1 2 3 5} 3 div {0.1 -0.2 1e-5 2.5e20 .5} concat"
 
 test "pi { 1 2 } mult { 1 0 0 1 } 2 matmult"
+test "{1 2 3 4} {5 6 7 8} 2 matmult height"
+puts "running: vecexpr {1 2 3 4} {5 6 7 8} 4294967298 matmult"
+puts "-> [catch {vecexpr {1 2 3 4} {5 6 7 8} 4294967298 matmult} msg] $msg"
 
 test "pi { 1 1 1 1 1 1 1 1 1 1 } mult {12. 54 21 23 -23.12} concat dup pop pop"
 
@@ -24,6 +28,115 @@ test "{0 23 -4 5 2 8} 2 min_ew"
 
 test "{1 2 3 4 5 6} 2 transp"
 test "{1 2 3 4 5 6} 3 transp"
+test "{1 2 3 4 5 6 7 8 9} 3 transp"
+
+test "{1 2 3 5} {0 1 2 3} sub sq {2 2 2 2} mult sqrt 0.5 add sum"
+test "-threads 2 {1 2 3 5} {0 1 2 3} sub sq {2 2 2 2} mult sqrt 0.5 add sum"
+test "-map {{1 2 3} {4 5 6}} {1 0 1} sub sq sum"
+test "-threads 2 -map {{1 2 3} {4 5 6}} -matrix 2 mult"
+
+# Vectors of several tasks (32768 elements each) are split between threads,
+# and with no threshold so are -map batches of small items: the results
+# should not depend on the number of threads
+proc test_threads { cmd } {
+  puts "running: vecexpr $cmd (1 and 4 threads)"
+  set one [uplevel #0 [list vecexpr -threads 1 {*}$cmd]]
+  set four [uplevel #0 [list vecexpr -threads 4 {*}$cmd]]
+  puts "-> $one[expr {$one eq $four ? {} : " but with 4 threads: $four"}]"
+}
+set xs {}; set ys {}
+for {set i 0} {$i < 100000} {incr i} {
+  lappend xs [expr {$i * 7919 % 1000 / 8.0 - 60}]
+  lappend ys [expr {$i * 104729 % 997 / 16.0}]
+}
+set xs [vecexpr $xs]; set ys [vecexpr $ys]
+vecexpr::configure -threshold 0
+test_threads "<xs <ys sub sq 2 mult sqrt 0.5 add sum"
+test_threads "<xs f32 3 mult 1 add dup mult max"
+test_threads "<ys 0 8 8 bin"
+test_threads "<xs {-60 -60} 32 {4 4} binnd"
+test_threads "<xs cumsum 0 49999 stride <xs 7 wmax max swap pop concat"
+test_threads "<xs i64 diff 3 wsum 0 33333 stride"
+test_threads "<ys {10 50 90} percentile"
+set big {9007199254740993 1}
+test_threads [list -map {{1 2} {3 4} {5 6}} i64 $big i64 add]
+puts "running: vecexpr \$big i64 (after the batch)"
+puts "-> [vecexpr $big i64]"
+test_threads "-map {{1 2 3} {4 5 6} {7 8 9} {10 11 12}} -matrix dup mult {1 0 1} add"
+# 200 x 48 and 48 x 48 integer matrices: large enough for the packed product
+# on several threads, and exact whatever the blocking
+set ma {}; set mb {}
+for {set i 0} {$i < 9600} {incr i} { lappend ma [expr {$i % 7 - 3}] }
+for {set i 0} {$i < 2304} {incr i} { lappend mb [expr {$i % 5 - 2}] }
+test_threads "<ma <mb 48 matmult dup sum swap 1000 1 slice concat"
+vecexpr::configure -threshold 65536
+
+# Commands on 4096 elements or more are checked before they run: the error
+# comes before >early is set
+set long [lrepeat 5000 1]
+puts "running: vecexpr \$long 2 mult dup >early {1 2 3} add"
+puts "-> [catch {vecexpr $long 2 mult dup >early {1 2 3} add} msg] $msg, early set: [info exists early]"
+
+proc async_done { status result } { set ::async_result "$status $result" }
+puts "running: vecexpr -async async_done {1 2 3} dup mult >async_sq <async_sq {1 1 1} dot"
+vecexpr -async async_done {1 2 3} dup mult >async_sq <async_sq {1 1 1} dot
+vwait async_result
+puts "-> $async_result, async_sq $async_sq"
+
+vecexpr {1 2 3 5} store pi recall mult dup sum concat
+vecexpr::buffers -reset
+vecexpr {1 2 3 5} store pi recall mult dup sum concat
+puts "buffers after a repeated call: [vecexpr::buffers]"
+
+vecexpr::stats -enable 1 -reset
+vecexpr {1 2 3 5} {0 1 2 3} sub sq sum pop 2 transp
+puts "calls profiled: [dict map {name entry} [vecexpr::stats -enable 0] {dict get $entry calls}]"
+vecexpr::stats -enable 1 -reset
+vecexpr {1 2 3} pi 180 div mult
+puts "calls profiled, with 180 folded: [dict map {name entry} [vecexpr::stats -enable 0] {dict get $entry calls}]"
+
+test "{1.5 2.5 3.5} f32 2 mult {1 2 3} i64 swap f64 concat"
+test "{4611686018427387904 -3} i64 2 i64 mult"
+test "{9007199254740993 -1.5} i64"
+test "{1 2} i64 2 mult"
+test "{1 2 3} i64 {4 5 6} i64 dot"
+
+test "{3 4 0 1 0 0} norm3 {1 0 0 0 1 0} {0 0 1} cross3 concat"
+test "{0 0 0 2 0 0} {1 3} com3 {1 0 0 0 1 0} {0 -1 0 1 0 0 0 0 1} 10 transform3 dot3"
+
+test "{0 0 0 1 0 0 9.5 0 0} 10 1.2 selfpairs3"
+test "{0 0 0 1 0 0 9.5 0 0} dup 10 1.2 pairs3"
+test "{0 0 0 1 0 0 9.5 0 0} {0 0.5 0} 0 1.2 neighbors3"
+test "{0 0 0 1 0 0 9.5 0 0} {10 10 10} 2 4 selfpairhist3"
+
+test "{1 2 3} store:a 2 mult store:b pop recall:a recall:b dup mult add"
+test "{1 2 3} store:a pop recall:a {pi 180 div mult dup pop} recall:a {swap swap} add"
+test "{1 2 3 4 5 6} 0 3 stride sum {1 2 3 4 5 6} 2 1 col 2 mult concat"
+test "{1 2 3 4 5 6} 1 4 slice 1 2 stride {1 2 3 4 5 6} 3 0 row add"
+test "{2 4 4 4 5 5 7 9} stats"
+test "-map {{Inf 1} {1e308 1e308} {-1e308 -1e308}} sum swap pop"
+test "{Inf 1} stats swap pop {Inf 1} {1 1} dot concat"
+test "{3 1 4 1 5 9 2 6} dup {25 50 75} percentile swap argsort concat"
+test "{3 1 4 1 5} i64 dup unique swap count concat"
+test "{3 1 4 1 5 9 2 6} dup cumsum swap 3 wmax concat {1 2 4 7 11 16} i64 diff 2 wsum concat"
+test "{0.5 0.5 1.5 0.5 1.5 1.2 3 0} {0 0} 1 {2 2} binnd"
+test "{0.5 0.5 1.5 0.5 1.5 1.2} {0.2 0.3 0.5} {0 0} 1 {2 2} wbinnd"
+
+test "{1 2 3 4 5 6} >file:npy:vecexpr_test.npy <file:npy,1,2,3:vecexpr_test.npy"
+test "{1 2 3 4 5 6} >file:f32:vecexpr_test.f32 <file:f32:vecexpr_test.f32 sum"
+test "-chunk 4 <file:f32:vecexpr_test.f32 dup mult sum swap pop <file:npy:vecexpr_test.npy 0 2 3 bin"
+test "-chunk 4 <file:f32:vecexpr_test.f32 stats"
+puts "running: vecexpr -chunk 4 <file:f32:vecexpr_test.f32 2 mult >file:f32:vecexpr_test.f32"
+puts "-> [catch {vecexpr -chunk 4 <file:f32:vecexpr_test.f32 2 mult >file:f32:vecexpr_test.f32} msg] $msg"
+test "<file:f32:vecexpr_test.f32"
+# The input shrinks while it is streamed (when <shrink is read, in the first chunk)
+set shrink 0
+trace add variable shrink read { apply {args { set c [open vecexpr_test.f32 r+]; chan truncate $c 8; close $c }} }
+puts "running: vecexpr -chunk 1 <file:f32:vecexpr_test.f32 <shrink pop <file:f32:vecexpr_test.f32 add sum"
+puts "-> [catch {vecexpr -chunk 1 <file:f32:vecexpr_test.f32 <shrink pop <file:f32:vecexpr_test.f32 add sum} msg] $msg"
+file delete vecexpr_test.npy vecexpr_test.f32
+set packed [binary format R* {1 2 3 4 5 6}]
+test "<bytes:f32be,1,,2:::packed 10 mult >bytes:i32:::packed <bytes:i32:::packed"
 
 if { $test_errors } {
   puts [vecexpr 1 2 asd]
@@ -0,0 +1,89 @@
+#!/bin/tclsh
+
+# Accuracy of the vectorized math kernels, in ulp, against Tcl's expr (libm).
+# Each kernel is run for every instruction set the CPU supports, over a
+# sweep of its input domain. Exits with an error if a bound is exceeded.
+
+set npoints 20000
+
+# kernel  domain (min max log-scale)  bound (ulp)
+set kernels {
+  exp    {-745 709.7 0}   1
+  exp    {-1 1 0}         1
+  log    {-320 308 1}     1
+  log    {0.5 2 0}        1
+  sqrt   {-320 308 1}     0
+  sin    {-10 10 0}       1
+  sin    {-1e5 1e5 0}     2
+  sin    {-1e9 1e9 0}     2
+  cos    {-10 10 0}       1
+  cos    {-1e5 1e5 0}     2
+  tan    {-10 10 0}       4
+  tan    {-1e5 1e5 0}     4
+  atan2  {-100 100 0}     2
+  atan2  {-300 300 1}     2
+}
+
+# Order doubles as integers, so that consecutive doubles differ by one
+proc ordered { x } {
+  binary scan [binary format q $x] w bits
+  if { $bits < 0 } { set bits [expr {-($bits & 0x7fffffffffffffff)}] }
+  return $bits
+}
+
+proc ulp { a b } {
+  if { $a == $b } { return 0 }
+  return [expr {abs([ordered $a] - [ordered $b])}]
+}
+
+proc sample { min max logscale } {
+  global npoints
+  set l {}
+  for { set i 0 } { $i < $npoints } { incr i } {
+    set x [expr {$min + rand() * ($max - $min)}]
+    if { $logscale } { set x [expr {10.0 ** $x}] }
+    lappend l $x
+  }
+  return $l
+}
+
+set failed 0
+foreach isa { sse2 avx2 avx512 } {
+  set env(VECEXPR_ISA) $isa
+  set i [interp create]
+  $i eval [list load [file normalize ./vecexpr.so] Vecexpr]
+  if { [$i eval set vecexpr::isa] ne $isa } {
+    puts "$isa: not supported by this CPU, skipped"
+    interp delete $i
+    continue
+  }
+  expr {srand(1)}
+  foreach { f domain bound } $kernels {
+    set x [sample {*}$domain]
+    if { $f eq "atan2" } {
+      set y [sample {*}$domain]
+      set res [$i eval [list vecexpr $y $x atan2]]
+      set ref [lmap a $y b $x { expr {atan2($a, $b)} }]
+    } else {
+      set res [$i eval [list vecexpr $x $f]]
+      set ref [lmap a $x { expr "$f\($a)" }]
+    }
+    set max 0
+    foreach r $res e $ref {
+      set u [ulp $r $e]
+      if { $u > $max } { set max $u }
+    }
+    set status ok
+    if { $max > $bound } {
+      set status FAILED
+      incr failed
+    }
+    puts [format "%-7s %-6s %-24s max %d ulp (bound %d) %s" $isa $f $domain $max $bound $status]
+  }
+  interp delete $i
+}
+unset env(VECEXPR_ISA)
+
+if { $failed } {
+  error "$failed kernel accuracy checks failed"
+}
@@ -1,8 +1,24 @@
 #include <tcl.h>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cfloat>
+#include <climits>
+#include <limits>
 #include <cmath>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 extern "C" {
 int Vecexpr_Init(Tcl_Interp *interp);
@@ -10,670 +26,7998 @@ int Vecexpr_Init(Tcl_Interp *interp);
 static int obj_vecexpr(ClientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[]);
 
 // A simple-minded, vector-based pocket calculator for Tcl.
-// There is a FIFO stack, plus an extra register (used via store and recall)
+// There is a FIFO stack, plus registers (used via store and recall, or
+// store:name and recall:name for named ones)
 // Arguments: vectors, scalars, builtin function names
 
-// TODO: norm (normalize), asin acos atan, cross (3-vectors), range (unary, creates sequence to given int)
+// TODO: asin acos atan, range (unary, creates sequence to given int)
 
 // Available functions:
 // nullary: pi (constant), height (current stack height, for debugging), <varName (push Tcl var - can be done with $var as well)
-// recall (after calling store)
-// Unary: abs cos sin exp floor log mean min max pow pi sq sqrt sum >varName (pop into Tcl var)
-// also unary: store (recall is 0-ary); dup (duplicate in the stack), pop
+// recall recall:name (after calling store store:name)
+// <file:type:path (push a binary file, see read_file)
+// Unary: abs cos sin exp floor log mean min max pow pi sq sqrt sum stats >varName (pop into Tcl var)
+// >file:type:path (pop into a binary file)
+// also unary: store store:name (recall is 0-ary); dup (duplicate in the stack), pop
+// (dup store recall copy nothing until the data are written, see ItemType)
+// f64 f32 i64 (convert the element type, see VecType)
 // Binary: add sub mult dot div concat swap (*)
 // (*) all binary functions except dot accept mixed scalar/vector operands
 // vector lengths must match except for concat and swap
+// 3-vectors (packed x y z, see XyzJob): unary norm3 normalize3, binary cross3
+// dot3 com3, ternary transform3
+// Views (no copy, see ItemType): vector first count slice, vector first step
+// stride, matrix nlines i row, matrix nlines j col
+// Pairs of points closer than a cutoff (see CellGrid): points1 points2 box
+// cutoff neighbors3 / pairs3, points1 points2 box cutoff nbins pairhist3
+// Histograms: data min dx nbins bin; samples min dx nbins binnd (N-D, see BinJob);
+// samples weights min dx nbins wbinnd
+// Order statistics (see SortJob): unary sort argsort unique count, median
+// (like mean), data percents percentile (data kept, percents replaced)
 
 // Matrix multiplication: matrices are unrolled in row-major order
-// the common dimension is pushed on the stack last:
+// the common dimension is pushed on the stack last, and both matrices are
+// replaced by their product:
 // vecexpr "1 0 0 1" "1 2" 2 matmult   gives  "1.0 2.0"
 // vecexpr "1 0 0 1" "1 2" 1 matmult   gives  "1.0 2.0 0.0 0.0 0.0 0.0 1.0 2.0"
 
-static int obj_vecexpr(ClientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+// Compiled programs
+// Any argument that is not data (i.e. whose first list element is not a number)
+// is compiled once into an array of opcodes, which is cached as the internal
+// representation of the Tcl_Obj (see program_type below). Literal arguments in
+// a Tcl script keep their internal rep between calls, so repeated calls skip
+// both the list parsing and the keyword lookup.
+// An argument may hold several operators, and scalar constants after the first
+// operator, e.g.  vecexpr $x $y {sub sq} $z {mult 0.5 mult sqrt}
+
+// Vector objects
+// Results (final result, >varName and &varName) are returned as Tcl_Objs of
+// type "vecexpr vector", which hold a contiguous array of doubles. The string
+// (and hence list) rep is only generated when Tcl needs it, so feeding a
+// result back into vecexpr copies the array without any per-element Tcl_Obj.
+
+enum Opcode {
+  OP_SCALAR,      // push constant scalar (operand: value)
+  OP_PI,
+  OP_HEIGHT,
+  OP_RECALL,
+  OP_PUSH_VAR,    // <varName (operand: name)
+  OP_POP_VAR,     // >varName
+  OP_POP_INT_VAR, // &varName
+  OP_READ_FILE,   // <file:type:path (operands: name, file)
+  OP_WRITE_FILE,  // >file:type:path
+  OP_READ_BYTES,  // <bytes:type:varName (operands: name, file)
+  OP_WRITE_BYTES, // >bytes:type:varName
+  OP_ABS,
+  OP_COS,
+  OP_SIN,
+  OP_TAN,
+  OP_EXP,
+  OP_LOG,
+  OP_MEAN,
+  OP_MIN,
+  OP_MAX,
+  OP_SUM,
+  OP_STATS,
+  OP_MEDIAN,
+  OP_FLOOR,
+  OP_ROUND,
+  OP_SQ,
+  OP_SQRT,
+  OP_NORM3,       // 3-vectors (see XyzJob)
+  OP_NORMALIZE3,
+  OP_SORT,        // sorting (see SortJob)
+  OP_ARGSORT,
+  OP_UNIQUE,
+  OP_COUNT,
+  OP_CUMSUM,      // scans and sliding windows (see ScanJob and WindowJob)
+  OP_CUMPROD,
+  OP_DIFF,
+  OP_DUP,
+  OP_POP,
+  OP_STORE,
+  OP_F64,         // conversions (see VecType)
+  OP_F32,
+  OP_I64,
+  OP_CONCAT,
+  OP_SWAP,
+  OP_ADD,
+  OP_DIV,
+  OP_DOT,
+  OP_MIN_EW,
+  OP_MULT,
+  OP_SUB,
+  OP_ATAN2,
+  OP_CROSS3,
+  OP_DOT3,
+  OP_COM3,
+  OP_PERCENTILE,
+  OP_BLOCKAVG,
+  OP_WSUM,
+  OP_WMEAN,
+  OP_WMIN,
+  OP_WMAX,
+  OP_TRANSP,
+  OP_MATMULT,
+  OP_TRANSFORM3,
+  OP_SLICE,       // views (see ItemType)
+  OP_STRIDE,
+  OP_ROW,
+  OP_COL,
+  OP_NEIGHBORS3,  // pair search (see CellGrid)
+  OP_PAIRS3,
+  OP_SELFNEIGHBORS3,
+  OP_SELFPAIRS3,
+  OP_BIN,
+  OP_BINND,
+  OP_WBINND,
+  OP_PAIRHIST3,
+  OP_SELFPAIRHIST3,
+  OP_NUM          // number of opcodes
+};
+
+// Operator table: keyword, opcode, number of operands used, and change in stack height
+struct OpInfo {
+  const char *name;
+  Opcode      op;
+  int         arity;
+  int         change;
+};
+
+static const OpInfo op_table[] = {
+  { "pi",      OP_PI,      0, +1 },
+  { "height",  OP_HEIGHT,  0, +1 },
+  { "recall",  OP_RECALL,  0, +1 },
+  { "abs",     OP_ABS,     1,  0 },
+  { "cos",     OP_COS,     1,  0 },
+  { "sin",     OP_SIN,     1,  0 },
+  { "tan",     OP_TAN,     1,  0 },
+  { "exp",     OP_EXP,     1,  0 },
+  { "log",     OP_LOG,     1,  0 },
+  { "mean",    OP_MEAN,    1, +1 },
+  { "min",     OP_MIN,     1, +1 },
+  { "max",     OP_MAX,     1, +1 },
+  { "sum",     OP_SUM,     1, +1 },
+  { "stats",   OP_STATS,   1, +1 },
+  { "median",  OP_MEDIAN,  1, +1 },
+  { "floor",   OP_FLOOR,   1,  0 },
+  { "round",   OP_ROUND,   1,  0 },
+  { "sq",      OP_SQ,      1,  0 },
+  { "sqrt",    OP_SQRT,    1,  0 },
+  { "norm3",   OP_NORM3,   1,  0 },
+  { "normalize3", OP_NORMALIZE3, 1, 0 },
+  { "sort",    OP_SORT,    1,  0 },
+  { "argsort", OP_ARGSORT, 1,  0 },
+  { "unique",  OP_UNIQUE,  1,  0 },
+  { "count",   OP_COUNT,   1,  0 },
+  { "cumsum",  OP_CUMSUM,  1,  0 },
+  { "cumprod", OP_CUMPROD, 1,  0 },
+  { "diff",    OP_DIFF,    1,  0 },
+  { "dup",     OP_DUP,     1, +1 },
+  { "pop",     OP_POP,     1, -1 },
+  { "store",   OP_STORE,   1,  0 },
+  { "f64",     OP_F64,     1,  0 },
+  { "f32",     OP_F32,     1,  0 },
+  { "i64",     OP_I64,     1,  0 },
+  { "concat",  OP_CONCAT,  2, -1 },
+  { "swap",    OP_SWAP,    2,  0 },
+  { "add",     OP_ADD,     2, -1 },
+  { "div",     OP_DIV,     2, -1 },
+  { "dot",     OP_DOT,     2, -1 },
+  { "min_ew",  OP_MIN_EW,  2, -1 },
+  { "mult",    OP_MULT,    2, -1 },
+  { "sub",     OP_SUB,     2, -1 },
+  { "atan2",   OP_ATAN2,   2, -1 },
+  { "cross3",  OP_CROSS3,  2, -1 },
+  { "dot3",    OP_DOT3,    2, -1 },
+  { "com3",    OP_COM3,    2, -1 },
+  { "percentile", OP_PERCENTILE, 2, 0 },
+  { "blockavg", OP_BLOCKAVG, 2, -1 },
+  { "wsum",    OP_WSUM,    2, -1 },
+  { "wmean",   OP_WMEAN,   2, -1 },
+  { "wmin",    OP_WMIN,    2, -1 },
+  { "wmax",    OP_WMAX,    2, -1 },
+  { "transp",  OP_TRANSP,  2, -1 },
+  { "matmult", OP_MATMULT, 3, -2 },
+  { "transform3", OP_TRANSFORM3, 3, -2 },
+  { "slice",   OP_SLICE,   3, -2 },
+  { "stride",  OP_STRIDE,  3, -2 },
+  { "row",     OP_ROW,     3, -2 },
+  { "col",     OP_COL,     3, -2 },
+  { "neighbors3", OP_NEIGHBORS3, 4, -3 },
+  { "pairs3",  OP_PAIRS3,  4, -3 },
+  { "selfneighbors3", OP_SELFNEIGHBORS3, 3, -2 },
+  { "selfpairs3", OP_SELFPAIRS3, 3, -2 },
+  { "bin",     OP_BIN,     4, -3 },
+  { "binnd",   OP_BINND,   4, -3 },
+  { "wbinnd",  OP_WBINND,  5, -4 },
+  { "pairhist3", OP_PAIRHIST3, 5, -4 },
+  { "selfpairhist3", OP_SELFPAIRHIST3, 4, -3 },
+  { NULL,      OP_SCALAR,  0,  0 }
+};
+
+// Name and arity of any opcode, including those of prefixed words
+static const char * op_name(Opcode op)
 {
-  if (argc < 2) {
-    Tcl_WrongNumArgs(interp, 1, objv, (char *)"data data/funct ?data/funct? ...");
-    return TCL_ERROR;
+  for (const OpInfo *info = op_table; info->name; info++) {
+    if (info->op == op) return info->name;
+  }
+  switch (op) {
+  case OP_PUSH_VAR:     return "<varName";
+  case OP_POP_VAR:      return ">varName";
+  case OP_POP_INT_VAR:  return "&varName";
+  case OP_READ_FILE:    return "<file:";
+  case OP_WRITE_FILE:   return ">file:";
+  case OP_READ_BYTES:   return "<bytes:";
+  case OP_WRITE_BYTES:  return ">bytes:";
+  default:              return "?";
   }
+}
 
-  // all vectors have same size
-  // int vecsize = 0;
+// Arity and change in stack height of each opcode, indexed by opcode
+// (filled when the extension is loaded, see init_op_info)
+static int op_arities[OP_NUM];
+static int op_changes[OP_NUM];
 
-  int     funct_length;
-  char *  funct;
+static void init_op_info()
+{
+  for (int op = 0; op < OP_NUM; op++) {
+    const bool pops = (op == OP_POP_VAR || op == OP_POP_INT_VAR || op == OP_WRITE_FILE || op == OP_WRITE_BYTES);
+    op_arities[op] = pops ? 1 : 0;
+    op_changes[op] = pops ? -1 : +1;
+  }
+  for (const OpInfo *info = op_table; info->name; info++) {
+    op_arities[info->op] = info->arity;
+    op_changes[info->op] = info->change;
+  }
+}
 
-  Tcl_Obj **data;
-  int       num;
-  double    scalar;
-  bool      is_data;
-  size_t    count_back;
-  size_t    count_prev;
-  bool      mismatched;     // are two different-length vectors on top of the stack?
+static inline int op_arity(Opcode op)
+{
+  return op_arities[op];
+}
 
-  std::vector<std::vector <double> > stack;
+static inline int op_change(Opcode op)
+{
+  return op_changes[op];
+}
 
-  // additional register
-  std::vector <double> reg;
+// Binary files and byte arrays (see read_file, write_file and read_bytes)
+enum FileFormat { FILE_F64, FILE_F32, FILE_NPY, FILE_I64, FILE_I32,
+                  FILE_ITEM };  // >bytes: without a type: that of the vector
 
-  for (int a = 1; a < argc; a++) {
+struct FileSpec {
+  FileFormat format;
+  char       order;   // byte arrays: '=' host, '<' little-endian, '>' big-endian
+  size_t     offset;  // first element read
+  size_t     count;   // elements read, 0 for all
+  size_t     stride;
+};
 
-    if (Tcl_ListObjGetElements(interp, objv[a], &num, &data) != TCL_OK) {
-      Tcl_SetResult(interp, (char *) "vecexpr: error parsing arguments", TCL_STATIC);
-      return TCL_ERROR;
-    }
+struct Instr {
+  Opcode      op;
+  double      value;  // OP_SCALAR
+  std::string name;   // variable operators, file path
+  FileSpec    file;   // file operators
+};
 
-    if ( !num ) {
-      Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
-      return TCL_ERROR;
-    }
+struct Program {
+  std::vector<Instr> code;
+  int depth_needed;   // minimum stack height before running
+  int depth_change;   // net change in stack height
+  int refs;           // held by the Tcl_Obj, and by running commands
+};
 
-    is_data = (Tcl_GetDoubleFromObj(interp, data[0], &scalar) == TCL_OK);
+static inline void program_release(Program *prog)
+{
+  if (--prog->refs == 0) delete prog;
+}
 
-    if ( is_data ) {
-      // parse list and push
-      stack.push_back (std::vector <double>());
-      stack.back().resize (num);
-      stack.back()[0] = scalar;
-      for  (int i = 1; i < num; i++) {
-        if (Tcl_GetDoubleFromObj(interp, data[i], &scalar) != TCL_OK) {
-          Tcl_SetResult(interp, (char *) "vecexpr: error parsing vector element as floating-point", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        stack.back()[i] = scalar;
-      }
-    } else {
-      // functions
+static void optimize_program(Program &prog);
+static void program_free(Tcl_Obj *obj);
+static void program_dup(Tcl_Obj *src, Tcl_Obj *dup);
+static int  program_set_from_any(Tcl_Interp *interp, Tcl_Obj *obj);
+
+// The string rep of a program is never invalidated, so no updateStringProc
+static Tcl_ObjType program_type = {
+  "vecexpr program",
+  program_free,
+  program_dup,
+  NULL,
+  program_set_from_any
+};
+
+static inline Program * get_program(Tcl_Obj *obj)
+{
+  return (Program *) obj->internalRep.twoPtrValue.ptr1;
+}
+
+static void program_free(Tcl_Obj *obj)
+{
+  program_release(get_program(obj));
+  obj->typePtr = NULL;
+}
+
+static void program_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  Program *prog = new Program(*get_program(src));
+  prog->refs = 1;
+  dup->internalRep.twoPtrValue.ptr1 = prog;
+  dup->typePtr = &program_type;
+}
+
+// Parse "type[,offset[,count[,stride]]]:path" after <file: or >file:, or
+// "type[,offset[,count[,stride]]]:varName" after <bytes: or >bytes:, where
+// "type:" may be left out
+static int parse_file_spec(Tcl_Interp *interp, const char *word, bool reading, Instr &instr)
+{
+  const bool  bytes = (word[1] == 'b');
+  const char *spec = strchr(word, ':') + 1;
+  const char *colon = strchr(spec, ':');
+  instr.file.order = '=';
+  instr.file.offset = 0;
+  instr.file.count = 0;
+  instr.file.stride = 1;
+  if (bytes && *spec && (!colon || colon == spec)) {
+    // No type (a name such as ::x starts with one)
+    instr.name = spec;
+    instr.file.format = reading ? FILE_F64 : FILE_ITEM;
+    return TCL_OK;
+  }
+  if (!colon || !colon[1]) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: expected %.*stype:%s, got \"%s\"", (int) (spec - word), word,
+                                           bytes ? "varName" : "path", word));
+    return TCL_ERROR;
+  }
+  instr.name = colon + 1;
+
+  const char *comma = strchr(spec, ',');
+  const std::string given(spec, (comma && comma < colon) ? comma : colon);
+  std::string type(given);
+  if (bytes && type.size() > 2 && (!type.compare(type.size() - 2, 2, "le") || !type.compare(type.size() - 2, 2, "be"))) {
+    instr.file.order = (type[type.size() - 2] == 'l') ? '<' : '>';
+    type.resize(type.size() - 2);
+  }
+  if (type == "f64") {
+    instr.file.format = FILE_F64;
+  } else if (type == "f32") {
+    instr.file.format = FILE_F32;
+  } else if (type == "npy" && !bytes) {
+    instr.file.format = FILE_NPY;
+  } else if (type == "i64" && bytes) {
+    instr.file.format = FILE_I64;
+  } else if (type == "i32" && bytes) {
+    instr.file.format = FILE_I32;
+  } else if (bytes) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: unknown byte array type \"%s\" (should be f64, f32, i64 or i32, "
+                                           "optionally followed by le or be)", given.c_str()));
+    return TCL_ERROR;
+  } else {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: unknown file type \"%s\" (should be f64, f32 or npy)", type.c_str()));
+    return TCL_ERROR;
+  }
+  if (!comma || comma > colon) return TCL_OK;
+  if (!reading) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: offset, count and stride only apply to reading %s, in \"%s\"",
+                                           bytes ? "byte arrays" : "files", word));
+    return TCL_ERROR;
+  }
+  // Empty fields keep their default
+  size_t *fields[3] = { &instr.file.offset, &instr.file.count, &instr.file.stride };
+  const char *p = comma;
+  for (int f = 0; f < 3 && p < colon && *p == ','; f++) {
+    p++;
+    if (*p == ',' || *p == ':') continue;
+    char *end;
+    const unsigned long long value = strtoull(p, &end, 10);
+    if (end == p || *p == '-' || (*end != ',' && *end != ':')) break;
+    *fields[f] = value;
+    p = end;
+  }
+  if (p != colon || instr.file.stride == 0) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: bad offset, count or stride in \"%s\"", word));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+static const OpInfo * lookup_op(const char *name)
+{
+  for (const OpInfo *info = op_table; info->name; info++) {
+    if (!strcmp(name, info->name)) return info;
+  }
+  return NULL;
+}
 
-      if (num != 1) {
-        Tcl_SetResult(interp, (char *) "vecexpr: error parsing list with more than one element as function", TCL_STATIC);
+// Compile list elements into a program and install it as internal rep of obj
+static int compile_program(Tcl_Interp *interp, Tcl_Obj *obj, int num, Tcl_Obj * const words[])
+{
+  Program *prog = new Program;
+  prog->depth_needed = 0;
+  prog->depth_change = 0;
+  prog->refs = 1;
+  prog->code.resize(num);
+
+  int height = 0;
+  for (int i = 0; i < num; i++) {
+    Instr &instr = prog->code[i];
+    int   length;
+    const char *word = Tcl_GetStringFromObj(words[i], &length);
+    int   arity = 0, change = +1;
+
+    instr.value = 0.0;
+    instr.file = FileSpec();
+    if (length == 0) {
+      Tcl_SetResult(interp, (char *) "vecexpr: found empty string when trying to parse function name (should not happen!)", TCL_STATIC);
+      delete prog;
+      return TCL_ERROR;
+    }
+    if (Tcl_GetDoubleFromObj(NULL, words[i], &instr.value) == TCL_OK) {
+      instr.op = OP_SCALAR;
+    } else if (!strncmp(word, "<file:", 6) || !strncmp(word, ">file:", 6)
+               || !strncmp(word, "<bytes:", 7) || !strncmp(word, ">bytes:", 7)) {
+      const bool reading = (word[0] == '<');
+      if (word[1] == 'b') {
+        instr.op = reading ? OP_READ_BYTES : OP_WRITE_BYTES;
+      } else {
+        instr.op = reading ? OP_READ_FILE : OP_WRITE_FILE;
+      }
+      if (parse_file_spec(interp, word, reading, instr) != TCL_OK) {
+        delete prog;
         return TCL_ERROR;
       }
-      funct = Tcl_GetStringFromObj(data[0], &funct_length);
-      if ( !funct_length ) {
-        Tcl_SetResult(interp, (char *) "vecexpr: found empty string when trying to parse function name (should not happen!)", TCL_STATIC);
+      if (!reading) {
+        arity = 1;
+        change = -1;
+      }
+    } else if (!strncmp(word, "store:", 6) || !strncmp(word, "recall:", 7)) {
+      const bool storing = (word[0] == 's');
+      instr.op = storing ? OP_STORE : OP_RECALL;
+      instr.name = &word[storing ? 6 : 7];
+      if (storing) {
+        arity = 1;
+        change = 0;
+      }
+    } else if (word[0] == '<') {
+      instr.op = OP_PUSH_VAR;
+      instr.name = &word[1];
+    } else if (word[0] == '>' || word[0] == '&') {
+      instr.op = (word[0] == '>') ? OP_POP_VAR : OP_POP_INT_VAR;
+      instr.name = &word[1];
+      arity = 1;
+      change = -1;
+    } else {
+      const OpInfo *info = lookup_op(word);
+      if (!info) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: unrecognized function keyword \"%s\"", word));
+        delete prog;
         return TCL_ERROR;
       }
+      instr.op = info->op;
+      arity = info->arity;
+      change = info->change;
+    }
+    // Operands missing from the start of the program must be on the stack already
+    if (height - arity < -prog->depth_needed) {
+      prog->depth_needed = arity - height;
+    }
+    height += change;
+  }
+  prog->depth_change = height;
+  optimize_program(*prog);
 
-      // Zero-ary function first
+  // Make sure the string rep survives before dropping the old internal rep
+  Tcl_GetString(obj);
+  if (obj->typePtr && obj->typePtr->freeIntRepProc) {
+    obj->typePtr->freeIntRepProc(obj);
+  }
+  obj->internalRep.twoPtrValue.ptr1 = prog;
+  obj->typePtr = &program_type;
+  return TCL_OK;
+}
 
-      if (!strcmp(funct, "pi")) { // FUNCTION: PI
-        stack.push_back(std::vector<double> (1, M_PI));
-        continue;
-      }
+static int program_set_from_any(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+  Tcl_Obj **words;
+  int       num;
 
-      if (!strcmp(funct, "height")) { // FUNCTION: HEIGHT
-        //return stack height
-        stack.push_back(std::vector<double> (1, (double) stack.size()));
-        continue;
-      }
+  if (Tcl_ListObjGetElements(interp, obj, &num, &words) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  // compile_program may free the list rep holding the words
+  std::vector<Tcl_Obj *> held(words, words + num);
+  for (int i = 0; i < num; i++) Tcl_IncrRefCount(held[i]);
+  int result = compile_program(interp, obj, num, held.data());
+  for (int i = 0; i < num; i++) Tcl_DecrRefCount(held[i]);
+  return result;
+}
 
-      if (!strcmp(funct, "recall")) { // FUNCTION: RECALL
-        if ( reg.size() == 0 ) {
-          Tcl_SetResult(interp, (char *) "vecexpr: trying to recall value from empty register", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        stack.push_back( std::vector<double> (reg) );
-        continue;
-      }
+// Element types
+// Vectors hold f64 (the default), f32 or i64 elements, in buffers of doubles:
+// f64 and i64 elements take one double each, and f32 elements half of one, so
+// that f32 data take half the memory and bandwidth; the number of elements of
+// an f32 vector is kept apart. Operators without f32 or i64 kernels convert
+// their operands to f64 (see run_instr and run_fused).
+// A stack item may also be a view (slice stride row col): length elements of
+// its buffer, every stride-th from offset, without copying them. Element-wise
+// operators and reductions read views in place (see run_fused); other
+// operators, and writes, copy them into a buffer of their own first (see
+// materialize). Vector objects are never views.
+// dup store recall make views of a buffer shared by several items and
+// registers, so that they copy nothing: the buffer is only copied when one of
+// them is written, like any view (copy on write). Vector objects pushed onto
+// the stack are views of the buffer of the object in the same way.
+enum VecType { VEC_F64, VEC_F32, VEC_I64 };
 
-      if ( funct[0] == '<' ) { // FUNCTION: PUSH VARIABLE
-      // This does not seem very useful, as the variable can be passed as
-      // a parameter to vecexpr slightly more efficiently than using this code
-      // 1000-buck question: why is {expr  1 + 2} slower than { vecexpr 1 2 add }, but
-      // { expr {$a + $b} } much faster than either { vecexpr $a $b add } or
-      // { vecexpr <a <b add } ???
-      // (the answer might lie in the code used internally to parse expr:
-      // http://tcl.cvs.sourceforge.net/viewvc/tcl/tcl/generic/tclCompExpr.c?view=markup )
+// Buffer of views held by several items, registers and vector objects (see
+// share_item and push_vector); vector objects may be read by other threads
+struct SharedBuffer {
+  std::vector<double> buf;
+  std::atomic<int>    refs;
+};
 
-        const char *varName = &funct[1];
-        Tcl_Obj *varData = Tcl_GetVar2Ex( interp, varName, NULL, 0);
-        if ( varData == NULL ) {
-          Tcl_SetResult(interp, (char *) "vecexpr: tried to push unknown Tcl variable", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        int num_elts;
-        Tcl_Obj ** listData;
-        if (Tcl_ListObjGetElements(interp, varData, &num_elts, &listData) != TCL_OK) {
-          Tcl_SetResult(interp, (char *) "vecexpr: error parsing arguments", TCL_STATIC);
-          return TCL_ERROR;
-        }
+struct ItemType {
+  VecType        type;
+  size_t         length;   // number of elements of an f32 vector or of a view (0 otherwise)
+  size_t         offset;   // of the first element of a view (0 otherwise)
+  size_t         stride;   // between elements of a view (0: not a view)
+  SharedBuffer * shared;   // buffer of a shared view, or NULL: the buffer of the item
+};
 
-        if ( !num_elts ) {
-          Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
-          return TCL_ERROR;
-        }
+static const ItemType F64_ITEM = { VEC_F64, 0, 0, 0, NULL };
 
-        stack.push_back (std::vector <double>());
-        stack.back().resize (num_elts);
-        for  (int i = 0; i < num_elts; i++) {
-          if (Tcl_GetDoubleFromObj(interp, listData[i], &scalar) != TCL_OK) {
-            Tcl_SetResult(interp, (char *) "vecexpr: error parsing vector element as floating-point", TCL_STATIC);
-            return TCL_ERROR;
-          }
-          stack.back()[i] = scalar;
-        }
-        continue;
-      }
+// Elements are read and written through these types, which may alias the doubles
+typedef float   f32_alias __attribute__((may_alias));
+typedef int64_t i64_alias __attribute__((may_alias));
 
-      if (stack.size() == 0) {
-        Tcl_SetResult(interp, (char *) "vecexpr: calling function with empty stack", TCL_STATIC);
-        return TCL_ERROR;
-      }
+static const char * const type_names[] = { "f64", "f32", "i64" };
 
-      count_back = stack.back().size();
+static inline ItemType item_type(VecType type, size_t n)
+{
+  const ItemType t = { type, (type == VEC_F32) ? n : 0, 0, 0, NULL };
+  return t;
+}
 
-      // Unary functions
+// Doubles needed for n elements of type
+static inline size_t buffer_words(VecType type, size_t n)
+{
+  return (type == VEC_F32) ? (n + 1) / 2 : n;
+}
 
-      if ( funct[0] == '>' ) { // FUNCTION: POP TO VARIABLE
-        const char *varName = &funct[1];
-        Tcl_Obj * newList = Tcl_NewListObj (0, NULL);
-        for (size_t i = 0; i < count_back; i++) {
-          Tcl_ListObjAppendElement (interp, newList, Tcl_NewDoubleObj(stack.back()[i]));
-        }
-        Tcl_SetVar2Ex (interp, varName, NULL, newList, 0);
-        stack.pop_back();
-        continue;
-      }
+static inline size_t item_length(const std::vector<double> &buf, const ItemType &t)
+{
+  return (t.type == VEC_F32 || t.stride) ? t.length : buf.size();
+}
 
-      if ( funct[0] == '&' ) { // FUNCTION: pop to integer variable
-        const char *varName = &funct[1];
-        Tcl_Obj * newList = Tcl_NewListObj (0, NULL);
-        for (size_t i = 0; i < count_back; i++) {
-          double const val = stack.back()[i];
-          long int floor = val < 0 ? (long int)val - 1 : (long int)val;
-          Tcl_ListObjAppendElement (interp, newList, Tcl_NewIntObj(floor));
-        }
-        Tcl_SetVar2Ex (interp, varName, NULL, newList, 0);
-        stack.pop_back();
-        continue;
-      }
+static inline double get_elem(const double *buf, VecType type, size_t i)
+{
+  switch (type) {
+  case VEC_F32: return ((const f32_alias *) buf)[i];
+  case VEC_I64: return (double) ((const i64_alias *) buf)[i];
+  default:      return buf[i];
+  }
+}
 
-      if (!strcmp(funct, "abs")) { // FUNCTION: ABS
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = fabs(stack.back()[i]);
-        }
-        continue;
-      }
+// Convert n elements of a typed buffer, every stride-th from offset, to doubles
+static void to_doubles(double *dest, const double *buf, VecType type, size_t offset, size_t stride, size_t n)
+{
+  if (type == VEC_F64 && stride == 1) {
+    memcpy(dest, buf + offset, n * sizeof(double));
+  } else if (type == VEC_F64) {
+    const double *src = buf + offset;
+    for (size_t i = 0; i < n; i++) dest[i] = src[i * stride];
+  } else if (type == VEC_F32) {
+    const f32_alias *src = (const f32_alias *) buf + offset;
+    for (size_t i = 0; i < n; i++) dest[i] = src[i * stride];
+  } else {
+    const i64_alias *src = (const i64_alias *) buf + offset;
+    for (size_t i = 0; i < n; i++) dest[i] = (double) src[i * stride];
+  }
+}
 
-      if (!strcmp(funct, "cos")) { // FUNCTION: COS
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = cos(stack.back()[i]);
-        }
-        continue;
-      }
+// i64 value of x, rounded down like &varName; false if out of range
+static inline bool floor_i64(double x, int64_t &result)
+{
+  const double f = floor(x);
+  if (!(f >= -9223372036854775808.0 && f < 9223372036854775808.0)) return false;
+  result = (int64_t) f;
+  return true;
+}
 
-      if (!strcmp(funct, "sin")) { // FUNCTION: SIN
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = sin(stack.back()[i]);
-        }
-        continue;
-      }
+// Text conversion
+// Vectors given as strings are read in one pass over the string, straight
+// into doubles, and the string of a vector is written into one buffer; no
+// Tcl_Obj is made per element. Both agree with Tcl: a plain decimal number
+// reads as Tcl_GetDouble reads it, and a double prints as Tcl_PrintDouble
+// prints it, i.e. the shortest text that reads back as the same double (the
+// Ryu algorithm, Ulf Adams, PLDI 2018). Other lists (braces, hex, octal,
+// Inf...) go through the Tcl list parser, as before.
 
-      if (!strcmp(funct, "tan")) { // FUNCTION: SIN
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = tan(stack.back()[i]);
-        }
-        continue;
-      }
+// Classes of characters in lists: separators, and those the Tcl list parser
+// must handle
+enum { CHAR_PLAIN, CHAR_SPACE, CHAR_QUOTE };
+static unsigned char list_chars[256];
 
-      if (!strcmp(funct, "exp")) { // FUNCTION: EXP
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = exp(stack.back()[i]);
-        }
-        continue;
-      }
+static const Tcl_ObjType *list_obj_type;
 
-      if (!strcmp(funct, "log")) { // FUNCTION: LOG
-        for (size_t i = 0; i < count_back; i++) {
-          if (stack.back()[i] <= 0.0) {
-            Tcl_SetResult(interp, (char *) "vecexpr: taking log of non-positive value", TCL_STATIC);
-            return TCL_ERROR;
-          }
-          stack.back()[i] = log(stack.back()[i]);
-        }
-        continue;
-      }
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 u128;
 
-      if (!strcmp(funct, "mean")) { // FUNCTION: MEAN
-        double sum = stack.back()[0];
-        for (size_t i = 1; i < count_back; i++) {
-          sum += stack.back()[i];
-        }
-        stack.push_back(std::vector<double> (1, sum / count_back));
-        continue;
-      }
+// Top 125 bits of 5^i, and 2^(bits(5^i) - 1 + 125) / 5^i + 1 (low word
+// first), computed exactly when the extension is loaded
+static const int POW5_BITS = 125;
+static uint64_t pow5_split[326][2];
+static uint64_t pow5_inv_split[342][2];
+static u128     pow10_u128[39];
 
-      if (!strcmp(funct, "min")) { // FUNCTION: MIN
-        double min = stack.back()[0];
-        for (size_t i = 1; i < count_back; i++) {
-          if (stack.back()[i] < min)
-            min = stack.back()[i];
-        }
-        stack.push_back(std::vector<double> (1, min));
-        continue;
-      }
+static void init_pow_tables()
+{
+  pow10_u128[0] = 1;
+  for (int i = 1; i < 39; i++) pow10_u128[i] = pow10_u128[i-1] * 10;
 
-      if (!strcmp(funct, "max")) { // FUNCTION: MAX
-        double max = stack.back()[0];
-        for (size_t i = 1; i < count_back; i++) {
-          if (stack.back()[i] > max)
-            max = stack.back()[i];
-        }
-        stack.push_back(std::vector<double> (1, max));
-        continue;
+  // 5^i and remainders, in 32-bit words (5^341 has 792 bits)
+  const int WORDS = 26;
+  uint32_t p[WORDS] = { 1 };
+  uint32_t r[WORDS];
+  for (int i = 0; i < 342; i++) {
+    uint64_t carry = 0;
+    for (int k = 0; k < WORDS && i > 0; k++) {
+      carry += (uint64_t) p[k] * 5;
+      p[k] = (uint32_t) carry;
+      carry >>= 32;
+    }
+    int bits = WORDS * 32;
+    while (!((p[(bits - 1) / 32] >> ((bits - 1) % 32)) & 1)) bits--;
+    if (i < 326) {
+      u128 top = 0;
+      for (int b = bits - POW5_BITS; b < bits; b++) {
+        top = top >> 1 | (u128) (b >= 0 && ((p[b / 32] >> (b % 32)) & 1)) << (POW5_BITS - 1);
       }
-
-      if (!strcmp(funct, "sum")) { // FUNCTION: SUM
-        double sum = stack.back()[0];
-        for (size_t i = 1; i < count_back; i++) {
-          sum += stack.back()[i];
-        }
-        stack.push_back(std::vector<double> (1, sum));
-        continue;
+      pow5_split[i][0] = (uint64_t) top;
+      pow5_split[i][1] = (uint64_t) (top >> 64);
+    }
+    // Long division of 2^(bits - 1 + 125) by 5^i: the quotient bits above
+    // 2^125 are zero, leaving r = 2^(bits - 1) there
+    memset(r, 0, sizeof(r));
+    r[(bits - 1) / 32] = 1u << ((bits - 1) % 32);
+    u128 q = 0;
+    for (int b = POW5_BITS; b >= 0; b--) {
+      if (b < POW5_BITS) {
+        for (int k = WORDS - 1; k > 0; k--) r[k] = r[k] << 1 | r[k-1] >> 31;
+        r[0] <<= 1;
       }
-
-      if (!strcmp(funct, "floor")) { // FUNCTION: FLOOR
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = floor(stack.back()[i]);
+      int k = WORDS - 1;
+      while (k > 0 && r[k] == p[k]) k--;
+      const bool ge = (r[k] >= p[k]);
+      if (ge) {
+        int64_t borrow = 0;
+        for (k = 0; k < WORDS; k++) {
+          borrow += (int64_t) r[k] - p[k];
+          r[k] = (uint32_t) borrow;
+          borrow >>= 32;
         }
-        continue;
       }
+      q = q << 1 | (u128) ge;
+    }
+    q += 1;
+    pow5_inv_split[i][0] = (uint64_t) q;
+    pow5_inv_split[i][1] = (uint64_t) (q >> 64);
+  }
+}
 
-      if (!strcmp(funct, "round")) { // FUNCTION: ROUND
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] = round(stack.back()[i]);
-        }
-        continue;
-      }
+static inline int pow5_bits(int e)     { return (int) (((uint32_t) e * 1217359) >> 19) + 1; }
+static inline int log10_pow2(int e)    { return (int) (((uint32_t) e * 78913) >> 18); }
+static inline int log10_pow5(int e)    { return (int) (((uint32_t) e * 732923) >> 20); }
 
-      if (!strcmp(funct, "sq")) { // FUNCTION: SQ
-        for (size_t i = 0; i < count_back; i++) {
-          stack.back()[i] *= stack.back()[i];
-        }
-        continue;
-      }
+static inline int pow5_factor(uint64_t v)
+{
+  int count = 0;
+  while (v % 5 == 0) {
+    v /= 5;
+    count++;
+  }
+  return count;
+}
 
-      if (!strcmp(funct, "sqrt")) { // FUNCTION: SQRT
-        for (size_t i = 0; i < count_back; i++) {
-#ifdef DEBUG
-          if (stack.back()[i] < 0.0) {
-            Tcl_SetResult(interp, (char *) "vecexpr: taking sqrt of negative value", TCL_STATIC);
-            return TCL_ERROR;
-          }
-#endif
-          stack.back()[i] = sqrt(stack.back()[i]);
-        }
-        continue;
-      }
+static inline bool multiple_of_pow5(uint64_t v, int p) { return pow5_factor(v) >= p; }
+static inline bool multiple_of_pow2(uint64_t v, int p) { return (v & ((1ull << p) - 1)) == 0; }
 
-      if (!strcmp(funct, "dup")) { // FUNCTION: DUP
-        stack.push_back( std::vector<double> (stack.back()) );
-        continue;
-      }
+static inline uint64_t mul_shift(uint64_t m, const uint64_t *mul, int j)
+{
+  const u128 b0 = (u128) m * mul[0];
+  const u128 b2 = (u128) m * mul[1];
+  return (uint64_t) (((b0 >> 64) + b2) >> (j - 64));
+}
 
-      if (!strcmp(funct, "pop")) { // FUNCTION: POP
-        stack.pop_back();
-        continue;
-      }
+static inline uint32_t mul_shift32(uint32_t m, uint64_t factor, int shift)
+{
+  const uint64_t b0 = (uint64_t) m * (uint32_t) factor;
+  const uint64_t b1 = (uint64_t) m * (uint32_t) (factor >> 32);
+  return (uint32_t) (((b0 >> 32) + b1) >> (shift - 32));
+}
 
-      if (!strcmp(funct, "store")) { // FUNCTION: STORE
-        reg = stack.back();
-        continue;
+// Remove digits while the interval vm to vp holds several decimals, rounding
+// vr, whose next digit is last_removed (see shortest_decimal): returns the
+// digits left, and how many were removed
+static inline uint64_t round_shortest(uint64_t vr, uint64_t vp, uint64_t vm, bool vm_trailing_zeros,
+                                      bool vr_trailing_zeros, uint8_t last_removed, bool even, int &removed)
+{
+  removed = 0;
+  if (vm_trailing_zeros || vr_trailing_zeros) {
+    while (vp / 10 > vm / 10) {
+      vm_trailing_zeros &= (vm % 10 == 0);
+      vr_trailing_zeros &= (last_removed == 0);
+      last_removed = (uint8_t) (vr % 10);
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    if (vm_trailing_zeros) {
+      while (vm % 10 == 0) {
+        vr_trailing_zeros &= (last_removed == 0);
+        last_removed = (uint8_t) (vr % 10);
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
+        removed++;
       }
+    }
+    if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0) {
+      // Exactly halfway: round to even
+      last_removed = 4;
+    }
+    return vr + ((vr == vm && (!even || !vm_trailing_zeros)) || last_removed >= 5);
+  }
+  while (vp / 10 > vm / 10) {
+    last_removed = (uint8_t) (vr % 10);
+    vr /= 10;
+    vp /= 10;
+    vm /= 10;
+    removed++;
+  }
+  return vr + (vr == vm || last_removed >= 5);
+}
 
-      // ########## End of unary functions
+// Shortest decimal digits * 10^exp10 that reads back as the positive finite
+// double with these IEEE fields
+static void shortest_decimal(uint64_t ieee_mantissa, uint32_t ieee_exponent, uint64_t &digits, int &exp10)
+{
+  int      e2;
+  uint64_t m2;
+  if (ieee_exponent == 0) {
+    e2 = 1 - 1023 - 52 - 2;
+    m2 = ieee_mantissa;
+  } else {
+    e2 = (int) ieee_exponent - 1023 - 52 - 2;
+    m2 = (1ull << 52) | ieee_mantissa;
+  }
+  const bool even = (m2 & 1) == 0;
 
-      if (stack.size() < 2) {
-        Tcl_SetResult(interp, (char *)  "vecexpr: not a unary function, and only one item on stack", TCL_STATIC);
-        return TCL_ERROR;
+  // The interval of decimals that read back as the double: mm to mp (times
+  // 2^e2, including the bounds if even), around mv
+  const uint64_t mv = 4 * m2;
+  const uint32_t mm_shift = (ieee_mantissa != 0 || ieee_exponent <= 1);
+  uint64_t vr, vp, vm;
+  int      e10;
+  bool     vm_trailing_zeros = false;
+  bool     vr_trailing_zeros = false;
+  if (e2 >= 0) {
+    const int q = log10_pow2(e2) - (e2 > 3);
+    e10 = q;
+    const int k = POW5_BITS + pow5_bits(q) - 1;
+    const int i = -e2 + q + k;
+    vr = mul_shift(4 * m2, pow5_inv_split[q], i);
+    vp = mul_shift(4 * m2 + 2, pow5_inv_split[q], i);
+    vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_inv_split[q], i);
+    if (q <= 21) {
+      if (mv % 5 == 0) {
+        vr_trailing_zeros = multiple_of_pow5(mv, q);
+      } else if (even) {
+        vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+      } else {
+        vp -= multiple_of_pow5(mv + 2, q);
       }
+    }
+  } else {
+    const int q = log10_pow5(-e2) - (-e2 > 1);
+    e10 = q + e2;
+    const int i = -e2 - q;
+    const int k = pow5_bits(i) - POW5_BITS;
+    const int j = q - k;
+    vr = mul_shift(4 * m2, pow5_split[i], j);
+    vp = mul_shift(4 * m2 + 2, pow5_split[i], j);
+    vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_split[i], j);
+    if (q <= 1) {
+      vr_trailing_zeros = true;
+      if (even) {
+        vm_trailing_zeros = (mm_shift == 1);
+      } else {
+        --vp;
+      }
+    } else if (q < 63) {
+      vr_trailing_zeros = multiple_of_pow2(mv, q);
+    }
+  }
 
-      int back = stack.size()-1; // last on stack
-      int prev = stack.size()-2; // second-to-last on stack
-      count_prev = stack[prev].size();
-      mismatched = (count_back != count_prev);
+  int removed;
+  digits = round_shortest(vr, vp, vm, vm_trailing_zeros, vr_trailing_zeros, 0, even, removed);
+  exp10 = e10 + removed;
+}
 
-      if (!strcmp(funct, "concat")) { // FUNCTION: CONCAT
-        stack[prev].reserve(count_prev + count_back);
-        for (size_t i = 0; i < count_back; i++) {
-          stack[prev].push_back (stack.back()[i]);
-        }
-        stack.pop_back();
-        continue;
-      }
+// Shortest decimal digits * 10^exp10 that reads back as the positive finite
+// float with these IEEE fields (the same steps, with the top words of the
+// tables as 61-bit multipliers)
+static void shortest_decimal_f32(uint32_t ieee_mantissa, uint32_t ieee_exponent, uint64_t &digits, int &exp10)
+{
+  static const int BITS = POW5_BITS - 64;
+  int      e2;
+  uint32_t m2;
+  if (ieee_exponent == 0) {
+    e2 = 1 - 127 - 23 - 2;
+    m2 = ieee_mantissa;
+  } else {
+    e2 = (int) ieee_exponent - 127 - 23 - 2;
+    m2 = (1u << 23) | ieee_mantissa;
+  }
+  const bool even = (m2 & 1) == 0;
 
-      if (!strcmp(funct, "swap")) { // FUNCTION: SWAP
-        stack.back().swap(stack[prev]);
-        continue;
+  const uint32_t mv = 4 * m2;
+  const uint32_t mm_shift = (ieee_mantissa != 0 || ieee_exponent <= 1);
+  uint32_t vr, vp, vm;
+  int      e10;
+  bool     vm_trailing_zeros = false;
+  bool     vr_trailing_zeros = false;
+  uint8_t  last_removed = 0;
+  if (e2 >= 0) {
+    const int q = log10_pow2(e2);
+    e10 = q;
+    const int k = BITS + pow5_bits(q) - 1;
+    const int i = -e2 + q + k;
+    vr = mul_shift32(mv, pow5_inv_split[q][1] + 1, i);
+    vp = mul_shift32(mv + 2, pow5_inv_split[q][1] + 1, i);
+    vm = mul_shift32(mv - 1 - mm_shift, pow5_inv_split[q][1] + 1, i);
+    if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+      // No digit is removed below: compute the one under vr
+      const int l = BITS + pow5_bits(q - 1) - 1;
+      last_removed = (uint8_t) (mul_shift32(mv, pow5_inv_split[q - 1][1] + 1, -e2 + q - 1 + l) % 10);
+    }
+    if (q <= 9) {
+      if (mv % 5 == 0) {
+        vr_trailing_zeros = multiple_of_pow5(mv, q);
+      } else if (even) {
+        vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+      } else {
+        vp -= multiple_of_pow5(mv + 2, q);
+      }
+    }
+  } else {
+    const int q = log10_pow5(-e2);
+    e10 = q + e2;
+    const int i = -e2 - q;
+    const int k = pow5_bits(i) - BITS;
+    const int j = q - k;
+    vr = mul_shift32(mv, pow5_split[i][1], j);
+    vp = mul_shift32(mv + 2, pow5_split[i][1], j);
+    vm = mul_shift32(mv - 1 - mm_shift, pow5_split[i][1], j);
+    if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+      const int l = q - 1 - (pow5_bits(i + 1) - BITS);
+      last_removed = (uint8_t) (mul_shift32(mv, pow5_split[i + 1][1], l) % 10);
+    }
+    if (q <= 1) {
+      vr_trailing_zeros = true;
+      if (even) {
+        vm_trailing_zeros = (mm_shift == 1);
+      } else {
+        --vp;
       }
+    } else if (q < 31) {
+      vr_trailing_zeros = multiple_of_pow2(mv, q - 1);
+    }
+  }
 
-      if (!strcmp(funct, "add")) { // FUNCTION: ADD
-        if ( count_back == 1 || count_prev == 1 ) { // Add scalar to vector / matrix
-          if (count_back > 1) {
-            stack.back().swap(stack[prev]);
-            count_prev = count_back;
-          }
-          for (size_t i = 0; i < count_prev; i++) {
-            stack[prev][i] += stack.back()[0];
-          }
-        } else {
-          if ( mismatched ) {
-            // This could be a vector-matrix addition
-            const int ivec = (count_back < count_prev ? back : prev);
-            const int imat = (count_back < count_prev ? prev : back);
-            std::vector<double> & vec = stack[ivec];
-            std::vector<double> & mat = stack[imat];
-            size_t count_mat = mat.size();
-            size_t count_vec = vec.size();
-            if (count_mat % count_vec) {
-              Tcl_SetResult(interp, (char *) "vecexpr: matrix-vector add with non-divisor vector length", TCL_STATIC);
-              return TCL_ERROR;
-            }
-            if (count_back < count_prev) {
-              // <matrix> <vector> add: add vector to matrix rows
-              int k = 0;
-              for (size_t i = 0; i < count_mat / count_vec; i++) {
-                for (size_t j = 0; j < count_vec; j++) {
-                  mat[k++] += vec[j];
-                }
-              }
-              stack.pop_back(); // get vector off the stack
-            } else {
-              // <vector> <matrix> add: add vector to matrix columns
-              int k = 0;
-              for (size_t j = 0; j < count_vec; j++) {
-                for (size_t i = 0; i < count_mat / count_vec; i++) {
-                  mat[k++] += vec[j];
-                }
-              }
-              stack.back().swap(stack[prev]); // move vector to the back
-              stack.pop_back(); // get vector off the stack
-            }
+  int removed;
+  digits = round_shortest(vr, vp, vm, vm_trailing_zeros, vr_trailing_zeros, last_removed, even, removed);
+  exp10 = e10 + removed;
+}
 
-            // Leave matrix at the back of the stack
-            continue;
+// Significant bits of n > 0
+static inline int u128_bits(u128 n)
+{
+  const uint64_t hi = (uint64_t) (n >> 64);
+  return hi ? 128 - __builtin_clzll(hi) : 64 - __builtin_clzll((uint64_t) n);
+}
 
-          } else {
-            for (size_t i = 0; i < count_back; i++) {
-              stack[prev][i] += stack.back()[i];
-            }
-          }
-        }
-        stack.pop_back();
-        continue;
-      }
+// n (with at least 54 significant bits when sticky) rounded to the nearest
+// double, ties to even; sticky: n is followed by nonzero fraction bits
+static inline double round_u128(u128 n, bool sticky)
+{
+  const int bits = u128_bits(n);
+  if (bits <= 53) return (double) (uint64_t) n;
+  const int shift = bits - 54;
+  const uint64_t top = (uint64_t) (n >> shift);
+  const bool rest = sticky || (shift && (n << (128 - shift)) != 0);
+  uint64_t mantissa = top >> 1;
+  if ((top & 1) && (rest || (mantissa & 1))) mantissa++;
+  return ldexp((double) mantissa, shift + 1);
+}
+#endif
 
-      if ( !strcmp(funct, "div") ) { // FUNCTION: DIV
-        bool zero = false;
-        for (size_t i = 0; i < count_back; i++) {if (stack.back()[i] == 0.0) zero = true;}
-        if (zero) {
-          Tcl_SetResult(interp, (char *) "vecexpr: divide by zero in function div", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        if ( count_back == 1 || count_prev == 1 ) {
-          if (count_back > 1) {
-            stack.back().swap(stack[prev]);
-            count_prev = count_back;
-            for (size_t i = 0; i < count_prev; i++) {
-              stack[prev][i] = stack.back()[0] / stack[prev][i];
-            }
-          } else {
-            for (size_t i = 0; i < count_prev; i++) {
-              stack[prev][i] /= stack.back()[0];
-            }
-          }
-        } else {
-          if ( mismatched ) {
-            Tcl_SetResult(interp, (char *)  "vecexpr: attempting binary function on different-length vectors", TCL_STATIC);
-            return TCL_ERROR;
-          }
-          for (size_t i = 0; i < count_back; i++) {
-            stack[prev][i] /= stack.back()[i];
-          }
-        }
-        stack.pop_back();
-        continue;
-      }
+static bool text_tables_ready = false;
+TCL_DECLARE_MUTEX(text_tables_mutex)
 
-      if (!strcmp(funct, "dot")) { // FUNCTION: DOT
-        if (mismatched) {
-          Tcl_SetResult(interp, (char *) "vecexpr: function dot requires vectors of same length", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        double dot = 0.0;
+static void init_text_tables()
+{
+  Tcl_MutexLock(&text_tables_mutex);
+  if (!text_tables_ready) {
+    for (int c = 0; c < 256; c++) list_chars[c] = CHAR_PLAIN;
+    for (const char *c = " \t\n\r\v\f"; *c; c++) list_chars[(unsigned char) *c] = CHAR_SPACE;
+    for (const char *c = "{}\"\\"; *c; c++) list_chars[(unsigned char) *c] = CHAR_QUOTE;
+    list_obj_type = Tcl_GetObjType("list");
+#ifdef __SIZEOF_INT128__
+    init_pow_tables();
+#endif
+    text_tables_ready = true;
+  }
+  Tcl_MutexUnlock(&text_tables_mutex);
+}
+
+// Exactly representable powers of ten
+static const double pow10_f64[23] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#ifdef __SIZEOF_INT128__
+// Sign of w / 10^k - a * 2^b, for a * 2^b within a few units of 2^-54 of
+// w / 10^k (k <= 21, a < 2^55)
+static inline int compare_decimal(uint64_t w, int k, uint64_t a, int b)
+{
+  u128 lhs = w;
+  u128 rhs = (u128) a * pow10_u128[k];
+  if (b < 0) {
+    lhs <<= -b;
+  } else {
+    rhs <<= b;
+  }
+  return (lhs > rhs) - (lhs < rhs);
+}
+#endif
+
+// w * 10^e, correctly rounded; false if out of the exact range
+static inline bool decimal_to_double(uint64_t w, int e, double &x)
+{
+  if (w == 0) {
+    x = 0.0;
+    return true;
+  }
+  // Both w and 10^e are exact doubles: one rounding
+  if (w <= (1ull << 53) && e >= -22 && e <= 22) {
+    x = (e < 0) ? (double) w / pow10_f64[-e] : (double) w * pow10_f64[e];
+    return true;
+  }
+#ifdef __SIZEOF_INT128__
+  if (e >= 0) {
+    if (e > 38 || w > ~(u128) 0 / pow10_u128[e]) return false;
+    x = round_u128(w * pow10_u128[e], false);
+    return true;
+  }
+  if (e < -21) return false;
+  // One rounding too many: check against the bounds of the values that
+  // round to the candidate, and step to its neighbour if needed
+  x = (double) w / pow10_f64[-e];
+  for (int tries = 0; tries < 3; tries++) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    const uint64_t mantissa = (bits & ((1ull << 52) - 1)) | (1ull << 52);
+    const int      exp2 = (int) (bits >> 52) - 1075;
+    const int above = compare_decimal(w, -e, 2 * mantissa + 1, exp2 - 1);
+    const int below = (mantissa == (1ull << 52)) ? compare_decimal(w, -e, 4 * mantissa - 1, exp2 - 2)
+                                                 : compare_decimal(w, -e, 2 * mantissa - 1, exp2 - 1);
+    if (above > 0 || (above == 0 && (mantissa & 1))) {
+      x = nextafter(x, HUGE_VAL);
+    } else if (below < 0 || (below == 0 && (mantissa & 1))) {
+      x = nextafter(x, 0.0);
+    } else {
+      return true;
+    }
+  }
+  return false;
+#else
+  return false;
+#endif
+}
+
+static inline bool is_list_space(char c)
+{
+  return list_chars[(unsigned char) c] == CHAR_SPACE;
+}
+
+// Read one plain decimal number from p, ending at end or at a list separator;
+// returns the end of the number, or NULL if it is not one (or if Tcl would
+// read it differently: octal, hex, Inf, NaN...)
+static const char * read_decimal(const char *p, const char *end, double &x)
+{
+  const char *const start = p;
+  const bool negative = (*p == '-');
+  if (*p == '-' || *p == '+') p++;
+  // Tcl reads integers with a leading zero as octal
+  if (p + 1 < end && p[0] == '0' && p[1] >= '0' && p[1] <= '9') return NULL;
+  uint64_t w = 0;          // the first 19 significant digits
+  int      digits = 0;     // seen
+  int      significant = 0;
+  int      scale = 0;      // decimal exponent of w
+  bool     point = false;
+  for (; p < end; p++) {
+    if (*p >= '0' && *p <= '9') {
+      digits++;
+      if (w || *p != '0') significant++;
+      if (significant <= 19) {
+        w = w * 10 + (*p - '0');
+        scale -= point;
+      } else {
+        scale += !point;
+      }
+    } else if (*p == '.' && !point) {
+      point = true;
+    } else {
+      break;
+    }
+  }
+  if (!digits) return NULL;
+  bool exponent = false;
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    const bool minus = (p < end && *p == '-');
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    int e = 0;
+    const char *first = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+      if (e < 100000) e = e * 10 + (*p - '0');
+    }
+    if (p == first) return NULL;
+    scale += minus ? -e : e;
+    exponent = true;
+  }
+  if (p < end && !is_list_space(*p)) return NULL;
+
+  if (significant <= 19 && decimal_to_double(w, scale, x)) {
+    // Integers have no negative zero
+    if (negative && (x != 0.0 || point || exponent)) x = -x;
+    return p;
+  }
+  char copy[64];
+  if ((size_t) (p - start) >= sizeof(copy)) return NULL;
+  memcpy(copy, start, p - start);
+  copy[p - start] = '\0';
+  return (Tcl_GetDouble(NULL, copy, &x) == TCL_OK) ? p : NULL;
+}
+
+// Number of words of a string, if it is a list of plain words (no braces,
+// quotes or backslashes); 0 otherwise
+static size_t count_words(const char *s, size_t len)
+{
+  size_t n = 0;
+  bool   space = true;
+  for (size_t i = 0; i < len; i++) {
+    const int c = list_chars[(unsigned char) s[i]];
+    if (c == CHAR_QUOTE) return 0;
+    n += (space && c == CHAR_PLAIN);
+    space = (c == CHAR_SPACE);
+  }
+  return n;
+}
+
+// Read a list of plain decimal numbers (count_words of them) into x; false
+// if some word is not one
+static bool read_numbers(const char *s, size_t len, double *x)
+{
+  const char *p = s;
+  const char *const end = s + len;
+  size_t i = 0;
+  for (;;) {
+    while (p < end && is_list_space(*p)) p++;
+    if (p == end) return true;
+    p = read_decimal(p, end, x[i++]);
+    if (!p) return false;
+  }
+}
+
+// Whether the first word of a string is a plain decimal number
+static bool starts_with_number(Tcl_Obj *obj)
+{
+  const char *p = obj->bytes;
+  const char *const end = p + obj->length;
+  double      x;
+  while (p < end && is_list_space(*p)) p++;
+  return p < end && read_decimal(p, end, x) != NULL;
+}
+
+// Strings not parsed as lists yet (pure strings, or with another rep)
+static inline bool is_text(Tcl_Obj *obj)
+{
+  return obj->bytes && obj->typePtr != list_obj_type;
+}
+
+// Room needed by print_f64 and print_fixed (sign, 309 digits, point, 17 decimals)
+static const size_t NUMBER_SPACE = 336;
+
+static char * print_digits(uint64_t u, char *out)
+{
+  char tmp[20];
+  int  n = 0;
+  do {
+    tmp[n++] = (char) ('0' + u % 10);
+    u /= 10;
+  } while (u);
+  while (n) *out++ = tmp[--n];
+  return out;
+}
+
+static inline char * print_i64(int64_t v, char *out)
+{
+  if (v < 0) *out++ = '-';
+  return print_digits(v < 0 ? 0 - (uint64_t) v : (uint64_t) v, out);
+}
+
+static char * print_nonfinite(double x, char *out)
+{
+  Tcl_PrintDouble(NULL, x, out);
+  return out + strlen(out);
+}
+
+#ifdef __SIZEOF_INT128__
+// value * 10^exp10 (value > 0), laid out as Tcl_PrintDouble does: returns the end
+static char * print_decimal(uint64_t value, int exp10, char *out)
+{
+  char digits[20];
+  const int n = (int) (print_digits(value, digits) - digits);
+  const int e = exp10 + n - 1;   // of the first digit
+  if (e < -4 || e > 16) {
+    *out++ = digits[0];
+    if (n > 1) {
+      *out++ = '.';
+      memcpy(out, digits + 1, n - 1);
+      out += n - 1;
+    }
+    *out++ = 'e';
+    *out++ = (e < 0) ? '-' : '+';
+    return print_digits(e < 0 ? -e : e, out);
+  }
+  if (e < 0) {
+    memcpy(out, "0.0000", 1 - e);
+    out += 1 - e;
+    memcpy(out, digits, n);
+    return out + n;
+  }
+  // e + 1 digits before the point, padded with zeros
+  for (int i = 0; i <= e; i++) *out++ = (i < n) ? digits[i] : '0';
+  *out++ = '.';
+  if (n <= e + 1) {
+    *out++ = '0';
+  } else {
+    memcpy(out, digits + e + 1, n - e - 1);
+    out += n - e - 1;
+  }
+  return out;
+}
+#endif
+
+// Shortest text that reads back as x, as Tcl_PrintDouble writes it
+// (tcl_precision 0): returns the end
+static char * print_f64(double x, char *out)
+{
+#ifdef __SIZEOF_INT128__
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  const uint64_t ieee_mantissa = bits & ((1ull << 52) - 1);
+  const uint32_t ieee_exponent = (uint32_t) (bits >> 52) & 0x7ff;
+  if (ieee_exponent == 0x7ff) return print_nonfinite(x, out);
+  if (bits >> 63) *out++ = '-';
+  if (ieee_exponent == 0 && ieee_mantissa == 0) {
+    memcpy(out, "0.0", 3);
+    return out + 3;
+  }
+  uint64_t value;
+  int      exp10;
+  shortest_decimal(ieee_mantissa, ieee_exponent, value, exp10);
+  return print_decimal(value, exp10, out);
+#else
+  Tcl_PrintDouble(NULL, x, out);
+  return out + strlen(out);
+#endif
+}
+
+// Shortest text that reads back as the float x, laid out as print_f64 does:
+// returns the end
+static char * print_f32(float x, char *out)
+{
+#ifdef __SIZEOF_INT128__
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  const uint32_t ieee_mantissa = bits & ((1u << 23) - 1);
+  const uint32_t ieee_exponent = (bits >> 23) & 0xff;
+  if (ieee_exponent == 0xff) return print_nonfinite(x, out);
+  if (bits >> 31) *out++ = '-';
+  if (ieee_exponent == 0 && ieee_mantissa == 0) {
+    memcpy(out, "0.0", 3);
+    return out + 3;
+  }
+  uint64_t value;
+  int      exp10;
+  shortest_decimal_f32(ieee_mantissa, ieee_exponent, value, exp10);
+  return print_decimal(value, exp10, out);
+#else
+  // The shortest digits that read back, through the double nearest to them
+  char buf[TCL_DOUBLE_SPACE];
+  if (!std::isfinite(x)) return print_nonfinite(x, out);
+  for (int digits = 6; digits <= 9; digits++) {
+    snprintf(buf, sizeof(buf), "%.*g", digits, x);
+    if (strtof(buf, NULL) == x) break;
+  }
+  Tcl_PrintDouble(NULL, strtod(buf, NULL), out);
+  return out + strlen(out);
+#endif
+}
+
+// The integer of digits [0, n) divided by 10^decimals
+static char * print_point(const char *digits, int n, int decimals, char *out)
+{
+  if (n <= decimals) {
+    *out++ = '0';
+    if (decimals) *out++ = '.';
+    for (int i = n; i < decimals; i++) *out++ = '0';
+    memcpy(out, digits, n);
+    return out + n;
+  }
+  memcpy(out, digits, n - decimals);
+  out += n - decimals;
+  if (decimals) {
+    *out++ = '.';
+    memcpy(out, digits + n - decimals, decimals);
+    out += decimals;
+  }
+  return out;
+}
+
+// x rounded to a number of decimals (0 to 17), as printf "%.*f" writes it:
+// returns the end
+static char * print_fixed(double x, int decimals, char *out)
+{
+  if (!std::isfinite(x)) return print_nonfinite(x, out);
+#ifdef __SIZEOF_INT128__
+  // Round the shortest decimal of x rather than x itself, which gives the
+  // same digits unless it ends exactly halfway, or unless x may be further
+  // than half the last decimal from it (large x, many decimals)
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  const uint64_t ieee_mantissa = bits & ((1ull << 52) - 1);
+  const uint32_t ieee_exponent = (uint32_t) (bits >> 52) & 0x7ff;
+  uint64_t value = 0;
+  int      exp10 = -decimals;
+  bool     exact = true;
+  if (fabs(x) < 1e15 && x != 0.0) {
+    shortest_decimal(ieee_mantissa, ieee_exponent, value, exp10);
+    if (exp10 >= -decimals) {
+      const double ulp = ldexp(1.0, (ieee_exponent ? (int) ieee_exponent : 1) - 1023 - 52);
+      exact = (ulp * pow10_f64[decimals] <= 0.5);
+    } else {
+      const int drop = -decimals - exp10;
+      char tmp[20];
+      const int n = (int) (print_digits(value, tmp) - tmp);
+      if (drop > n) {
+        value = 0;
+      } else if (drop == n) {
+        const uint64_t half = 5 * (uint64_t) pow10_f64[n - 1];
+        exact = (value != half);
+        value = (value > half);
+      } else {
+        const uint64_t unit = (uint64_t) pow10_f64[drop];
+        const uint64_t rest = value % unit;
+        exact = (rest != unit / 2);
+        value = value / unit + (rest > unit / 2);
+      }
+      exp10 = -decimals;
+    }
+  }
+  if (exact && fabs(x) < 1e15) {
+    char digits[40];
+    char *end = print_digits(value, digits);
+    for (int i = exp10; i > -decimals; i--) *end++ = '0';
+    if (bits >> 63) *out++ = '-';
+    return print_point(digits, (int) (end - digits), decimals, out);
+  }
+#endif
+  return out + snprintf(out, NUMBER_SPACE, "%.*f", decimals, x);
+}
+
+static void vector_free(Tcl_Obj *obj);
+static void vector_dup(Tcl_Obj *src, Tcl_Obj *dup);
+static void vector_update_string(Tcl_Obj *obj);
+static int  vector_set_from_any(Tcl_Interp *interp, Tcl_Obj *obj);
+
+// ptr1: VectorRep holding the data
+static Tcl_ObjType vector_type = {
+  "vecexpr vector",
+  vector_free,
+  vector_dup,
+  vector_update_string,
+  vector_set_from_any
+};
+
+struct VectorRep {
+  SharedBuffer *      data;      // never written once the rep is made
+  ItemType            type;
+  int                 decimals;  // of the string rep (vecexpr -decimals), or -1: shortest
+};
+
+static inline VectorRep * get_vector(Tcl_Obj *obj)
+{
+  return (VectorRep *) obj->internalRep.twoPtrValue.ptr1;
+}
+
+static inline size_t vector_length(const VectorRep &vec)
+{
+  return item_length(vec.data->buf, vec.type);
+}
+
+// New rep of f64 numbers, or taking over the contents of buf (left empty)
+static VectorRep * new_vector_rep(std::vector<double> *buf, const ItemType &type)
+{
+  VectorRep *vec = new VectorRep;
+  vec->data = new SharedBuffer;
+  vec->data->refs = 1;
+  if (buf) vec->data->buf.swap(*buf);
+  vec->type = type;
+  vec->decimals = -1;
+  return vec;
+}
+
+// Copy of a rep, sharing its buffer
+static VectorRep * share_vector_rep(const VectorRep &src)
+{
+  VectorRep *vec = new VectorRep(src);
+  vec->data->refs++;
+  return vec;
+}
+
+static void delete_vector_rep(VectorRep *vec)
+{
+  if (--vec->data->refs == 0) delete vec->data;
+  delete vec;
+}
+
+static void vector_free(Tcl_Obj *obj)
+{
+  delete_vector_rep(get_vector(obj));
+  obj->typePtr = NULL;
+}
+
+static void vector_dup(Tcl_Obj *src, Tcl_Obj *dup)
+{
+  dup->internalRep.twoPtrValue.ptr1 = share_vector_rep(*get_vector(src));
+  dup->typePtr = &vector_type;
+}
+
+// Whether Tcl_PrintDouble writes the shortest text that reads back, as
+// print_f64 does, i.e. tcl_precision is 0 (the default): 17 writes 0.1 with
+// more digits, fewer than 17 round 0.1 + 0.2
+static bool tcl_prints_shortest()
+{
+  char buf[TCL_DOUBLE_SPACE];
+  Tcl_PrintDouble(NULL, 0.1, buf);
+  if (strcmp(buf, "0.1")) return false;
+  Tcl_PrintDouble(NULL, 0.1 + 0.2, buf);
+  return !strcmp(buf, "0.30000000000000004");
+}
+
+static void vector_update_string(Tcl_Obj *obj)
+{
+  const VectorRep &vec = *get_vector(obj);
+  const double * data = vec.data->buf.data();
+  const size_t n = vector_length(vec);
+  const int    decimals = (vec.type.type == VEC_I64) ? -1 : vec.decimals;
+  // Other values of tcl_precision are left to Tcl_PrintDouble
+  const bool   shortest = (decimals < 0 && vec.type.type == VEC_F64 && tcl_prints_shortest());
+
+  // Room for typical elements, grown as needed
+  size_t size = n * (decimals >= 0 ? decimals + 8 : vec.type.type == VEC_F64 ? 20 : 12) + NUMBER_SPACE;
+  char * str = (char *) ckalloc(size);
+  char * p = str;
+  for (size_t i = 0; i < n; i++) {
+    if ((size_t) (p - str) + NUMBER_SPACE + 1 > size) {
+      const size_t used = p - str;
+      size *= 2;
+      str = (char *) ckrealloc(str, size);
+      p = str + used;
+    }
+    if (i) *p++ = ' ';
+    if (vec.type.type == VEC_I64) {
+      p = print_i64(((const i64_alias *) data)[i], p);
+    } else if (decimals >= 0) {
+      p = print_fixed(get_elem(data, vec.type.type, i), decimals, p);
+    } else if (vec.type.type == VEC_F32) {
+      p = print_f32(((const f32_alias *) data)[i], p);
+    } else if (shortest) {
+      p = print_f64(data[i], p);
+    } else {
+      Tcl_PrintDouble(NULL, data[i], p);
+      p += strlen(p);
+    }
+  }
+  *p = '\0';
+  obj->length = p - str;
+  obj->bytes = (char *) ckrealloc(str, obj->length + 1);
+}
+
+// Parse a string of plain decimal numbers into a new vector rep, or return
+// NULL (use the Tcl list parser)
+static VectorRep * read_vector(Tcl_Obj *obj)
+{
+  const size_t n = count_words(obj->bytes, obj->length);
+  if (!n) return NULL;
+  VectorRep *vec = new_vector_rep(NULL, F64_ITEM);
+  vec->data->buf.resize(n);
+  if (!read_numbers(obj->bytes, obj->length, vec->data->buf.data())) {
+    delete_vector_rep(vec);
+    return NULL;
+  }
+  return vec;
+}
+
+static inline void set_vector_rep(Tcl_Obj *obj, VectorRep *vec)
+{
+  if (obj->typePtr && obj->typePtr->freeIntRepProc) {
+    obj->typePtr->freeIntRepProc(obj);
+  }
+  obj->internalRep.twoPtrValue.ptr1 = vec;
+  obj->typePtr = &vector_type;
+}
+
+static int vector_set_from_any(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+  Tcl_Obj **data;
+  int       num;
+
+  if (is_text(obj)) {
+    VectorRep *vec = read_vector(obj);
+    if (vec) {
+      set_vector_rep(obj, vec);
+      return TCL_OK;
+    }
+  }
+  if (Tcl_ListObjGetElements(interp, obj, &num, &data) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  VectorRep *vec = new_vector_rep(NULL, F64_ITEM);
+  vec->data->buf.resize(num);
+  for (int i = 0; i < num; i++) {
+    if (Tcl_GetDoubleFromObj(interp, data[i], &vec->data->buf[i]) != TCL_OK) {
+      delete_vector_rep(vec);
+      return TCL_ERROR;
+    }
+  }
+  Tcl_GetString(obj);
+  set_vector_rep(obj, vec);
+  return TCL_OK;
+}
+
+// Create a vector object holding vec
+static Tcl_Obj * new_rep_obj(VectorRep *vec)
+{
+  Tcl_Obj *obj = Tcl_NewObj();
+  Tcl_InvalidateStringRep(obj);
+  obj->internalRep.twoPtrValue.ptr1 = vec;
+  obj->typePtr = &vector_type;
+  return obj;
+}
+
+// Create a vector object, taking over the contents of buf (left empty)
+static Tcl_Obj * new_vector_obj(std::vector<double> &buf, const ItemType &type)
+{
+  return new_rep_obj(new_vector_rep(&buf, type));
+}
+
+// Classify an argument: returns its compiled program, or NULL for data.
+// Data arguments are lists whose first element parses as a number.
+static int classify_arg(Tcl_Interp *interp, Tcl_Obj *obj, Program **prog)
+{
+  Tcl_Obj **data;
+  int       num;
+  double    scalar;
+
+  *prog = NULL;
+  if (obj->typePtr == &program_type) {
+    *prog = get_program(obj);
+    return TCL_OK;
+  }
+  if (obj->typePtr == &vector_type) {
+    return TCL_OK;
+  }
+  // Keep strings of numbers as they are, for load_data
+  if (is_text(obj) && starts_with_number(obj)) {
+    return TCL_OK;
+  }
+  if (Tcl_ListObjGetElements(interp, obj, &num, &data) != TCL_OK) {
+    Tcl_SetResult(interp, (char *) "vecexpr: error parsing arguments", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if ( !num ) {
+    Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (Tcl_GetDoubleFromObj(NULL, data[0], &scalar) == TCL_OK) {
+    return TCL_OK;
+  }
+  if (program_set_from_any(interp, obj) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  *prog = get_program(obj);
+  return TCL_OK;
+}
+
+// Thread pool
+// Large vectors can be processed by several threads (vecexpr -threads N, or
+// vecexpr::configure -threads N). Each interpreter owns a pool of worker
+// threads, created the first time it is needed and kept for later calls.
+// Work is split into tasks; the calling thread takes tasks too. Workers
+// never touch the caller's Tcl interpreter (see run_map for their own).
+
+typedef void (*TaskFn)(void *ctx, size_t task, int worker);
+
+// Uses Tcl's portable thread API rather than std::thread, so that the
+// extension does not depend on the host's C++ runtime version
+class ThreadPool {
+public:
+  // size: number of threads working on a job, including the caller
+  explicit ThreadPool(int size);
+  ~ThreadPool();
+  int size() const { return workers.size() + 1; }
+  // Run fn(ctx, task, worker) for task = 0 .. ntasks-1, worker = 0 .. size()-1
+  void run(size_t ntasks, TaskFn fn, void *ctx);
+  // Interpreter of the thread of worker, for error messages, created on that
+  // thread when first needed; only that thread may call it (worker 0: the
+  // thread that runs jobs and deletes the pool)
+  Tcl_Interp * scratch_interp(int worker);
+
+private:
+  struct Worker {
+    ThreadPool * pool;
+    int          index;
+    Tcl_ThreadId id;
+  };
+  static Tcl_ThreadCreateType worker_main(ClientData clientData);
+  void work(int worker);
+  void worker_loop(int worker);
+
+  std::vector<Worker>  workers;
+  std::vector<Tcl_Interp *> interps;  // scratch, by worker (NULL until needed)
+  Tcl_Mutex            mutex;
+  Tcl_Condition        wake;
+  Tcl_Condition        done;
+  TaskFn               job_fn;
+  void *               job_ctx;
+  size_t               job_ntasks;
+  std::atomic<size_t>  next_task;
+  int                  busy;        // workers still running the current job
+  unsigned long        generation;  // incremented for each job
+  bool                 quit;
+};
+
+ThreadPool::ThreadPool(int size)
+  : mutex(NULL), wake(NULL), done(NULL), job_fn(NULL), job_ctx(NULL), job_ntasks(0),
+    next_task(0), busy(0), generation(0), quit(false)
+{
+  workers.resize(size > 1 ? size - 1 : 0);
+  interps.resize(workers.size() + 1, NULL);
+  for (size_t w = 0; w < workers.size(); w++) {
+    workers[w].pool = this;
+    workers[w].index = w + 1;
+    if (Tcl_CreateThread(&workers[w].id, worker_main, (ClientData) &workers[w],
+                         TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+      // e.g. Tcl built without threads: run with the workers we have
+      workers.resize(w);
+      break;
+    }
+  }
+  interps.resize(workers.size() + 1);
+}
+
+ThreadPool::~ThreadPool()
+{
+  Tcl_MutexLock(&mutex);
+  quit = true;
+  Tcl_ConditionNotify(&wake);
+  Tcl_MutexUnlock(&mutex);
+  for (size_t w = 0; w < workers.size(); w++) {
+    int result;
+    Tcl_JoinThread(workers[w].id, &result);
+  }
+  if (interps[0]) Tcl_DeleteInterp(interps[0]);
+  Tcl_ConditionFinalize(&wake);
+  Tcl_ConditionFinalize(&done);
+  Tcl_MutexFinalize(&mutex);
+}
+
+Tcl_ThreadCreateType ThreadPool::worker_main(ClientData clientData)
+{
+  Worker *worker = (Worker *) clientData;
+  worker->pool->worker_loop(worker->index);
+  Tcl_Interp *interp = worker->pool->interps[worker->index];
+  if (interp) Tcl_DeleteInterp(interp);
+  Tcl_ExitThread(0);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+Tcl_Interp * ThreadPool::scratch_interp(int worker)
+{
+  if (!interps[worker]) interps[worker] = Tcl_CreateInterp();
+  return interps[worker];
+}
+
+void ThreadPool::work(int worker)
+{
+  size_t task;
+  while ((task = next_task++) < job_ntasks) {
+    job_fn(job_ctx, task, worker);
+  }
+}
+
+void ThreadPool::worker_loop(int worker)
+{
+  unsigned long seen = 0;
+  for (;;) {
+    Tcl_MutexLock(&mutex);
+    while (!quit && generation == seen) Tcl_ConditionWait(&wake, &mutex, NULL);
+    if (quit) {
+      Tcl_MutexUnlock(&mutex);
+      return;
+    }
+    seen = generation;
+    Tcl_MutexUnlock(&mutex);
+
+    work(worker);
+
+    Tcl_MutexLock(&mutex);
+    if (--busy == 0) Tcl_ConditionNotify(&done);
+    Tcl_MutexUnlock(&mutex);
+  }
+}
+
+void ThreadPool::run(size_t ntasks, TaskFn fn, void *ctx)
+{
+  Tcl_MutexLock(&mutex);
+  job_fn = fn;
+  job_ctx = ctx;
+  job_ntasks = ntasks;
+  next_task = 0;
+  busy = workers.size();
+  generation++;
+  Tcl_ConditionNotify(&wake);
+  Tcl_MutexUnlock(&mutex);
+
+  work(0);
+
+  Tcl_MutexLock(&mutex);
+  while (busy > 0) Tcl_ConditionWait(&done, &mutex, NULL);
+  Tcl_MutexUnlock(&mutex);
+}
+
+// Buffer pool
+// Vector storage used while evaluating (the stack, the register, temporaries)
+// is recycled through a per-interpreter pool, so that repeated calls on
+// vectors of similar sizes do not allocate once the pool is warm. Free
+// buffers are kept by size class: class c holds buffers of capacity at least
+// 2^c. Vectors handed to Tcl (results, >varName) own their storage and are not
+// part of the pool. Only the interpreter's thread uses the pool.
+
+static const size_t POOL_CLASSES = 48;
+static const size_t POOL_ROUND_MAX = 1 << 16;        // larger buffers are allocated to size
+static const size_t POOL_MAX_BYTES = 64 << 20;       // free buffers kept, per interpreter
+
+class BufferPool {
+public:
+  BufferPool() : allocations(0), reuses(0), frees(0), cached(0), cached_bytes(0) {}
+  // Give v (whose contents are discarded) room for n doubles, and size n
+  void take(std::vector<double> &v, size_t n);
+  // Return the storage of v to the pool, leaving v empty
+  void give(std::vector<double> &v);
+  void reset_counters() { allocations = reuses = frees = 0; }
+
+  Tcl_WideInt allocations;   // buffers allocated from the heap
+  Tcl_WideInt reuses;        // buffers served from the pool
+  Tcl_WideInt frees;         // buffers released to the heap (pool full)
+  size_t      cached;        // free buffers in the pool
+  size_t      cached_bytes;
+
+private:
+  std::vector<std::vector<double> > free_list[POOL_CLASSES];
+};
+
+// Smallest c such that 2^c >= n
+static inline size_t size_class_up(size_t n)
+{
+  size_t c = 0;
+  while (c + 1 < POOL_CLASSES && ((size_t) 1 << c) < n) c++;
+  return c;
+}
+
+// Largest c such that 2^c <= n (n > 0)
+static inline size_t size_class_down(size_t n)
+{
+  size_t c = 0;
+  while (c + 1 < POOL_CLASSES && ((size_t) 2 << c) <= n) c++;
+  return c;
+}
+
+void BufferPool::take(std::vector<double> &v, size_t n)
+{
+  if (v.capacity() >= n) {
+    v.resize(n);
+    return;
+  }
+  give(v);
+  const size_t c = size_class_up(n);
+  // Buffers allocated to size sit one class below
+  const size_t first = (c > 0) ? c - 1 : c;
+  for (size_t k = first; k < POOL_CLASSES && k <= c + 1; k++) {
+    std::vector<std::vector<double> > &list = free_list[k];
+    if (list.empty() || list.back().capacity() < n) continue;
+    v.swap(list.back());
+    list.pop_back();
+    cached--;
+    cached_bytes -= v.capacity() * sizeof(double);
+    reuses++;
+    v.resize(n);
+    return;
+  }
+  allocations++;
+  v.reserve(n <= POOL_ROUND_MAX ? (size_t) 1 << c : n);
+  v.resize(n);
+}
+
+void BufferPool::give(std::vector<double> &v)
+{
+  const size_t bytes = v.capacity() * sizeof(double);
+  if (bytes == 0) return;
+  if (cached_bytes + bytes > POOL_MAX_BYTES) {
+    std::vector<double>().swap(v);
+    frees++;
+    return;
+  }
+  std::vector<std::vector<double> > &list = free_list[size_class_down(v.capacity())];
+  list.push_back(std::vector<double>());
+  list.back().swap(v);
+  cached++;
+  cached_bytes += bytes;
+}
+
+// Profiling (vecexpr::stats)
+// When enabled for an interpreter, vecexpr records the calls, elements and
+// time spent in each phase of a command and in each operator. Fused chains of
+// element-wise operators are recorded as a whole, under their operator names.
+struct ProfileEntry {
+  Tcl_WideInt calls;
+  Tcl_WideInt elements;
+  Tcl_WideInt ns;
+};
+
+enum ProfilePhase {
+  PHASE_TOTAL,    // whole commands
+  PHASE_COMPILE,  // classifying and compiling the arguments
+  PHASE_INPUT,    // pushing data arguments and constants (parsing lists)
+  PHASE_RESULT,   // building the result object
+  PHASE_COUNT
+};
+
+static const char * const phase_names[PHASE_COUNT] = { "total", "compile", "input", "result" };
+
+struct Profile {
+  ProfileEntry phases[PHASE_COUNT];
+  ProfileEntry ops[OP_NUM];
+  std::map<std::string, ProfileEntry> chains;  // fused chains, by their operators
+};
+
+static inline Tcl_WideInt profile_clock()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Count a call on elements started at start (a profile_clock time)
+static inline void profile_add(ProfileEntry &entry, size_t elements, Tcl_WideInt start)
+{
+  entry.calls++;
+  entry.elements += elements;
+  entry.ns += profile_clock() - start;
+}
+
+static void profile_reset(Profile &profile)
+{
+  memset(profile.phases, 0, sizeof(profile.phases));
+  memset(profile.ops, 0, sizeof(profile.ops));
+  profile.chains.clear();
+}
+
+struct Machine;
+struct MapWorker;
+struct AsyncQueue;
+
+// Per-interpreter state, shared by the vecexpr commands
+struct VecexprState {
+  int          threads;       // default number of threads
+  size_t       threshold;     // vectors shorter than this are processed serially
+  ThreadPool * pool;
+  int          pool_threads;  // size requested for pool (it may have fewer threads)
+  BufferPool   buffers;
+  std::vector<Machine *> machines;  // idle machines, kept with their scratch space
+  std::vector<MapWorker *> map_workers;  // one per thread of the pool (see run_map)
+  AsyncQueue * async;         // jobs of vecexpr -async
+  int          running;       // commands running (more than one if nested)
+  bool         profiling;     // see vecexpr::stats
+  Profile      profile;
+};
+
+static const size_t DEFAULT_THRESHOLD = 65536;
+
+// Return a pool of the requested size, or NULL if running serially
+static ThreadPool * get_pool(VecexprState *state, int threads)
+{
+#ifndef TCL_THREADS
+  // tcl.h turns mutexes and conditions into no-ops: run serially
+  threads = 1;
+#endif
+  if (threads < 2) return NULL;
+  if (state->pool && state->pool_threads != threads && state->running > 1) {
+    // Nested command: the pool is in use by the outer one
+    return state->pool->size() > 1 ? state->pool : NULL;
+  }
+  if (state->pool && state->pool_threads != threads) {
+    delete state->pool;
+    state->pool = NULL;
+  }
+  if (!state->pool) {
+    state->pool = new ThreadPool(threads);
+    state->pool_threads = threads;
+  }
+  return state->pool->size() > 1 ? state->pool : NULL;
+}
+
+struct MachineScratch;
+struct Stream;
+
+// Named register (store:name recall:name; store and recall use name ""),
+// holding a shared view
+struct Register {
+  std::string name;
+  ItemType    item;
+};
+
+// Value of >varName or &varName, kept until the command can set the variable
+// (see obj_vecexpr -async)
+struct VarWrite {
+  std::string         name;
+  std::vector<double> buf;
+  ItemType            type;
+  bool                binary;   // >bytes: the value is bytes instead
+  std::vector<unsigned char> bytes;
+};
+
+// Evaluation state of one vecexpr command. Machines are reused by later
+// calls (see acquire_machine), keeping the capacity of their containers
+struct Machine {
+  std::vector<std::vector<double> > stack;
+  std::vector<ItemType> types;     // of the stack items
+  std::vector<Register> regs;      // registers stored by the command
+  std::vector<SharedBuffer *> free_shared;  // unused, kept for share_item
+  ThreadPool *        pool;        // NULL: serial
+  size_t              threshold;   // minimum work size for using the pool
+  BufferPool *        buffers;
+  std::vector<std::vector<double> > per_worker;  // temporary buffers for each worker
+  MachineScratch *    scratch;     // see obj_vecexpr and run_fused
+  Stream *            stream;      // NULL unless streaming (see run_stream)
+  Profile *           profile;     // NULL unless profiling
+  std::vector<VarWrite> * var_writes;  // NULL: >varName and &varName set the variables
+  const std::atomic<bool> * cancel;    // NULL, or stops the command before its next step
+  int                 decimals;    // of the results, or -1: shortest (vecexpr -decimals)
+};
+
+// Push a buffer for n elements of type (contents unspecified) from the pool
+static inline std::vector<double> & push_typed(Machine &m, size_t n, VecType type)
+{
+  m.stack.push_back(std::vector<double>());
+  m.types.push_back(item_type(type, n));
+  m.buffers->take(m.stack.back(), buffer_words(type, n));
+  return m.stack.back();
+}
+
+// Push a buffer of n doubles (contents unspecified) from the pool
+static inline std::vector<double> & push_new(Machine &m, size_t n)
+{
+  return push_typed(m, n, VEC_F64);
+}
+
+// Drop the reference of an item or register to its shared buffer, returning
+// the buffer to the pool with the last one
+static inline void release_shared(Machine &m, ItemType &t)
+{
+  if (!t.shared) return;
+  if (--t.shared->refs == 0) {
+    m.buffers->give(t.shared->buf);
+    m.free_shared.push_back(t.shared);
+  }
+  t.shared = NULL;
+}
+
+// Pop the top of the stack, returning its storage to the pool
+static inline void pop(Machine &m)
+{
+  release_shared(m, m.types.back());
+  m.buffers->give(m.stack.back());
+  m.stack.pop_back();
+  m.types.pop_back();
+}
+
+static void clear_stack(Machine &m)
+{
+  while (!m.stack.empty()) pop(m);
+}
+
+static Register * find_register(Machine &m, const std::string &name)
+{
+  for (size_t r = 0; r < m.regs.size(); r++) {
+    if (m.regs[r].name == name) return &m.regs[r];
+  }
+  return NULL;
+}
+
+static inline void swap_items(Machine &m, size_t i, size_t j)
+{
+  m.stack[i].swap(m.stack[j]);
+  std::swap(m.types[i], m.types[j]);
+}
+
+static inline size_t stack_length(const Machine &m, size_t i)
+{
+  return item_length(m.stack[i], m.types[i]);
+}
+
+// Buffer holding the elements of item i
+static inline const double * item_data(const Machine &m, size_t i)
+{
+  const ItemType &t = m.types[i];
+  return t.shared ? t.shared->buf.data() : m.stack[i].data();
+}
+
+// Element k of item i (of a view: element k of the view)
+static inline double item_elem(const Machine &m, size_t i, size_t k)
+{
+  const ItemType &t = m.types[i];
+  return get_elem(item_data(m, i), t.type, t.stride ? t.offset + k * t.stride : k);
+}
+
+// Make item i a view of a shared buffer, which other items can then share
+static void share_item(Machine &m, size_t i)
+{
+  ItemType &t = m.types[i];
+  if (t.shared) return;
+  if (m.free_shared.empty()) {
+    t.shared = new SharedBuffer;
+  } else {
+    t.shared = m.free_shared.back();
+    m.free_shared.pop_back();
+  }
+  t.shared->refs = 1;
+  t.length = stack_length(m, i);
+  t.shared->buf.swap(m.stack[i]);
+  if (t.stride == 0) {
+    t.offset = 0;
+    t.stride = 1;
+  }
+}
+
+// Copy the elements of item i into dest, a pool buffer, contiguously
+static void copy_item(Machine &m, size_t i, std::vector<double> &dest)
+{
+  const ItemType &t = m.types[i];
+  const size_t    n = stack_length(m, i);
+  const double *  data = item_data(m, i);
+  m.buffers->take(dest, buffer_words(t.type, n));
+  if (t.stride == 0) {
+    memcpy(dest.data(), data, m.stack[i].size() * sizeof(double));
+  } else if (t.type == VEC_F32) {
+    const f32_alias *src = (const f32_alias *) data + t.offset;
+    f32_alias *d = (f32_alias *) dest.data();
+    for (size_t k = 0; k < n; k++) d[k] = src[k * t.stride];
+  } else if (t.stride == 1) {
+    memcpy(dest.data(), data + t.offset, n * sizeof(double));
+  } else {
+    // f64 and i64: copy the bits
+    const i64_alias *src = (const i64_alias *) data + t.offset;
+    i64_alias *d = (i64_alias *) dest.data();
+    for (size_t k = 0; k < n; k++) d[k] = src[k * t.stride];
+  }
+}
+
+// If item i is the last view of a whole shared buffer, give it the buffer
+// back without copying; returns false if it is still a view
+static bool reclaim(Machine &m, size_t i)
+{
+  ItemType &t = m.types[i];
+  if (t.stride == 0) return true;
+  if (!t.shared || t.shared->refs > 1 || t.offset != 0 || t.stride != 1
+      || t.shared->buf.size() != buffer_words(t.type, t.length)) {
+    return false;
+  }
+  m.stack[i].swap(t.shared->buf);
+  release_shared(m, t);
+  t = item_type(t.type, t.length);
+  return true;
+}
+
+// Turn item i, if it is a view, into a vector with a buffer of its own
+static void materialize(Machine &m, size_t i)
+{
+  if (reclaim(m, i)) return;
+  std::vector<double> buf;
+  copy_item(m, i, buf);
+  m.stack[i].swap(buf);
+  m.buffers->give(buf);
+  release_shared(m, m.types[i]);
+  m.types[i] = item_type(m.types[i].type, m.types[i].length);
+}
+
+// Materialize the top count items of the stack
+static void materialize_top(Machine &m, int count)
+{
+  const size_t size = m.stack.size();
+  for (size_t i = (size > (size_t) count) ? size - count : 0; i < size; i++) materialize(m, i);
+}
+
+// Convert a buffer of the pool to type; fails (with a message in interp, if
+// not NULL) when converting elements that are not finite or too large to i64
+static int convert_buffer(Tcl_Interp *interp, BufferPool &pool, std::vector<double> &buf, ItemType &t,
+                          VecType type)
+{
+  const VecType from = t.type;
+  const size_t  n = item_length(buf, t);
+  if (from == type) return TCL_OK;
+
+  if (from == VEC_F32) {
+    // Widen into a new buffer
+    std::vector<double> wide;
+    pool.take(wide, n);
+    const f32_alias *src = (const f32_alias *) buf.data();
+    if (type == VEC_F64) {
+      for (size_t i = 0; i < n; i++) wide[i] = src[i];
+    } else {
+      i64_alias *dest = (i64_alias *) wide.data();
+      for (size_t i = 0; i < n; i++) {
+        if (!floor_i64(src[i], dest[i])) {
+          pool.give(wide);
+          goto range;
+        }
+      }
+    }
+    buf.swap(wide);
+    pool.give(wide);
+  } else if (type == VEC_F32) {
+    // Narrow in place: float i never overwrites an element after i
+    f32_alias *dest = (f32_alias *) buf.data();
+    if (from == VEC_F64) {
+      for (size_t i = 0; i < n; i++) dest[i] = buf[i];
+    } else {
+      const i64_alias *src = (const i64_alias *) buf.data();
+      for (size_t i = 0; i < n; i++) dest[i] = src[i];
+    }
+    buf.resize(buffer_words(VEC_F32, n));
+  } else if (type == VEC_F64) {
+    const i64_alias *src = (const i64_alias *) buf.data();
+    for (size_t i = 0; i < n; i++) buf[i] = (double) src[i];
+  } else {
+    i64_alias *dest = (i64_alias *) buf.data();
+    for (size_t i = 0; i < n; i++) {
+      int64_t v;
+      if (!floor_i64(buf[i], v)) goto range;
+      dest[i] = v;
+    }
+  }
+  t = item_type(type, n);
+  return TCL_OK;
+
+range:
+  if (interp) {
+    Tcl_SetResult(interp, (char *) "vecexpr: value out of range for i64 (or not a number)", TCL_STATIC);
+  }
+  return TCL_ERROR;
+}
+
+static inline int convert_item(Tcl_Interp *interp, Machine &m, size_t i, VecType type)
+{
+  if (m.types[i].type == type) return TCL_OK;
+  materialize(m, i);
+  return convert_buffer(interp, *m.buffers, m.stack[i], m.types[i], type);
+}
+
+// Convert the top count items of the stack to f64
+static void widen_top(Machine &m, int count)
+{
+  const size_t size = m.stack.size();
+  for (size_t i = (size > (size_t) count) ? size - count : 0; i < size; i++) {
+    convert_item(NULL, m, i, VEC_F64);
+  }
+}
+
+// Take one buffer of n doubles per worker in m.per_worker (contents
+// unspecified), for the given number of workers or all of them
+static void take_per_worker(Machine &m, size_t n, size_t workers = 0)
+{
+  m.per_worker.resize(workers ? workers : m.pool ? m.pool->size() : 1);
+  for (size_t w = 0; w < m.per_worker.size(); w++) m.buffers->take(m.per_worker[w], n);
+}
+
+static void give_per_worker(Machine &m)
+{
+  for (size_t w = 0; w < m.per_worker.size(); w++) m.buffers->give(m.per_worker[w]);
+}
+
+// Results up to this length are copied into new vector objects, keeping the
+// buffer in the pool; longer ones are handed over
+static const size_t RESULT_COPY_MAX = 4096;
+
+// decimals: of the string rep, or -1 for the shortest (see vecexpr -decimals)
+static Tcl_Obj * new_result_obj(std::vector<double> &buf, const ItemType &type, int decimals)
+{
+  Tcl_Obj *obj;
+  if (buf.size() > RESULT_COPY_MAX) {
+    obj = new_vector_obj(buf, type);
+  } else {
+    std::vector<double> copy(buf);
+    obj = new_vector_obj(copy, type);
+  }
+  get_vector(obj)->decimals = decimals;
+  return obj;
+}
+
+// Vector rep of a data argument: its own, or plain numbers parsed into a new
+// one, which is kept (as the list would be) for later calls; NULL for other
+// lists (see load_data)
+static VectorRep * data_vector(Tcl_Obj *obj)
+{
+  if (obj->typePtr == &vector_type) return get_vector(obj);
+  // Never shimmer a program that may be running
+  if (obj->typePtr == &program_type || !is_text(obj)) return NULL;
+  VectorRep *vec = read_vector(obj);
+  if (vec) set_vector_rep(obj, vec);
+  return vec;
+}
+
+// Load a vector object, or parse a Tcl list of numbers (as f64), into dest (a
+// pool buffer) and its type
+static int load_data(Tcl_Interp *interp, Tcl_Obj *obj, Machine &m, std::vector<double> &dest, ItemType &type)
+{
+  Tcl_Obj **data;
+  int       num;
+  double    scalar;
+
+  if (obj->typePtr == &program_type) {
+    Tcl_SetResult(interp, (char *) "vecexpr: error parsing vector element as floating-point", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  const VectorRep *vec = data_vector(obj);
+  if (vec) {
+    const std::vector<double> &buf = vec->data->buf;
+    if (buf.empty()) {
+      Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    m.buffers->take(dest, buf.size());
+    memcpy(dest.data(), buf.data(), buf.size() * sizeof(double));
+    type = vec->type;
+    return TCL_OK;
+  }
+  if (Tcl_ListObjGetElements(interp, obj, &num, &data) != TCL_OK) {
+    Tcl_SetResult(interp, (char *) "vecexpr: error parsing arguments", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if ( !num ) {
+    Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  m.buffers->take(dest, num);
+  type = F64_ITEM;
+  for (int i = 0; i < num; i++) {
+    if (Tcl_GetDoubleFromObj(interp, data[i], &scalar) != TCL_OK) {
+      Tcl_SetResult(interp, (char *) "vecexpr: error parsing vector element as floating-point", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    dest[i] = scalar;
+  }
+  return TCL_OK;
+}
+
+// Push a vector object as a view of its buffer, which is only copied if the
+// item is written (see materialize)
+static void push_vector(Machine &m, const VectorRep &vec)
+{
+  ItemType t = vec.type;
+  t.length = vector_length(vec);
+  t.offset = 0;
+  t.stride = 1;
+  t.shared = vec.data;
+  t.shared->refs++;
+  m.stack.push_back(std::vector<double>());
+  m.types.push_back(t);
+}
+
+// Push a vector object, or parse a Tcl list of numbers and push it onto the stack
+static int push_data(Tcl_Interp *interp, Tcl_Obj *obj, Machine &m)
+{
+  const VectorRep *vec = data_vector(obj);
+  if (vec) {
+    if (vec->data->buf.empty()) {
+      Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    push_vector(m, *vec);
+    return TCL_OK;
+  }
+  m.stack.push_back(std::vector<double>());
+  m.types.push_back(F64_ITEM);
+  return load_data(interp, obj, m, m.stack.back(), m.types.back());
+}
+
+// Is obj read as i64 by load_ints? Vector objects already have a type
+static inline bool reads_ints(Tcl_Obj *obj)
+{
+  return obj->typePtr != &vector_type && obj->typePtr != &program_type;
+}
+
+// Read a Tcl list of numbers followed by i64 (see run_steps) straight into
+// an i64 vector: integers exactly, as Tcl reads them, rather than through a
+// double (which holds 53 bits), and other numbers rounded down as i64 does
+static int load_ints(Tcl_Interp *interp, Tcl_Obj *obj, Machine &m, std::vector<double> &dest, ItemType &type)
+{
+  Tcl_Obj **data;
+  int       num;
+  if (Tcl_ListObjGetElements(interp, obj, &num, &data) != TCL_OK) {
+    Tcl_SetResult(interp, (char *) "vecexpr: error parsing arguments", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if ( !num ) {
+    Tcl_SetResult(interp, (char *) "vecexpr: empty list passed as argument", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  m.buffers->take(dest, num);
+  i64_alias *ints = (i64_alias *) dest.data();
+  for (int i = 0; i < num; i++) {
+    Tcl_WideInt wide;
+    double      scalar;
+    int64_t     value;
+    if (Tcl_GetWideIntFromObj(NULL, data[i], &wide) == TCL_OK) {
+      // Tcl wraps integers of up to 64 bits
+      const char *p = Tcl_GetString(data[i]);
+      while (is_list_space(*p)) p++;
+      if (*p == '-' ? wide > 0 : wide < 0) {
+        Tcl_SetResult(interp, (char *) "vecexpr: value out of range for i64 (or not a number)", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      ints[i] = wide;
+      continue;
+    }
+    if (Tcl_GetDoubleFromObj(NULL, data[i], &scalar) != TCL_OK) {
+      Tcl_SetResult(interp, (char *) "vecexpr: error parsing vector element as floating-point", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (!floor_i64(scalar, value)) {
+      Tcl_SetResult(interp, (char *) "vecexpr: value out of range for i64 (or not a number)", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    ints[i] = value;
+  }
+  type = item_type(VEC_I64, num);
+  return TCL_OK;
+}
+
+// New vector object with the value of a data argument or variable, which
+// other threads may read: it shares the buffer of a vector object, and other
+// values are parsed without converting obj (as i64 if ints: followed by i64,
+// see run_steps). NULL on error, with the message in interp
+static Tcl_Obj * private_vector(Tcl_Interp *interp, Tcl_Obj *obj, Machine &m, bool ints)
+{
+  if (obj->typePtr == &vector_type) return new_rep_obj(share_vector_rep(*get_vector(obj)));
+  VectorRep *vec = (!ints && obj->typePtr != &program_type && is_text(obj)) ? read_vector(obj) : NULL;
+  if (vec) return new_rep_obj(vec);
+  std::vector<double> buf;
+  ItemType            type;
+  if ((ints && reads_ints(obj) ? load_ints(interp, obj, m, buf, type) : load_data(interp, obj, m, buf, type)) != TCL_OK) {
+    m.buffers->give(buf);
+    return NULL;
+  }
+  return new_vector_obj(buf, type);
+}
+
+// Split work into tasks of TASK_SIZE elements (a multiple of the fusion chunk size)
+static const size_t TASK_SIZE = 32768;
+
+// Number of workers that run_tasks uses
+static inline size_t task_workers(const Machine &m, size_t work, size_t ntasks)
+{
+  return (m.pool && ntasks > 1 && work >= m.threshold) ? m.pool->size() : 1;
+}
+
+// Run tasks on the pool if the amount of work (elements) is large enough
+static void run_tasks(Machine &m, size_t work, size_t ntasks, TaskFn fn, void *ctx)
+{
+  if (task_workers(m, work, ntasks) > 1) {
+    m.pool->run(ntasks, fn, ctx);
+  } else {
+    for (size_t task = 0; task < ntasks; task++) fn(ctx, task, 0);
+  }
+}
+
+// Matrix product C = A B, with A ni x nk and B nk x nj (row-major)
+// Large products use a packed, cache-blocked kernel: B is copied once into
+// panels of GEMM_NR columns, and each task copies a block of GEMM_MC rows of A
+// into panels of GEMM_MR rows, GEMM_KC columns at a time, so that the
+// micro-kernel (gemm_kernel, see SIMD math kernels) reads both operands
+// contiguously while its GEMM_MR x GEMM_NR block of C stays in registers.
+// Each element of C is summed in order of k, whatever the blocking or the
+// number of threads.
+static const size_t GEMM_MR = 6;
+static const size_t GEMM_NR = 8;
+static const size_t GEMM_KC = 256;  // packed A block (GEMM_MC x GEMM_KC) fits in L2
+static const size_t GEMM_MC = 96;
+// Products with fewer multiply-adds, or too narrow for the packed kernel, use
+// a simple loop
+static const size_t GEMM_MIN_WORK = 32768;
+
+// Multiply a GEMM_MR-row panel of A (kc x GEMM_MR) by a GEMM_NR-column panel of
+// B (kc x GEMM_NR) into the GEMM_MR x GEMM_NR block c (row length ldc),
+// adding to its previous contents if accumulate is set
+typedef void (*GemmKernel)(size_t kc, const double *a, const double *b, double *c, size_t ldc,
+                           bool accumulate);
+static GemmKernel gemm_kernel = NULL;  // set by select_kernels
+
+struct MatmultJob {
+  const double *mat1;
+  const double *mat2;
+  double *      result;
+  size_t        ni, nk, nj;
+  size_t        rows_per_task;
+  std::vector<double> packed2;                 // B in panels (packed kernel only)
+  std::vector<std::vector<double> > *packed1;  // per worker, GEMM_MC x GEMM_KC at most
+};
+
+static const size_t MATMULT_TASK_WORK = 1 << 20; // multiply-adds per task (simple loop)
+
+static void matmult_simple_task(void *ctx, size_t task, int)
+{
+  const MatmultJob &job = *(const MatmultJob *) ctx;
+  const size_t i0 = task * job.rows_per_task;
+  const size_t i1 = (job.ni - i0 < job.rows_per_task) ? job.ni : i0 + job.rows_per_task;
+  for (size_t i = i0; i < i1; i++) {
+    const double *row1 = job.mat1 + i * job.nk;
+    double *row = job.result + i * job.nj;
+    for (size_t j = 0; j < job.nj; j++) row[j] = 0.0;
+    for (size_t k = 0; k < job.nk; k++) {
+      const double a = row1[k];
+      const double *row2 = job.mat2 + k * job.nj;
+      for (size_t j = 0; j < job.nj; j++) row[j] += a * row2[j];
+    }
+  }
+}
+
+// Copy B into job.packed2: for each block of GEMM_KC rows (p), each panel of
+// GEMM_NR columns is stored contiguously, row by row, padded with zeros
+static void gemm_pack2(MatmultJob &job)
+{
+  double *dest = job.packed2.data();
+  for (size_t p = 0; p < job.nk; p += GEMM_KC) {
+    const size_t kc = (job.nk - p < GEMM_KC) ? job.nk - p : GEMM_KC;
+    for (size_t j0 = 0; j0 < job.nj; j0 += GEMM_NR) {
+      const size_t nr = (job.nj - j0 < GEMM_NR) ? job.nj - j0 : GEMM_NR;
+      for (size_t k = p; k < p + kc; k++) {
+        const double *src = job.mat2 + k * job.nj + j0;
+        size_t j = 0;
+        for (; j < nr; j++) dest[j] = src[j];
+        for (; j < GEMM_NR; j++) dest[j] = 0.0;
+        dest += GEMM_NR;
+      }
+    }
+  }
+}
+
+static void matmult_packed_task(void *ctx, size_t task, int worker)
+{
+  MatmultJob &job = *(MatmultJob *) ctx;
+  const size_t i0 = task * GEMM_MC;
+  const size_t mc = (job.ni - i0 < GEMM_MC) ? job.ni - i0 : GEMM_MC;
+  const size_t npanels = (job.nj + GEMM_NR - 1) / GEMM_NR;
+  std::vector<double> &packed1 = (*job.packed1)[worker];
+
+  for (size_t p = 0; p < job.nk; p += GEMM_KC) {
+    const size_t kc = (job.nk - p < GEMM_KC) ? job.nk - p : GEMM_KC;
+    // Copy rows i0 .. i0+mc-1, columns p .. p+kc-1 of A into panels of GEMM_MR rows
+    double *dest = packed1.data();
+    for (size_t r0 = 0; r0 < mc; r0 += GEMM_MR) {
+      const size_t mr = (mc - r0 < GEMM_MR) ? mc - r0 : GEMM_MR;
+      const double *src = job.mat1 + (i0 + r0) * job.nk + p;
+      for (size_t k = 0; k < kc; k++) {
+        size_t r = 0;
+        for (; r < mr; r++) dest[r] = src[r * job.nk + k];
+        for (; r < GEMM_MR; r++) dest[r] = 0.0;
+        dest += GEMM_MR;
+      }
+    }
+    const double *panels2 = job.packed2.data() + p * npanels * GEMM_NR;
+    for (size_t j0 = 0, jp = 0; j0 < job.nj; j0 += GEMM_NR, jp++) {
+      const size_t nr = (job.nj - j0 < GEMM_NR) ? job.nj - j0 : GEMM_NR;
+      const double *b = panels2 + jp * kc * GEMM_NR;
+      for (size_t r0 = 0; r0 < mc; r0 += GEMM_MR) {
+        const size_t mr = (mc - r0 < GEMM_MR) ? mc - r0 : GEMM_MR;
+        double *c = job.result + (i0 + r0) * job.nj + j0;
+        if (mr == GEMM_MR && nr == GEMM_NR) {
+          gemm_kernel(kc, packed1.data() + r0 * kc, b, c, job.nj, p > 0);
+          continue;
+        }
+        // Block on the edge of C: go through a full-size block
+        double block[GEMM_MR * GEMM_NR] = { 0.0 };
+        for (size_t r = 0; r < mr; r++) {
+          for (size_t j = 0; j < nr; j++) block[r * GEMM_NR + j] = c[r * job.nj + j];
+        }
+        gemm_kernel(kc, packed1.data() + r0 * kc, b, block, GEMM_NR, p > 0);
+        for (size_t r = 0; r < mr; r++) {
+          for (size_t j = 0; j < nr; j++) c[r * job.nj + j] = block[r * GEMM_NR + j];
+        }
+      }
+    }
+  }
+}
+
+static void run_matmult(Machine &m, const double *mat1, const double *mat2, double *result,
+                        size_t ni, size_t nk, size_t nj)
+{
+  MatmultJob job;
+  job.mat1 = mat1;
+  job.mat2 = mat2;
+  job.result = result;
+  job.ni = ni;
+  job.nk = nk;
+  job.nj = nj;
+  const size_t work = ni * nk * nj;
+  if (work < GEMM_MIN_WORK || nj < GEMM_NR || ni < GEMM_MR) {
+    const size_t row_work = (nj > 0) ? nk * nj : 1;
+    job.rows_per_task = (MATMULT_TASK_WORK + row_work - 1) / row_work;
+    run_tasks(m, work, (ni + job.rows_per_task - 1) / job.rows_per_task, matmult_simple_task, &job);
+    return;
+  }
+  const size_t npanels = (nj + GEMM_NR - 1) / GEMM_NR;
+  m.buffers->take(job.packed2, nk * npanels * GEMM_NR);
+  gemm_pack2(job);
+  const size_t rows = (ni < GEMM_MC) ? (ni + GEMM_MR - 1) / GEMM_MR * GEMM_MR : GEMM_MC;
+  take_per_worker(m, rows * ((nk < GEMM_KC) ? nk : GEMM_KC));
+  job.packed1 = &m.per_worker;
+  run_tasks(m, work, (ni + GEMM_MC - 1) / GEMM_MC, matmult_packed_task, &job);
+  give_per_worker(m);
+  m.buffers->give(job.packed2);
+}
+
+// Transpose of an ni x nj matrix, by square tiles so that the rows read stay
+// in cache while the rows written are filled contiguously. Small tiles avoid
+// cache set conflicts when the row length is a power of 2. Tasks are bands of
+// TRANSP_TILE rows
+static const size_t TRANSP_TILE = 8;
+
+struct TranspJob {
+  const double *source;
+  double *      dest;
+  size_t        ni, nj;
+};
+
+// Square matrices are transposed in place, by swapping tiles across the diagonal
+static void transp_square_task(void *ctx, size_t task, int)
+{
+  const TranspJob &job = *(const TranspJob *) ctx;
+  double *mat = job.dest;
+  const size_t n = job.ni;
+  const size_t i0 = task * TRANSP_TILE;
+  const size_t i1 = (n - i0 < TRANSP_TILE) ? n : i0 + TRANSP_TILE;
+  for (size_t j0 = i0; j0 < n; j0 += TRANSP_TILE) {
+    const size_t j1 = (n - j0 < TRANSP_TILE) ? n : j0 + TRANSP_TILE;
+    for (size_t j = j0; j < j1; j++) {
+      // on the diagonal tile, only swap the upper triangle
+      for (size_t i = i0; i < i1 && (j0 != i0 || i < j); i++) {
+        const double t = mat[n * j + i];
+        mat[n * j + i] = mat[n * i + j];
+        mat[n * i + j] = t;
+      }
+    }
+  }
+}
+
+static void transp_task(void *ctx, size_t task, int)
+{
+  const TranspJob &job = *(const TranspJob *) ctx;
+  const size_t i0 = task * TRANSP_TILE;
+  const size_t i1 = (job.ni - i0 < TRANSP_TILE) ? job.ni : i0 + TRANSP_TILE;
+  for (size_t j0 = 0; j0 < job.nj; j0 += TRANSP_TILE) {
+    const size_t j1 = (job.nj - j0 < TRANSP_TILE) ? job.nj : j0 + TRANSP_TILE;
+    for (size_t j = j0; j < j1; j++) {
+      for (size_t i = i0; i < i1; i++) {
+        job.dest[job.ni * j + i] = job.source[job.nj * i + j];
+      }
+    }
+  }
+}
+
+// Histograms (bin, binnd, wbinnd)
+// Samples of dims interleaved coordinates are binned along each dimension as
+// floor((x - min) / dx), computed with a precomputed 1 / dx, into a row-major
+// histogram (the last dimension varies fastest). Samples outside the range in
+// any dimension are left out. Each worker runs one task over a contiguous
+// block of samples into a private histogram, and the histograms are summed in
+// order at the end, so that sums of weights only depend on the number of
+// workers.
+struct BinJob {
+  const double *data;
+  VecType       type;
+  const double *weights;    // f64, one per sample (wbinnd), or NULL to count
+  size_t        count;      // samples
+  size_t        per_task;   // samples
+  size_t        dims;
+  size_t        bins;       // total
+  std::vector<double> min, inv_dx, nbins;   // per dimension (nbins: integers)
+  std::vector<std::vector<double> > *hist;  // per task, i64 counts or f64 weights
+};
+
+// DIMS is the number of dimensions, or 0 for job.dims
+template <typename T, bool WEIGHTED, int DIMS>
+static inline void bin_range(const BinJob &job, const T *data, double *hist, size_t begin, size_t end)
+{
+  const size_t dims = DIMS ? DIMS : job.dims;
+  const double *min = job.min.data(), *inv_dx = job.inv_dx.data(), *nbins = job.nbins.data();
+  for (size_t i = begin; i < end; i++) {
+    const T *x = data + i * dims;
+    size_t index = 0;
+    size_t d = 0;
+    for (; d < dims; d++) {
+      const double b = (x[d] - min[d]) * inv_dx[d];
+      // Also leaves out NaN
+      if (!(b >= 0 && b < nbins[d])) break;
+      index = index * (size_t) nbins[d] + (size_t) b;
+    }
+    if (d < dims) continue;
+    if (WEIGHTED) {
+      hist[index] += job.weights[i];
+    } else {
+      ((i64_alias *) hist)[index]++;
+    }
+  }
+}
+
+template <typename T>
+static void bin_typed(const BinJob &job, const T *data, double *hist, size_t begin, size_t end)
+{
+  if (job.weights) {
+    if (job.dims == 1) bin_range<T, true, 1>(job, data, hist, begin, end);
+    else               bin_range<T, true, 0>(job, data, hist, begin, end);
+  } else {
+    if (job.dims == 1) bin_range<T, false, 1>(job, data, hist, begin, end);
+    else               bin_range<T, false, 0>(job, data, hist, begin, end);
+  }
+}
+
+static void bin_task(void *ctx, size_t task, int)
+{
+  BinJob &job = *(BinJob *) ctx;
+  const size_t begin = task * job.per_task;
+  const size_t end = (job.count - begin < job.per_task) ? job.count : begin + job.per_task;
+  double *hist = (*job.hist)[task].data();
+  switch (job.type) {
+  case VEC_F32: bin_typed(job, (const f32_alias *) job.data, hist, begin, end); break;
+  case VEC_I64: bin_typed(job, (const i64_alias *) job.data, hist, begin, end); break;
+  default:      bin_typed(job, job.data, hist, begin, end); break;
+  }
+}
+
+// Sum the histograms of the other tasks into the first one, TASK_SIZE bins per task
+static void bin_sum_task(void *ctx, size_t task, int)
+{
+  BinJob &job = *(BinJob *) ctx;
+  std::vector<std::vector<double> > &hist = *job.hist;
+  const size_t begin = task * TASK_SIZE;
+  const size_t end = (job.bins - begin < TASK_SIZE) ? job.bins : begin + TASK_SIZE;
+  for (size_t w = 1; w < hist.size(); w++) {
+    if (job.weights) {
+      for (size_t b = begin; b < end; b++) hist[0][b] += hist[w][b];
+    } else {
+      i64_alias *sum = (i64_alias *) hist[0].data();
+      const i64_alias *counts = (const i64_alias *) hist[w].data();
+      for (size_t b = begin; b < end; b++) sum[b] += counts[b];
+    }
+  }
+}
+
+// 3-vectors
+// norm3 normalize3 cross3 dot3 com3 and transform3 treat vectors as packed
+// points x0 y0 z0 x1 y1 z1 ... Their kernel (xyz_kernel, see SIMD math
+// kernels) handles n points with the sizes 3 and 3x3 known at compile time,
+// so that the compiler vectorizes across points. Tasks are TASK_SIZE points;
+// com3 sums each task apart and combines the sums in order.
+
+// Kernel for n points: t receives 1 (norm3 dot3) or 3 (normalize3 cross3
+// transform3) numbers per point, or for com3 the sums of w x, w y, w z and w.
+// b is the other operand: 3 numbers per point, or a single 3-vector for all of
+// them if broadcast (cross3 dot3, where reversed gives b x a); the weights
+// (com3: one per point, or one for all if broadcast); or the 3x3 matrix
+// followed by the translation (transform3: 12 numbers)
+typedef void (*XyzKernel)(Opcode op, double *t, const double *a, const double *b, bool broadcast,
+                          bool reversed, size_t n);
+static XyzKernel xyz_kernel = NULL;  // set by select_kernels
+
+struct XyzJob {
+  Opcode        op;
+  double *      t;
+  const double *a, *b;
+  bool          broadcast, reversed;
+  size_t        n;                 // points
+  size_t        out;               // numbers per point in t
+  double        xform[12];         // transform3
+  std::vector<double> partial;     // com3: 4 sums per task
+};
+
+static void xyz_task(void *ctx, size_t task, int)
+{
+  XyzJob &job = *(XyzJob *) ctx;
+  const size_t begin = task * TASK_SIZE;
+  const size_t n = (job.n - begin < TASK_SIZE) ? job.n - begin : TASK_SIZE;
+  const double *b = job.b;
+  if (b && !job.broadcast && job.op != OP_TRANSFORM3) b += begin * ((job.op == OP_COM3) ? 1 : 3);
+  double *t = (job.op == OP_COM3) ? &job.partial[4 * task] : job.t + begin * job.out;
+  xyz_kernel(job.op, t, job.a + 3 * begin, b, job.broadcast, job.reversed, n);
+}
+
+// Pair search
+// neighbors3, pairs3 and pairhist3 find the pairs of points (packed 3-vectors)
+// closer than a cutoff, one from each of two sets; selfneighbors3, selfpairs3
+// and selfpairhist3 the pairs of distinct points of one set, each pair once
+// (run as the former, with the set as both sets and PairJob::same). The box is 0
+// (none), a scalar (cube) or a 3-vector (orthorhombic box, with periodic
+// boundaries and the minimum image convention). The points of the second set
+// are sorted into a grid of cells at least as wide as the cutoff, so that each
+// point of the first set is only compared with the points of the 27 cells
+// around it. With periodic boundaries, the points are wrapped into the box,
+// and cells across a face of the box are shifted by the box length, rather
+// than taking the minimum image of each pair (unless the box is less than 3
+// cells wide). Tasks are blocks of PAIR_TASK points of the first set, taken
+// in the order of the cells too (except for pairs3, which lists the pairs in
+// the order of the points), so that nearby points share cached cells.
+
+static const size_t PAIR_TASK = 4096;
+static const size_t PAIR_WORK = 64;     // rough cost of a point, in elements
+
+struct CellGrid {
+  bool   periodic;
+  double box[3], inv_box[3];     // periodic
+  double lo[3], inv_size[3];     // origin and 1 / width of the cells
+  size_t dims[3];
+  std::vector<size_t> start;     // points of cell c: start[c] to start[c+1]
+  std::vector<double> xyz;       // second set, sorted by cell (wrapped if periodic)
+  std::vector<size_t> index;     // their index in the set
+};
+
+static inline double wrap(const CellGrid &grid, int d, double x)
+{
+  return grid.periodic ? x - grid.box[d] * floor(x * grid.inv_box[d]) : x;
+}
+
+// Cell along dimension d of coordinate x (wrapped)
+static inline size_t cell_of(const CellGrid &grid, int d, double x)
+{
+  const double c = (x - grid.lo[d]) * grid.inv_size[d];
+  return (c <= 0.0) ? 0 : (c >= grid.dims[d]) ? grid.dims[d] - 1 : (size_t) c;
+}
+
+// Counting sort of n points by cell: order receives their indices, and start
+// the position in order of the first point of each cell
+static void sort_by_cell(const CellGrid &grid, const double *points, size_t n,
+                         std::vector<size_t> &start, std::vector<size_t> &order)
+{
+  const size_t ncells = grid.dims[0] * grid.dims[1] * grid.dims[2];
+  std::vector<size_t> cell(n);
+  start.assign(ncells + 1, 0);
+  for (size_t j = 0; j < n; j++) {
+    const double *p = points + 3*j;
+    cell[j] = (cell_of(grid, 0, wrap(grid, 0, p[0])) * grid.dims[1] + cell_of(grid, 1, wrap(grid, 1, p[1])))
+              * grid.dims[2] + cell_of(grid, 2, wrap(grid, 2, p[2]));
+    start[cell[j] + 1]++;
+  }
+  for (size_t c = 0; c < ncells; c++) start[c + 1] += start[c];
+  std::vector<size_t> next(start.begin(), start.end() - 1);
+  order.resize(n);
+  for (size_t j = 0; j < n; j++) order[next[cell[j]]++] = j;
+}
+
+// Build the grid over the n2 points b, for pairs with the n1 points a; box
+// holds 1 or 3 numbers (0: none)
+static void build_grid(CellGrid &grid, const double *a, size_t n1, const double *b, size_t n2,
+                       const std::vector<double> &box, double cutoff)
+{
+  grid.periodic = (box.size() == 3 || box[0] != 0.0);
+  // Cells beyond about 2 per point would mostly be empty
+  const size_t max_cells = 2 * n2 + 64;
+  double extent[3];
+  for (int d = 0; d < 3; d++) {
+    if (grid.periodic) {
+      grid.box[d] = box[(box.size() > 1) ? d : 0];
+      grid.inv_box[d] = 1.0 / grid.box[d];
+      grid.lo[d] = 0.0;
+      extent[d] = grid.box[d];
+    } else {
+      double lo = (n2 > 0) ? b[d] : (n1 > 0) ? a[d] : 0.0, hi = lo;
+      for (size_t i = 0; i < n1; i++) { lo = fmin(lo, a[3*i+d]); hi = fmax(hi, a[3*i+d]); }
+      for (size_t i = 0; i < n2; i++) { lo = fmin(lo, b[3*i+d]); hi = fmax(hi, b[3*i+d]); }
+      grid.lo[d] = lo;
+      extent[d] = hi - lo;
+    }
+    const double cells = floor(extent[d] / cutoff);
+    grid.dims[d] = (cells < 1.0) ? 1 : (cells > max_cells) ? max_cells : (size_t) cells;
+  }
+  // Sparse points: fewer, wider cells
+  while ((double) grid.dims[0] * grid.dims[1] * grid.dims[2] > max_cells) {
+    for (int d = 0; d < 3; d++) grid.dims[d] = (grid.dims[d] + 1) / 2;
+  }
+  for (int d = 0; d < 3; d++) {
+    grid.inv_size[d] = (extent[d] > 0.0) ? grid.dims[d] / extent[d] : 0.0;
+  }
+
+  sort_by_cell(grid, b, n2, grid.start, grid.index);
+  grid.xyz.resize(3 * n2);
+  for (size_t k = 0; k < n2; k++) {
+    for (int d = 0; d < 3; d++) grid.xyz[3*k+d] = wrap(grid, d, b[3 * grid.index[k] + d]);
+  }
+}
+
+struct PairJob {
+  const CellGrid *grid;
+  Opcode          op;
+  const double *  a;          // first set
+  size_t          n1;
+  const size_t *  order;      // order of the points of the first set, or NULL
+  bool            same;       // one set (self operators): skip i == j, and j < i but for neighbors3
+  double          cutoff2;
+  double          hist_scale; // pairhist3: nbins / cutoff
+  size_t          nbins;
+  double *        counts;     // neighbors3: i64 per point
+  std::vector<std::vector<double> > *hist;   // pairhist3: i64, per worker
+  std::vector<std::vector<int64_t> > pairs;  // pairs3: per task
+};
+
+static void pair_task(void *ctx, size_t task, int worker)
+{
+  PairJob &job = *(PairJob *) ctx;
+  const CellGrid &grid = *job.grid;
+  const size_t begin = task * PAIR_TASK;
+  const size_t end = (job.n1 - begin < PAIR_TASK) ? job.n1 : begin + PAIR_TASK;
+  i64_alias *hist = (job.op == OP_PAIRHIST3) ? (i64_alias *) (*job.hist)[worker].data() : NULL;
+  std::vector<int64_t> *pairs = (job.op == OP_PAIRS3) ? &job.pairs[task] : NULL;
+  std::vector<int64_t> found;   // pairs3: neighbors of a point, sorted before they are added
+  // Minimum image of each pair along the periodic dimensions less than 3 cells wide
+  bool image[3];
+  for (int d = 0; d < 3; d++) image[d] = grid.periodic && grid.dims[d] < 3;
+  for (size_t pos = begin; pos < end; pos++) {
+    const size_t i = job.order ? job.order[pos] : pos;
+    double p[3];
+    for (int d = 0; d < 3; d++) p[d] = wrap(grid, d, job.a[3*i+d]);
+    // Cells to visit along each dimension: the 3 around the point, fewer at
+    // the edges of the grid, or all of them if periodic and fewer than 3; and
+    // the coordinate of the point relative to the points of each cell
+    size_t cells[3][3];
+    double rel[3][3];
+    int    ncells[3];
+    for (int d = 0; d < 3; d++) {
+      const size_t c = cell_of(grid, d, p[d]);
+      const size_t dim = grid.dims[d];
+      ncells[d] = 0;
+      if (image[d]) {
+        for (size_t k = 0; k < dim; k++) {
+          rel[d][ncells[d]] = p[d];
+          cells[d][ncells[d]++] = k;
+        }
+        continue;
+      }
+      for (int o = -1; o <= 1; o++) {
+        const bool across = (o < 0 && c == 0) || (o > 0 && c + 1 >= dim);
+        if (across && !grid.periodic) continue;
+        // Across a face of the box, the cell holds images shifted by the box length
+        rel[d][ncells[d]] = !across ? p[d] : (o < 0) ? p[d] + grid.box[d] : p[d] - grid.box[d];
+        cells[d][ncells[d]++] = (c + dim + o) % dim;
+      }
+    }
+    int64_t count = 0;
+    for (int u = 0; u < ncells[0]; u++) {
+      for (int v = 0; v < ncells[1]; v++) {
+        for (int w = 0; w < ncells[2]; w++) {
+          const size_t cell = (cells[0][u] * grid.dims[1] + cells[1][v]) * grid.dims[2] + cells[2][w];
+          const double px = rel[0][u], py = rel[1][v], pz = rel[2][w];
+          for (size_t k = grid.start[cell]; k < grid.start[cell + 1]; k++) {
+            double dx = px - grid.xyz[3*k], dy = py - grid.xyz[3*k+1], dz = pz - grid.xyz[3*k+2];
+            if (image[0]) dx -= grid.box[0] * floor(dx * grid.inv_box[0] + 0.5);
+            if (image[1]) dy -= grid.box[1] * floor(dy * grid.inv_box[1] + 0.5);
+            if (image[2]) dz -= grid.box[2] * floor(dz * grid.inv_box[2] + 0.5);
+            const double r2 = dx * dx + dy * dy + dz * dz;
+            if (!(r2 < job.cutoff2)) continue;
+            const size_t j = grid.index[k];
+            // Within one set, a point is not its own neighbor, and pairs are listed once
+            if (job.same && (j == i || (j < i && job.op != OP_NEIGHBORS3))) continue;
+            count++;
+            if (hist) {
+              const double bin = sqrt(r2) * job.hist_scale;
+              if (bin < job.nbins) hist[(size_t) bin]++;
+            } else if (pairs) {
+              found.push_back(j);
+            }
+          }
+        }
+      }
+    }
+    if (job.counts) ((i64_alias *) job.counts)[i] = count;
+    if (pairs && !found.empty()) {
+      std::sort(found.begin(), found.end());
+      for (size_t k = 0; k < found.size(); k++) {
+        pairs->push_back(i);
+        pairs->push_back(found[k]);
+      }
+      found.clear();
+    }
+  }
+}
+
+// Sorting (sort argsort unique count, and percentile with many quantiles)
+// Elements are sorted as 64-bit keys that compare as unsigned integers in the
+// order of the values, NaNs last: the bits of an f64 (or of an f32 converted to
+// f64) with the sign bit set, or all bits flipped for negative values, and the
+// bits of an i64 with the sign bit flipped. Short vectors go through std::sort;
+// longer ones through a stable LSD radix sort of RADIX_BITS-bit digits, split
+// into one block of elements per worker: each pass counts the digits of every
+// block, then every block moves its elements to the positions that follow
+// from the counts of all blocks. Passes where all keys have the same digit
+// (e.g. the high bits of small integers) are skipped.
+typedef uint64_t u64_alias __attribute__((may_alias));
+
+static const unsigned RADIX_BITS = 11;
+static const size_t   RADIX_BUCKETS = (size_t) 1 << RADIX_BITS;
+static const size_t   RADIX_MIN = 2048;   // shorter vectors use std::sort
+static const uint64_t KEY_SIGN = (uint64_t) 1 << 63;
+
+static inline uint64_t sort_key(const double *buf, VecType type, size_t i)
+{
+  if (type == VEC_I64) return (uint64_t) ((const i64_alias *) buf)[i] ^ KEY_SIGN;
+  const double x = (type == VEC_F32) ? (double) ((const f32_alias *) buf)[i] : buf[i];
+  if (std::isnan(x)) return UINT64_MAX;
+  uint64_t u;
+  memcpy(&u, &x, sizeof(u));
+  return (u & KEY_SIGN) ? ~u : u | KEY_SIGN;
+}
+
+// Store the value of key as element i of buf
+static inline void store_key(double *buf, VecType type, size_t i, uint64_t key)
+{
+  if (type == VEC_I64) {
+    ((i64_alias *) buf)[i] = (int64_t) (key ^ KEY_SIGN);
+    return;
+  }
+  const uint64_t u = (key & KEY_SIGN) ? key ^ KEY_SIGN : ~key;
+  double x = NAN;
+  if (key != UINT64_MAX) memcpy(&x, &u, sizeof(x));
+  if (type == VEC_F32) {
+    ((f32_alias *) buf)[i] = (float) x;
+  } else {
+    buf[i] = x;
+  }
+}
+
+// Do the keys a <= b (adjacent after sorting) hold equal values? -0.0 and 0.0
+// are equal, and so are all NaNs (see unique and count)
+static inline bool same_key(uint64_t a, uint64_t b, VecType type)
+{
+  return a == b || (type != VEC_I64 && a == ~KEY_SIGN && b == KEY_SIGN);
+}
+
+struct SortJob {
+  const u64_alias *keys;
+  u64_alias *      keys_out;
+  const i64_alias *index;      // argsort: indices moved with the keys, or NULL
+  i64_alias *      index_out;
+  size_t           n;
+  size_t           per_task;
+  unsigned         shift;      // of the digit of this pass
+  std::vector<size_t> counts;  // RADIX_BUCKETS per task: counts, then positions
+};
+
+static void radix_count_task(void *ctx, size_t task, int)
+{
+  SortJob &job = *(SortJob *) ctx;
+  size_t *count = &job.counts[task * RADIX_BUCKETS];
+  const size_t begin = task * job.per_task, end = std::min(job.n, begin + job.per_task);
+  memset(count, 0, RADIX_BUCKETS * sizeof(size_t));
+  for (size_t i = begin; i < end; i++) count[(job.keys[i] >> job.shift) & (RADIX_BUCKETS - 1)]++;
+}
+
+static void radix_move_task(void *ctx, size_t task, int)
+{
+  SortJob &job = *(SortJob *) ctx;
+  size_t *pos = &job.counts[task * RADIX_BUCKETS];
+  const size_t begin = task * job.per_task, end = std::min(job.n, begin + job.per_task);
+  for (size_t i = begin; i < end; i++) {
+    const size_t p = pos[(job.keys[i] >> job.shift) & (RADIX_BUCKETS - 1)]++;
+    job.keys_out[p] = job.keys[i];
+    if (job.index) job.index_out[p] = job.index[i];
+  }
+}
+
+// Sort the n keys in keys (a pool buffer), and if index is not NULL the
+// indices in index along with them (stably); both are swapped with pool
+// buffers while sorting, and hold the sorted arrays on return
+static void sort_keys(Machine &m, std::vector<double> &keys, std::vector<double> *index, size_t n)
+{
+  u64_alias *k = (u64_alias *) keys.data();
+  if (n < RADIX_MIN) {
+    if (!index) {
+      std::sort(k, k + n);
+      return;
+    }
+    i64_alias *order = (i64_alias *) index->data();
+    std::stable_sort(order, order + n, [k](int64_t a, int64_t b) { return k[a] < k[b]; });
+    std::vector<double> sorted;
+    m.buffers->take(sorted, n);
+    for (size_t i = 0; i < n; i++) ((u64_alias *) sorted.data())[i] = k[order[i]];
+    keys.swap(sorted);
+    m.buffers->give(sorted);
+    return;
+  }
+  std::vector<double> keys_tmp, index_tmp;
+  m.buffers->take(keys_tmp, n);
+  if (index) m.buffers->take(index_tmp, n);
+  SortJob job;
+  job.n = n;
+  const size_t ntasks = task_workers(m, n, (n + TASK_SIZE - 1) / TASK_SIZE);
+  job.per_task = (n + ntasks - 1) / ntasks;
+  job.counts.resize(ntasks * RADIX_BUCKETS);
+  for (job.shift = 0; job.shift < 64; job.shift += RADIX_BITS) {
+    job.keys = (const u64_alias *) keys.data();
+    job.keys_out = (u64_alias *) keys_tmp.data();
+    job.index = index ? (const i64_alias *) index->data() : NULL;
+    job.index_out = index ? (i64_alias *) index_tmp.data() : NULL;
+    run_tasks(m, n, ntasks, radix_count_task, &job);
+    // Bucket by bucket, then block by block: the first position of each
+    size_t total = 0;
+    bool   skip = false;
+    for (size_t d = 0; d < RADIX_BUCKETS && !skip; d++) {
+      const size_t first = total;
+      for (size_t task = 0; task < ntasks; task++) {
+        const size_t c = job.counts[task * RADIX_BUCKETS + d];
+        job.counts[task * RADIX_BUCKETS + d] = total;
+        total += c;
+      }
+      skip = (total - first == n);
+    }
+    if (skip) continue;
+    run_tasks(m, n, ntasks, radix_move_task, &job);
+    keys.swap(keys_tmp);
+    if (index) index->swap(index_tmp);
+  }
+  m.buffers->give(keys_tmp);
+  if (index) m.buffers->give(index_tmp);
+}
+
+// Sort the n elements of buf (a pool buffer) of type in place
+static void sort_values(Machine &m, std::vector<double> &buf, VecType type, size_t n)
+{
+  std::vector<double> keys;
+  m.buffers->take(keys, n);
+  u64_alias *k = (u64_alias *) keys.data();
+  for (size_t i = 0; i < n; i++) k[i] = sort_key(buf.data(), type, i);
+  sort_keys(m, keys, NULL, n);
+  k = (u64_alias *) keys.data();
+  for (size_t i = 0; i < n; i++) store_key(buf.data(), type, i, k[i]);
+  m.buffers->give(keys);
+}
+
+// Percentiles (and median) of the n doubles in x, NaNs left out, with linear
+// interpolation between the two nearest ranks (as NumPy does by default); x
+// is reordered. A few ranks are found by selection (std::nth_element, each
+// one in the part of x above the previous rank), more by sorting x.
+static const size_t SELECT_MAX = 8;
+
+static void percentiles(Machine &m, std::vector<double> &x, size_t n, const double *p, size_t np, double *result)
+{
+  n = std::remove_if(x.data(), x.data() + n, [](double v) { return std::isnan(v); }) - x.data();
+  if (n == 0) {
+    for (size_t i = 0; i < np; i++) result[i] = NAN;
+    return;
+  }
+  std::vector<size_t> ranks;
+  for (size_t i = 0; i < np; i++) {
+    const double pos = p[i] / 100.0 * (n - 1);
+    const size_t lo = (size_t) pos;
+    ranks.push_back(lo);
+    if (pos > lo) ranks.push_back(lo + 1);
+  }
+  std::sort(ranks.begin(), ranks.end());
+  ranks.erase(std::unique(ranks.begin(), ranks.end()), ranks.end());
+  if (ranks.size() > SELECT_MAX) {
+    sort_values(m, x, VEC_F64, n);
+  } else {
+    size_t begin = 0;
+    for (size_t r = 0; r < ranks.size(); r++) {
+      std::nth_element(x.data() + begin, x.data() + ranks[r], x.data() + n);
+      begin = ranks[r] + 1;
+    }
+  }
+  for (size_t i = 0; i < np; i++) {
+    const double pos = p[i] / 100.0 * (n - 1);
+    const size_t lo = (size_t) pos;
+    result[i] = (pos > lo) ? x[lo] + (pos - lo) * (x[lo + 1] - x[lo]) : x[lo];
+  }
+}
+
+// Scans and sliding windows
+// cumsum and cumprod scan blocks of TASK_SIZE elements in place, each from its
+// own start, on several threads; the totals of the blocks are then scanned
+// serially, and each block is combined with the total of the blocks before
+// it. The blocks are the same whatever the number of threads, and so are the
+// results. The other operators compute each result on its own: diff and
+// blockavg directly, and the windows as the combination of the end of a block
+// of w elements with the start of the next one (van Herk / Gil-Werman). That
+// takes O(N) operations whatever w, without branches for wmin and wmax (which
+// skip NaNs) and without the drift of a running sum for wsum and wmean (nor
+// its NaNs once an Inf has left the window). Sums and differences of i64
+// vectors stay exact (wrapping on overflow).
+
+struct ScanJob {
+  double *            x;        // f64, or i64 for integer sums
+  size_t              n;
+  Opcode              op;       // OP_CUMSUM or OP_CUMPROD
+  bool                integer;
+  std::vector<double> totals;   // per block (of the type of x)
+  std::vector<double> offsets;  // per block after the first: total of those before it
+};
+
+static void scan_block_task(void *ctx, size_t block, int)
+{
+  ScanJob &job = *(ScanJob *) ctx;
+  const size_t begin = block * TASK_SIZE;
+  const size_t end = (job.n - begin < TASK_SIZE) ? job.n : begin + TASK_SIZE;
+  if (job.integer) {
+    u64_alias *x = (u64_alias *) job.x;
+    for (size_t i = begin + 1; i < end; i++) x[i] += x[i-1];
+    ((u64_alias *) job.totals.data())[block] = x[end-1];
+    return;
+  }
+  double *x = job.x;
+  if (job.op == OP_CUMPROD) {
+    for (size_t i = begin + 1; i < end; i++) x[i] *= x[i-1];
+  } else {
+    for (size_t i = begin + 1; i < end; i++) x[i] += x[i-1];
+  }
+  job.totals[block] = x[end-1];
+}
+
+static void scan_offset_task(void *ctx, size_t block, int)
+{
+  ScanJob &job = *(ScanJob *) ctx;
+  if (block == 0) return;
+  const size_t begin = block * TASK_SIZE;
+  const size_t end = (job.n - begin < TASK_SIZE) ? job.n : begin + TASK_SIZE;
+  if (job.integer) {
+    u64_alias *x = (u64_alias *) job.x;
+    const uint64_t offset = ((const u64_alias *) job.offsets.data())[block];
+    for (size_t i = begin; i < end; i++) x[i] += offset;
+    return;
+  }
+  double *x = job.x;
+  const double offset = job.offsets[block];
+  if (job.op == OP_CUMPROD) {
+    for (size_t i = begin; i < end; i++) x[i] *= offset;
+  } else {
+    for (size_t i = begin; i < end; i++) x[i] += offset;
+  }
+}
+
+// Total of the blocks before block (> 0), from that of the blocks before block - 1
+static inline void scan_offset(ScanJob &job, size_t block)
+{
+  if (job.integer) {
+    const u64_alias *t = (const u64_alias *) job.totals.data();
+    u64_alias *o = (u64_alias *) job.offsets.data();
+    o[block] = (block == 1) ? t[0] : o[block-1] + t[block-1];
+    return;
+  }
+  const double *t = job.totals.data();
+  double *o = job.offsets.data();
+  o[block] = (block == 1) ? t[0] : (job.op == OP_CUMPROD) ? o[block-1] * t[block-1] : o[block-1] + t[block-1];
+}
+
+// Scan the n elements of x in place: running sums (integer ones if integer)
+// or products
+static void scan(Machine &m, double *x, size_t n, Opcode op, bool integer)
+{
+  ScanJob job;
+  job.x = x;
+  job.n = n;
+  job.op = op;
+  job.integer = integer;
+  const size_t nblocks = (n + TASK_SIZE - 1) / TASK_SIZE;
+  job.totals.resize(nblocks);
+  job.offsets.resize(nblocks);
+  if (task_workers(m, n, nblocks) > 1) {
+    run_tasks(m, n, nblocks, scan_block_task, &job);
+    for (size_t block = 1; block < nblocks; block++) scan_offset(job, block);
+    run_tasks(m, n, nblocks, scan_offset_task, &job);
+    return;
+  }
+  // Each block is combined while it is still in cache
+  for (size_t block = 0; block < nblocks; block++) {
+    scan_block_task(&job, block, 0);
+    if (block == 0) continue;
+    scan_offset(job, block);
+    scan_offset_task(&job, block, 0);
+  }
+}
+
+// Check the length operand of blockavg wsum wmean wmin wmax (length elements,
+// the first of which is value if known) for a vector of n elements (0 if
+// unknown); sets the number of results (0 if unknown)
+static int check_window(Tcl_Interp *interp, Opcode op, size_t n, size_t length, bool known, double value,
+                        size_t &count)
+{
+  count = 0;
+  if (length > 1 || (known && !(value >= 1 && value == floor(value)))) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: the length for %s should be a positive integer scalar",
+                                           op_name(op)));
+    return TCL_ERROR;
+  }
+  if (!n || !known) return TCL_OK;
+  if (value > n) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s length %.0f is larger than the vector (%lu elements)",
+                                           op_name(op), value, (unsigned long) n));
+    return TCL_ERROR;
+  }
+  count = (op == OP_BLOCKAVG) ? n / (size_t) value : n - (size_t) value + 1;
+  return TCL_OK;
+}
+
+struct WindowJob {
+  Opcode        op;
+  const double *x;          // f64 or i64 (diff wsum), or any type (wmin wmax)
+  VecType       type;
+  double *      out;        // of type
+  size_t        w;          // window or block length
+  size_t        count;      // results
+  size_t        per_task;   // results (a multiple of w for windows)
+};
+
+// Combine a with b for wsum or wmean (a + b), wmin or wmax (NaNs in b are
+// skipped), and the value that leaves b unchanged
+template <Opcode OP, typename T>
+static inline T window_op(T a, T b)
+{
+  return (OP == OP_WMIN) ? (b < a ? b : a) : (OP == OP_WMAX) ? (b > a ? b : a) : a + b;
+}
+
+template <Opcode OP, typename T>
+static inline T window_none()
+{
+  typedef std::numeric_limits<T> limits;
+  if (OP == OP_WMIN) return limits::has_infinity ? limits::infinity() : limits::max();
+  if (OP == OP_WMAX) return limits::has_infinity ? -limits::infinity() : limits::lowest();
+  return 0;
+}
+
+// Windows starting at begin ... end - 1, by blocks of w from begin: the
+// window starting at j in block [b, b + w) combines x[j] ... x[b + w - 1]
+// (combined backwards) with x[b + w] ... x[j + w - 1] (forwards)
+template <Opcode OP, typename T>
+static void window_blocks(const WindowJob &job, const T *x, T *out, size_t begin, size_t end)
+{
+  const size_t w = job.w;
+  const T      none = window_none<OP, T>();
+  for (size_t b = begin; b < end; b += w) {
+    const size_t last = (end - b < w) ? end : b + w;
+    T s = none;
+    for (size_t i = b + w; i-- > last; ) s = window_op<OP>(s, x[i]);
+    for (size_t i = last; i-- > b; ) out[i] = s = window_op<OP>(s, x[i]);
+    s = none;
+    for (size_t j = b + 1; j < last; j++) {
+      s = window_op<OP>(s, x[j + w - 1]);
+      out[j] = window_op<OP>(out[j], s);
+    }
+  }
+  if (OP == OP_WSUM || !std::numeric_limits<T>::has_quiet_NaN) return;
+  // Windows of NaNs were left at none, as were those of +-Inf: count the
+  // other elements of each window if there are any
+  size_t j = begin;
+  while (j < end && out[j] != none) j++;
+  if (j == end) return;
+  size_t valid = 0;
+  for (size_t i = begin; i < begin + w; i++) valid += (x[i] == x[i]);
+  for (j = begin; j < end; j++) {
+    if (valid == 0) out[j] = std::numeric_limits<T>::quiet_NaN();
+    if (j + 1 < end) valid += (size_t) (x[j + w] == x[j + w]) - (size_t) (x[j] == x[j]);
+  }
+}
+
+template <Opcode OP>
+static void window_typed(const WindowJob &job, size_t begin, size_t end)
+{
+  switch (job.type) {
+  case VEC_F32: window_blocks<OP>(job, (const f32_alias *) job.x, (f32_alias *) job.out, begin, end); break;
+  case VEC_I64: window_blocks<OP>(job, (const i64_alias *) job.x, (i64_alias *) job.out, begin, end); break;
+  default:      window_blocks<OP>(job, job.x, job.out, begin, end); break;
+  }
+}
+
+static void window_task(void *ctx, size_t task, int)
+{
+  WindowJob &job = *(WindowJob *) ctx;
+  const size_t begin = task * job.per_task;
+  const size_t end = (job.count - begin < job.per_task) ? job.count : begin + job.per_task;
+  const size_t w = job.w;
+  switch (job.op) {
+  case OP_DIFF:
+    if (job.type == VEC_I64) {
+      const u64_alias *x = (const u64_alias *) job.x;
+      u64_alias *out = (u64_alias *) job.out;
+      for (size_t j = begin; j < end; j++) out[j] = x[j+1] - x[j];
+    } else {
+      for (size_t j = begin; j < end; j++) job.out[j] = job.x[j+1] - job.x[j];
+    }
+    break;
+  case OP_BLOCKAVG:
+    for (size_t j = begin; j < end; j++) {
+      double sum = 0.0;
+      for (size_t i = j * w; i < (j + 1) * w; i++) sum += job.x[i];
+      job.out[j] = sum / w;
+    }
+    break;
+  case OP_WSUM: case OP_WMEAN:
+    if (job.type == VEC_I64) {
+      // Wrapping
+      window_blocks<OP_WSUM>(job, (const u64_alias *) job.x, (u64_alias *) job.out, begin, end);
+      break;
+    }
+    window_blocks<OP_WSUM>(job, job.x, job.out, begin, end);
+    if (job.op == OP_WMEAN) {
+      for (size_t j = begin; j < end; j++) job.out[j] /= (double) w;
+    }
+    break;
+  case OP_WMIN:
+    window_typed<OP_WMIN>(job, begin, end);
+    break;
+  default:
+    window_typed<OP_WMAX>(job, begin, end);
+    break;
+  }
+}
+
+// Binary files
+// <file:type:path pushes the contents of a file, and >file:type:path pops the
+// top of the stack into one. type is f64 or f32 (raw little-endian numbers) or
+// npy (NumPy .npy file, read as f8 f4 i8 or i4 of either byte order in C order,
+// written as little-endian f8). Reading may select elements with
+// type,offset,count,stride (in elements, after the .npy header; count defaults
+// to the rest of the file). Files are mapped into memory and converted
+// straight into a stack buffer, without going through Tcl_Objs.
+
+static const size_t FILE_CHUNK = 1024;   // elements converted at a time when writing
+
+struct ElemType {
+  size_t size;      // 4 or 8 bytes
+  bool   integer;
+  bool   swap;      // byte order differs from the host
+};
+
+static inline bool host_little_endian()
+{
+  const uint16_t one = 1;
+  unsigned char first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+static inline double load_elem(const unsigned char *p, const ElemType &type)
+{
+  if (type.size == 8) {
+    uint64_t u;
+    memcpy(&u, p, 8);
+    if (type.swap) u = __builtin_bswap64(u);
+    if (type.integer) return (double) (int64_t) u;
+    double x;
+    memcpy(&x, &u, 8);
+    return x;
+  }
+  uint32_t u;
+  memcpy(&u, p, 4);
+  if (type.swap) u = __builtin_bswap32(u);
+  if (type.integer) return (double) (int32_t) u;
+  float x;
+  memcpy(&x, &u, 4);
+  return x;
+}
+
+static inline int64_t load_int_elem(const unsigned char *p, const ElemType &type)
+{
+  if (type.size == 8) {
+    uint64_t u;
+    memcpy(&u, p, 8);
+    if (type.swap) u = __builtin_bswap64(u);
+    return (int64_t) u;
+  }
+  uint32_t u;
+  memcpy(&u, p, 4);
+  if (type.swap) u = __builtin_bswap32(u);
+  return (int32_t) u;
+}
+
+// Vector type holding the elements of a file without loss
+static inline VecType file_vec_type(const ElemType &type)
+{
+  return type.integer ? VEC_I64 : (type.size == 4) ? VEC_F32 : VEC_F64;
+}
+
+// Store an element of a vector buf of type t into a file element
+static inline void store_elem(unsigned char *p, const double *buf, VecType t, size_t i, const ElemType &type)
+{
+  if (type.size == 8) {
+    uint64_t u;
+    if (type.integer) {
+      u = (uint64_t) ((const i64_alias *) buf)[i];  // i64 vectors only
+    } else {
+      const double x = get_elem(buf, t, i);
+      memcpy(&u, &x, 8);
+    }
+    if (type.swap) u = __builtin_bswap64(u);
+    memcpy(p, &u, 8);
+    return;
+  }
+  uint32_t u;
+  if (type.integer) {
+    u = (uint32_t) ((const i64_alias *) buf)[i];  // i64 vectors only, in range
+  } else {
+    const float f = get_elem(buf, t, i);
+    memcpy(&u, &f, 4);
+  }
+  if (type.swap) u = __builtin_bswap32(u);
+  memcpy(p, &u, 4);
+}
+
+static int file_error(Tcl_Interp *interp, const char *what, const std::string &name)
+{
+  Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s \"%s\": %s", what, name.c_str(), Tcl_PosixError(interp)));
+  return TCL_ERROR;
+}
+
+// Open a file given by its Tcl name; returns -1 with an error in interp
+static int open_file(Tcl_Interp *interp, const std::string &name, int flags)
+{
+  Tcl_DString native;
+  if (!Tcl_TranslateFileName(interp, name.c_str(), &native)) return -1;
+  const int fd = open(Tcl_DStringValue(&native), flags, 0666);
+  Tcl_DStringFree(&native);
+  if (fd < 0) file_error(interp, "cannot open", name);
+  return fd;
+}
+
+// Read-only mapping of a whole file, unmapped when going out of scope
+struct MappedFile {
+  MappedFile() : data(NULL), size(0) {}
+  ~MappedFile() { if (data) munmap((void *) data, size); }
+  const unsigned char *data;
+  size_t               size;
+};
+
+static int map_file(Tcl_Interp *interp, const std::string &name, MappedFile &map)
+{
+  const int fd = open_file(interp, name, O_RDONLY);
+  if (fd < 0) return TCL_ERROR;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return file_error(interp, "cannot read", name);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: empty file \"%s\"", name.c_str()));
+    return TCL_ERROR;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return file_error(interp, "cannot map", name);
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  map.data = (const unsigned char *) data;
+  map.size = st.st_size;
+  return TCL_OK;
+}
+
+// Find "'key':" in a .npy header, returning the position of its value
+static const char * npy_field(const std::string &header, const char *key)
+{
+  const size_t at = header.find(std::string("'") + key + "'");
+  if (at == std::string::npos) return NULL;
+  const char *p = header.c_str() + at + strlen(key) + 2;
+  while (*p == ' ' || *p == ':') p++;
+  return p;
+}
+
+// Parse the header of a .npy file: element type, number of elements and
+// position of the data
+static int parse_npy(Tcl_Interp *interp, const std::string &name, const MappedFile &map,
+                     ElemType &type, size_t &count, size_t &start)
+{
+  const unsigned char *d = map.data;
+  if (map.size < 10 || memcmp(d, "\x93NUMPY", 6)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: \"%s\" is not a .npy file", name.c_str()));
+    return TCL_ERROR;
+  }
+  size_t length;
+  if (d[6] == 1) {
+    length = d[8] | (d[9] << 8);
+    start = 10;
+  } else {
+    length = (map.size < 12) ? map.size : d[8] | (d[9] << 8) | (d[10] << 16) | ((size_t) d[11] << 24);
+    start = 12;
+  }
+  if (start + length > map.size) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: truncated .npy header in \"%s\"", name.c_str()));
+    return TCL_ERROR;
+  }
+  const std::string header((const char *) d + start, length);
+  start += length;
+
+  const char *descr = npy_field(header, "descr");
+  const char *order = npy_field(header, "fortran_order");
+  const char *shape = npy_field(header, "shape");
+  if (!descr || !order || !shape || *descr != '\'' || *shape != '(') {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: cannot parse .npy header in \"%s\"", name.c_str()));
+    return TCL_ERROR;
+  }
+  // e.g. '<f8': byte order, kind, size
+  const char bo = descr[1], kind = descr[2], size = descr[3];
+  if (!strchr("<>=", bo) || !strchr("fi", kind) || !strchr("48", size) || descr[4] != '\'') {
+    const char *end = strchr(descr + 1, '\'');
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: unsupported .npy element type %.*s in \"%s\" (should be f8, f4, i8 or i4)",
+                                           end ? (int) (end - descr + 1) : 1, descr, name.c_str()));
+    return TCL_ERROR;
+  }
+  type.size = size - '0';
+  type.integer = (kind == 'i');
+  type.swap = (bo != '=') && ((bo == '<') != host_little_endian());
+
+  int dims = 0;
+  count = 1;
+  for (const char *p = shape + 1; *p != ')'; ) {
+    char *end;
+    const unsigned long long n = strtoull(p, &end, 10);
+    if (end == p) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: cannot parse .npy shape in \"%s\"", name.c_str()));
+      return TCL_ERROR;
+    }
+    // A product that wraps could pass for the size of the file
+    if (n > SIZE_MAX || (n != 0 && count > SIZE_MAX / n)) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: .npy shape too large in \"%s\"", name.c_str()));
+      return TCL_ERROR;
+    }
+    count *= n;
+    dims++;
+    p = end;
+    while (*p == ',' || *p == ' ') p++;
+  }
+  if (!strncmp(order, "True", 4) && dims > 1) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: Fortran-ordered array in \"%s\" is not supported", name.c_str()));
+    return TCL_ERROR;
+  }
+  if (count > (map.size - start) / type.size) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: truncated .npy file \"%s\"", name.c_str()));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+struct ReadJob {
+  const unsigned char *source;   // first element read
+  double *             dest;     // of type file_vec_type(type)
+  ElemType             type;
+  size_t               stride;   // in elements
+  size_t               count;
+};
+
+static void read_task(void *ctx, size_t task, int)
+{
+  ReadJob &job = *(ReadJob *) ctx;
+  const size_t begin = task * TASK_SIZE;
+  const size_t end = (job.count - begin < TASK_SIZE) ? job.count : begin + TASK_SIZE;
+  const size_t size = job.type.size;
+  if (!job.type.swap && job.stride == 1 && (size == 8 || !job.type.integer)) {
+    memcpy((char *) job.dest + begin * size, job.source + begin * size, (end - begin) * size);
+    return;
+  }
+  const size_t step = job.stride * size;
+  switch (file_vec_type(job.type)) {
+  case VEC_I64:
+    for (size_t i = begin; i < end; i++) ((i64_alias *) job.dest)[i] = load_int_elem(job.source + i * step, job.type);
+    break;
+  case VEC_F32:
+    for (size_t i = begin; i < end; i++) ((f32_alias *) job.dest)[i] = load_elem(job.source + i * step, job.type);
+    break;
+  default:
+    for (size_t i = begin; i < end; i++) job.dest[i] = load_elem(job.source + i * step, job.type);
+    break;
+  }
+}
+
+// Number of elements selected by the offset, count and stride of instr among
+// total ones
+static int select_window(Tcl_Interp *interp, const Instr &instr, size_t total, size_t &count)
+{
+  const FileSpec &spec = instr.file;
+  count = spec.count;
+  if (count == 0 && spec.offset < total) {
+    count = (total - spec.offset + spec.stride - 1) / spec.stride;
+  }
+  if (count == 0 || spec.offset >= total || (count - 1) > (total - 1 - spec.offset) / spec.stride) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: \"%s\" holds %lu elements, too few for offset %lu count %lu stride %lu",
+                                           instr.name.c_str(), (unsigned long) total, (unsigned long) spec.offset,
+                                           (unsigned long) spec.count, (unsigned long) spec.stride));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// Elements of a mapped file selected by instr: their type, the position of
+// the first one (in bytes), and their number
+static int file_window(Tcl_Interp *interp, const Instr &instr, const MappedFile &map,
+                       ElemType &type, size_t &first, size_t &count)
+{
+  const FileSpec &spec = instr.file;
+  size_t total, start = 0;
+  if (spec.format == FILE_NPY) {
+    if (parse_npy(interp, instr.name, map, type, total, start) != TCL_OK) {
+      return TCL_ERROR;
+    }
+  } else {
+    type.size = (spec.format == FILE_F64) ? 8 : 4;
+    type.integer = false;
+    type.swap = !host_little_endian();
+    total = map.size / type.size;
+  }
+  if (select_window(interp, instr, total, count) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  first = start + spec.offset * type.size;
+  return TCL_OK;
+}
+
+static int read_file(Tcl_Interp *interp, const Instr &instr, Machine &m)
+{
+  MappedFile map;
+  ElemType   type;
+  size_t     first, count;
+  if (map_file(interp, instr.name, map) != TCL_OK
+      || file_window(interp, instr, map, type, first, count) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  ReadJob job;
+  job.source = map.data + first;
+  job.dest = push_typed(m, count, file_vec_type(type)).data();
+  job.type = type;
+  job.stride = instr.file.stride;
+  job.count = count;
+  run_tasks(m, count, (count + TASK_SIZE - 1) / TASK_SIZE, read_task, &job);
+  return TCL_OK;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+  const char *p = (const char *) data;
+  while (size > 0) {
+    const ssize_t n = write(fd, p, size);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Create the file of a >file: operator, for count elements of type vtype
+// (written by write_values); returns -1 with an error in interp. .npy files
+// keep the type of the vector (<f8 <f4 or <i8)
+static int open_output(Tcl_Interp *interp, const Instr &instr, size_t count, VecType vtype, ElemType &type)
+{
+  if (instr.file.format == FILE_NPY) {
+    type.size = (vtype == VEC_F32) ? 4 : 8;
+    type.integer = (vtype == VEC_I64);
+  } else {
+    type.size = (instr.file.format == FILE_F32) ? 4 : 8;
+    type.integer = false;
+  }
+  type.swap = !host_little_endian();
+
+  const int fd = open_file(interp, instr.name, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0 || instr.file.format != FILE_NPY) return fd;
+  // Version 1.0 header, padded so that the data start on 64 bytes
+  char dict[128];
+  snprintf(dict, sizeof(dict), "{'descr': '<%c%d', 'fortran_order': False, 'shape': (%lu,), }",
+           type.integer ? 'i' : 'f', (int) type.size, (unsigned long) count);
+  std::string header(dict);
+  header.append(63 - (10 + header.size()) % 64, ' ');
+  header += '\n';
+  unsigned char start[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+                              (unsigned char) (header.size() & 0xff), (unsigned char) (header.size() >> 8) };
+  if (!write_all(fd, start, sizeof(start)) || !write_all(fd, header.data(), header.size())) {
+    file_error(interp, "cannot write", instr.name);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int write_values(Tcl_Interp *interp, const Instr &instr, int fd, const std::vector<double> &vec,
+                        const ItemType &item, const ElemType &type)
+{
+  const size_t count = item_length(vec, item);
+  bool ok = true;
+  if (!type.swap && file_vec_type(type) == item.type) {
+    ok = write_all(fd, vec.data(), count * type.size);
+  } else {
+    unsigned char buf[FILE_CHUNK * sizeof(double)];
+    for (size_t begin = 0; ok && begin < count; begin += FILE_CHUNK) {
+      const size_t n = (count - begin < FILE_CHUNK) ? count - begin : FILE_CHUNK;
+      for (size_t i = 0; i < n; i++) store_elem(buf + i * type.size, vec.data(), item.type, begin + i, type);
+      ok = write_all(fd, buf, n * type.size);
+    }
+  }
+  return ok ? TCL_OK : file_error(interp, "cannot write", instr.name);
+}
+
+static int write_file(Tcl_Interp *interp, const Instr &instr, const std::vector<double> &vec, const ItemType &item)
+{
+  ElemType type;
+  const int fd = open_output(interp, instr, item_length(vec, item), item.type, type);
+  if (fd < 0) return TCL_ERROR;
+  if (write_values(interp, instr, fd, vec, item, type) != TCL_OK) {
+    close(fd);
+    return TCL_ERROR;
+  }
+  if (close(fd) != 0) {
+    return file_error(interp, "cannot write", instr.name);
+  }
+  return TCL_OK;
+}
+
+// Byte arrays
+// <bytes:type:varName pushes the contents of a byte array variable, as made
+// by binary format or read from a binary channel, and >bytes:type:varName
+// sets a variable to a byte array holding the top of the stack. type is f64
+// f32 i64 or i32 in the byte order of the host (binary format d f m n), or
+// followed by le or be for little- or big-endian (q r w i, Q R W I). Without
+// a type, byte arrays are read as f64 and written with the type of the
+// vector. Reading may select elements as for files. The bytes are copied
+// straight into or out of a stack buffer, swapped if their order differs.
+
+static ElemType bytes_elem_type(const FileSpec &spec, VecType vtype)
+{
+  ElemType type;
+  if (spec.format == FILE_ITEM) {
+    type.size = (vtype == VEC_F32) ? 4 : 8;
+    type.integer = (vtype == VEC_I64);
+  } else {
+    type.size = (spec.format == FILE_F64 || spec.format == FILE_I64) ? 8 : 4;
+    type.integer = (spec.format == FILE_I64 || spec.format == FILE_I32);
+  }
+  type.swap = (spec.order != '=') && ((spec.order == '<') != host_little_endian());
+  return type;
+}
+
+// Push the elements of size bytes at data selected by instr
+static int read_bytes(Tcl_Interp *interp, const Instr &instr, const unsigned char *data, size_t size, Machine &m)
+{
+  const ElemType type = bytes_elem_type(instr.file, VEC_F64);
+  size_t count;
+  if (size % type.size) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: byte array \"%s\" of %lu bytes does not hold whole %lu-byte elements",
+                                           instr.name.c_str(), (unsigned long) size, (unsigned long) type.size));
+    return TCL_ERROR;
+  }
+  if (select_window(interp, instr, size / type.size, count) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  ReadJob job;
+  job.source = data + instr.file.offset * type.size;
+  job.dest = push_typed(m, count, file_vec_type(type)).data();
+  job.type = type;
+  job.stride = instr.file.stride;
+  job.count = count;
+  run_tasks(m, count, (count + TASK_SIZE - 1) / TASK_SIZE, read_task, &job);
+  return TCL_OK;
+}
+
+// Store the elements of an item at p, given as i64 for integer types
+static int store_bytes(Tcl_Interp *interp, unsigned char *p, const std::vector<double> &vec, const ItemType &item,
+                       const ElemType &type)
+{
+  const size_t count = item_length(vec, item);
+  if (!type.swap && file_vec_type(type) == item.type && (type.size == 8 || !type.integer)) {
+    memcpy(p, vec.data(), count * type.size);
+    return TCL_OK;
+  }
+  const i64_alias *ints = (const i64_alias *) vec.data();
+  for (size_t i = 0; i < count; i++) {
+    if (type.integer && type.size == 4 && ints[i] != (int32_t) ints[i]) {
+      Tcl_SetResult(interp, (char *) "vecexpr: value out of range for i32", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    store_elem(p + i * type.size, vec.data(), item.type, i, type);
+  }
+  return TCL_OK;
+}
+
+// Streaming (vecexpr -chunk N, see run_stream)
+// Every <file: input is read N elements at a time through a reader thread,
+// which loads the next chunk of all inputs while the current one is being
+// processed (double buffering). >file: outputs of streamed data are written
+// chunk by chunk.
+
+static const size_t STREAM_SLOTS = 2;
+
+struct StreamInput {
+  const Instr *instr;
+  int          fd;
+  ElemType     type;
+  size_t       first;    // position of the first element, in bytes
+  size_t       stride;   // in elements
+  std::vector<unsigned char> raw[STREAM_SLOTS];
+};
+
+struct StreamOutput {
+  const Instr *instr;
+  int          fd;
+  ElemType     type;
+};
+
+struct Stream {
+  std::vector<StreamInput>  inputs;
+  std::vector<StreamOutput> outputs;
+  size_t        total;     // elements in each input
+  size_t        chunk;     // elements per chunk
+  size_t        nchunks;
+  size_t        current;   // chunk being processed
+  // Shared with the reader thread
+  Tcl_Mutex     mutex;
+  Tcl_Condition cond;
+  long          loaded[STREAM_SLOTS];  // chunk held by each slot, -1 if free
+  bool          stop;
+  std::string   error;     // set by the reader
+  Tcl_ThreadId  reader;
+  bool          threaded;
+};
+
+static inline size_t chunk_length(const Stream &st, size_t k)
+{
+  return (st.total - k * st.chunk < st.chunk) ? st.total - k * st.chunk : st.chunk;
+}
+
+// Read chunk k of every input into its slot; returns an error message, or ""
+static std::string load_chunk(Stream &st, size_t k)
+{
+  const size_t slot = k % STREAM_SLOTS;
+  const size_t n = chunk_length(st, k);
+  for (size_t i = 0; i < st.inputs.size(); i++) {
+    StreamInput &in = st.inputs[i];
+    const size_t bytes = ((n - 1) * in.stride + 1) * in.type.size;
+    const off_t  pos = in.first + (off_t) k * st.chunk * in.stride * in.type.size;
+    in.raw[slot].resize(bytes);
+    for (size_t done = 0; done < bytes; ) {
+      const ssize_t r = pread(in.fd, &in.raw[slot][done], bytes - done, pos + done);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) {
+        return "vecexpr: cannot read \"" + in.instr->name + "\": "
+               + (r < 0 ? Tcl_ErrnoMsg(errno) : "unexpected end of file");
+      }
+      done += r;
+    }
+  }
+  return "";
+}
+
+static Tcl_ThreadCreateType stream_reader(ClientData clientData)
+{
+  Stream &st = *(Stream *) clientData;
+  for (size_t k = 0; k < st.nchunks; k++) {
+    const size_t slot = k % STREAM_SLOTS;
+    Tcl_MutexLock(&st.mutex);
+    while (!st.stop && st.loaded[slot] != -1) Tcl_ConditionWait(&st.cond, &st.mutex, NULL);
+    const bool stop = st.stop;
+    Tcl_MutexUnlock(&st.mutex);
+    if (stop) break;
+    const std::string error = load_chunk(st, k);
+    // A chunk that failed is never published as loaded
+    Tcl_MutexLock(&st.mutex);
+    if (error.empty()) st.loaded[slot] = k;
+    st.error = error;
+    Tcl_ConditionNotify(&st.cond);
+    Tcl_MutexUnlock(&st.mutex);
+    if (!error.empty()) break;
+  }
+  Tcl_ExitThread(0);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+// Wait until chunk k of the inputs has been read
+static int wait_chunk(Tcl_Interp *interp, Stream &st, size_t k)
+{
+  const size_t slot = k % STREAM_SLOTS;
+  std::string error;
+  if (!st.threaded) {
+    error = load_chunk(st, k);
+  } else {
+    Tcl_MutexLock(&st.mutex);
+    while (st.loaded[slot] != (long) k && st.error.empty()) Tcl_ConditionWait(&st.cond, &st.mutex, NULL);
+    if (st.loaded[slot] != (long) k) error = st.error;
+    Tcl_MutexUnlock(&st.mutex);
+  }
+  if (!error.empty()) {
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(error.c_str(), -1));
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+}
+
+// Let the reader fill the slot of chunk k with a later chunk
+static void release_chunk(Stream &st, size_t k)
+{
+  if (!st.threaded) return;
+  Tcl_MutexLock(&st.mutex);
+  st.loaded[k % STREAM_SLOTS] = -1;
+  Tcl_ConditionNotify(&st.cond);
+  Tcl_MutexUnlock(&st.mutex);
+}
+
+// Is the file named name, if it exists, the one open as fd?
+static bool is_open_file(const std::string &name, int fd)
+{
+  Tcl_DString native;
+  if (!Tcl_TranslateFileName(NULL, name.c_str(), &native)) return false;
+  struct stat path_stat, fd_stat;
+  const bool same = stat(Tcl_DStringValue(&native), &path_stat) == 0 && fstat(fd, &fd_stat) == 0
+    && path_stat.st_dev == fd_stat.st_dev && path_stat.st_ino == fd_stat.st_ino;
+  Tcl_DStringFree(&native);
+  return same;
+}
+
+// Outputs are truncated when opened, and written chunk by chunk: none of them
+// can be a streamed input
+static int check_stream_output(Tcl_Interp *interp, const Stream &st, const std::string &name)
+{
+  for (size_t i = 0; i < st.inputs.size(); i++) {
+    if (st.inputs[i].fd >= 0 && is_open_file(name, st.inputs[i].fd)) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: cannot write \"%s\" while it is streamed (without -chunk, it can)",
+                                             name.c_str()));
+      return TCL_ERROR;
+    }
+  }
+  return TCL_OK;
+}
+
+// <file: while streaming: push the current chunk of the input
+static void stream_read(const Instr &instr, Machine &m)
+{
+  Stream &st = *m.stream;
+  size_t i = 0;
+  while (st.inputs[i].instr != &instr) i++;
+  const StreamInput &in = st.inputs[i];
+  const size_t n = chunk_length(st, st.current);
+  ReadJob job;
+  job.source = in.raw[st.current % STREAM_SLOTS].data();
+  job.dest = push_typed(m, n, file_vec_type(in.type)).data();
+  job.type = in.type;
+  job.stride = in.stride;
+  job.count = n;
+  run_tasks(m, n, (n + TASK_SIZE - 1) / TASK_SIZE, read_task, &job);
+}
+
+// >file: while streaming: append streamed data to the output, or write other
+// data as usual
+static int stream_write(Tcl_Interp *interp, const Instr &instr, Machine &m)
+{
+  const Stream &st = *m.stream;
+  for (size_t o = 0; o < st.outputs.size(); o++) {
+    if (st.outputs[o].instr == &instr) {
+      return write_values(interp, instr, st.outputs[o].fd, m.stack.back(), m.types.back(), st.outputs[o].type);
+    }
+  }
+  if (check_stream_output(interp, st, instr.name) != TCL_OK) return TCL_ERROR;
+  return write_file(interp, instr, m.stack.back(), m.types.back());
+}
+
+// Does op work on any type of operands? Others are given f64 operands
+static inline bool keeps_types(Opcode op)
+{
+  switch (op) {
+  case OP_SCALAR: case OP_PI: case OP_HEIGHT: case OP_RECALL: case OP_PUSH_VAR: case OP_READ_FILE:
+  case OP_WRITE_FILE: case OP_POP_VAR: case OP_POP_INT_VAR: case OP_READ_BYTES: case OP_WRITE_BYTES:
+  case OP_DUP: case OP_POP: case OP_STORE:
+  case OP_F64: case OP_F32: case OP_I64: case OP_CONCAT: case OP_SWAP: case OP_BIN:
+  case OP_BINND: case OP_WBINND: case OP_SLICE: case OP_STRIDE: case OP_ROW: case OP_COL:
+  case OP_SORT: case OP_ARGSORT: case OP_UNIQUE: case OP_COUNT: case OP_MEDIAN: case OP_PERCENTILE:
+  case OP_CUMSUM: case OP_CUMPROD: case OP_DIFF: case OP_BLOCKAVG: case OP_WSUM: case OP_WMEAN:
+  case OP_WMIN: case OP_WMAX:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Number of operands on top of the stack that op reads as plain vectors, and
+// which are materialized before it runs if they are views (see ItemType)
+static inline int plain_operands(Opcode op)
+{
+  switch (op) {
+  case OP_DUP: case OP_POP: case OP_STORE: case OP_SWAP:
+  case OP_SLICE: case OP_STRIDE: case OP_ROW: case OP_COL:  // views of views
+    return 0;
+  default:
+    return op_arity(op);
+  }
+}
+
+// Variable written earlier by the same -async command (others were read
+// beforehand): the last write of instr.name, of the kind instr reads
+static const VarWrite * written_var(Tcl_Interp *interp, const Instr &instr, const Machine &m)
+{
+  const VarWrite *w = NULL;
+  for (size_t i = m.var_writes->size(); i-- > 0 && !w; ) {
+    if ((*m.var_writes)[i].name == instr.name) w = &(*m.var_writes)[i];
+  }
+  if (!w) {
+    Tcl_SetResult(interp, (char *) "vecexpr: tried to push unknown Tcl variable", TCL_STATIC);
+  } else if (w->binary != (instr.op == OP_READ_BYTES)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: \"%s\" was written by %s and cannot be read by %s in the same -async command",
+                                           instr.name.c_str(), w->binary ? ">bytes:" : ">varName", op_name(instr.op)));
+    w = NULL;
+  }
+  return w;
+}
+
+// Run one instruction on the stack.
+// Stack heights have been checked beforehand (see obj_vecexpr)
+static int run_instr(Tcl_Interp *interp, const Instr &instr, Machine &m)
+{
+  std::vector<std::vector<double> > &stack = m.stack;
+
+  materialize_top(m, plain_operands(instr.op));
+  if (!keeps_types(instr.op)) {
+    widen_top(m, op_arity(instr.op));
+  }
+
+  size_t count_back = 0;
+  size_t count_prev = 0;
+  bool   mismatched = false; // are two different-length vectors on top of the stack?
+  int    back = 0, prev = 0;
+
+  if (stack.size() > 0) {
+    count_back = stack.back().size();
+    back = stack.size()-1; // last on stack
+  }
+  if (stack.size() > 1) {
+    prev = stack.size()-2; // second-to-last on stack
+    count_prev = stack[prev].size();
+    mismatched = (count_back != count_prev);
+  }
+
+  switch (instr.op) {
+
+  // Zero-ary functions first
+
+  case OP_SCALAR:
+    push_new(m, 1)[0] = instr.value;
+    break;
+
+  case OP_PI:
+    push_new(m, 1)[0] = M_PI;
+    break;
+
+  case OP_HEIGHT: {
+    //return stack height
+    const double height = stack.size();
+    push_new(m, 1)[0] = height;
+    break;
+  }
+
+  case OP_RECALL: {
+    const Register *r = find_register(m, instr.name);
+    if (!r) {
+      if (instr.name.empty()) {
+        Tcl_SetResult(interp, (char *) "vecexpr: trying to recall value from empty register", TCL_STATIC);
+      } else {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: trying to recall value from empty register \"%s\"",
+                                               instr.name.c_str()));
+      }
+      return TCL_ERROR;
+    }
+    const ItemType item = r->item;
+    item.shared->refs++;
+    stack.push_back(std::vector<double>());
+    m.types.push_back(item);
+    break;
+  }
+
+  case OP_PUSH_VAR: {
+    if (m.var_writes) {
+      // Written earlier by the same command (others were read beforehand)
+      const VarWrite *w = written_var(interp, instr, m);
+      if (!w) {
+        return TCL_ERROR;
+      }
+      const size_t n = item_length(w->buf, w->type);
+      memcpy(push_typed(m, n, w->type.type).data(), w->buf.data(), buffer_words(w->type.type, n) * sizeof(double));
+      break;
+    }
+    // This does not seem very useful, as the variable can be passed as
+    // a parameter to vecexpr slightly more efficiently than using this code
+    // 1000-buck question: why is {expr  1 + 2} slower than { vecexpr 1 2 add }, but
+    // { expr {$a + $b} } much faster than either { vecexpr $a $b add } or
+    // { vecexpr <a <b add } ???
+    // (the answer might lie in the code used internally to parse expr:
+    // http://tcl.cvs.sourceforge.net/viewvc/tcl/tcl/generic/tclCompExpr.c?view=markup )
+
+    Tcl_Obj *varData = Tcl_GetVar2Ex( interp, instr.name.c_str(), NULL, 0);
+    if ( varData == NULL ) {
+      Tcl_SetResult(interp, (char *) "vecexpr: tried to push unknown Tcl variable", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (push_data(interp, varData, m) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    break;
+  }
+
+  case OP_READ_BYTES: {
+    if (m.var_writes) {
+      const VarWrite *w = written_var(interp, instr, m);
+      if (!w || read_bytes(interp, instr, w->bytes.data(), w->bytes.size(), m) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      break;
+    }
+    Tcl_Obj *varData = Tcl_GetVar2Ex(interp, instr.name.c_str(), NULL, 0);
+    if (varData == NULL) {
+      Tcl_SetResult(interp, (char *) "vecexpr: tried to push unknown Tcl variable", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    int size;
+    const unsigned char *data = Tcl_GetByteArrayFromObj(varData, &size);
+    if (read_bytes(interp, instr, data, size, m) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    break;
+  }
+
+  case OP_READ_FILE:
+    if (m.stream) {
+      stream_read(instr, m);
+    } else if (read_file(interp, instr, m) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    break;
+
+  // Unary functions
+
+  case OP_WRITE_FILE:
+    if ((m.stream ? stream_write(interp, instr, m) : write_file(interp, instr, stack.back(), m.types.back())) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    pop(m);
+    break;
+
+  case OP_POP_VAR:
+  case OP_POP_INT_VAR:
+    if (instr.op == OP_POP_INT_VAR && convert_item(interp, m, back, VEC_I64) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (m.var_writes) {
+      m.var_writes->push_back(VarWrite());
+      VarWrite &w = m.var_writes->back();
+      w.name = instr.name;
+      w.buf.swap(stack.back());
+      w.type = m.types.back();
+      w.binary = false;
+    } else {
+      Tcl_SetVar2Ex (interp, instr.name.c_str(), NULL, new_result_obj(stack.back(), m.types.back(), m.decimals), 0);
+    }
+    pop(m);
+    break;
+
+  case OP_WRITE_BYTES: {
+    if ((instr.file.format == FILE_I64 || instr.file.format == FILE_I32)
+        && convert_item(interp, m, back, VEC_I64) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    const ElemType type = bytes_elem_type(instr.file, m.types.back().type);
+    const size_t size = item_length(stack.back(), m.types.back()) * type.size;
+    if (size > INT_MAX) {
+      Tcl_SetResult(interp, (char *) "vecexpr: vector too long for a byte array", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (m.var_writes) {
+      m.var_writes->push_back(VarWrite());
+      VarWrite &w = m.var_writes->back();
+      w.name = instr.name;
+      w.type = m.types.back();
+      w.binary = true;
+      w.bytes.resize(size);
+      if (store_bytes(interp, w.bytes.data(), stack.back(), m.types.back(), type) != TCL_OK) {
+        return TCL_ERROR;
+      }
+    } else {
+      Tcl_Obj *obj = Tcl_NewByteArrayObj(NULL, 0);
+      if (store_bytes(interp, Tcl_SetByteArrayLength(obj, size), stack.back(), m.types.back(), type) != TCL_OK) {
+        Tcl_DecrRefCount(obj);
+        return TCL_ERROR;
+      }
+      Tcl_SetVar2Ex(interp, instr.name.c_str(), NULL, obj, 0);
+    }
+    pop(m);
+    break;
+  }
+
+  // Element-wise unary operators and reductions always run through run_fused
+
+  case OP_DUP: {
+    // Both items share the buffer until one of them is written
+    share_item(m, back);
+    const ItemType item = m.types[back];
+    item.shared->refs++;
+    stack.push_back(std::vector<double>());
+    m.types.push_back(item);
+    break;
+  }
+
+  case OP_POP:
+    pop(m);
+    break;
+
+  case OP_STORE: {
+    share_item(m, back);
+    Register *r = find_register(m, instr.name);
+    if (!r) {
+      m.regs.push_back(Register());
+      r = &m.regs.back();
+      r->name = instr.name;
+    } else {
+      release_shared(m, r->item);
+    }
+    r->item = m.types[back];
+    r->item.shared->refs++;
+    break;
+  }
+
+  case OP_F64:
+  case OP_F32:
+  case OP_I64:
+    if (convert_item(interp, m, back, (instr.op == OP_F64) ? VEC_F64 : (instr.op == OP_F32) ? VEC_F32 : VEC_I64)
+        != TCL_OK) {
+      return TCL_ERROR;
+    }
+    break;
+
+  // ########## End of unary functions
+
+  case OP_CONCAT: {
+    if (m.types[prev].type != m.types[back].type) {
+      widen_top(m, 2);
+    }
+    const VecType type = m.types[back].type;
+    const size_t  n_prev = stack_length(m, prev);
+    const size_t  n_back = stack_length(m, back);
+    const size_t  words = buffer_words(type, n_prev + n_back);
+    if (stack[prev].capacity() < words) {
+      std::vector<double> buf;
+      m.buffers->take(buf, words);
+      memcpy(buf.data(), stack[prev].data(), stack[prev].size() * sizeof(double));
+      stack[prev].swap(buf);
+      m.buffers->give(buf);
+    }
+    stack[prev].resize(words);
+    if (type == VEC_F32) {
+      memcpy((f32_alias *) stack[prev].data() + n_prev, stack.back().data(), n_back * sizeof(float));
+    } else {
+      memcpy(stack[prev].data() + n_prev, stack.back().data(), n_back * sizeof(double));
+    }
+    m.types[prev] = item_type(type, n_prev + n_back);
+    pop(m);
+    break;
+  }
+
+  case OP_SWAP:
+    swap_items(m, back, prev);
+    break;
+
+  case OP_ADD:
+    if ( count_back == 1 || count_prev == 1 ) { // Add scalar to vector / matrix
+      if (count_back > 1) {
+        stack.back().swap(stack[prev]);
+        count_prev = count_back;
+      }
+      for (size_t i = 0; i < count_prev; i++) {
+        stack[prev][i] += stack.back()[0];
+      }
+    } else {
+      if ( mismatched ) {
+        // This could be a vector-matrix addition
+        const int ivec = (count_back < count_prev ? back : prev);
+        const int imat = (count_back < count_prev ? prev : back);
+        std::vector<double> & vec = stack[ivec];
+        std::vector<double> & mat = stack[imat];
+        size_t count_mat = mat.size();
+        size_t count_vec = vec.size();
+        if (count_mat % count_vec) {
+          Tcl_SetResult(interp, (char *) "vecexpr: matrix-vector add with non-divisor vector length", TCL_STATIC);
+          return TCL_ERROR;
+        }
+        if (count_back < count_prev) {
+          // <matrix> <vector> add: add vector to matrix rows
+          int k = 0;
+          for (size_t i = 0; i < count_mat / count_vec; i++) {
+            for (size_t j = 0; j < count_vec; j++) {
+              mat[k++] += vec[j];
+            }
+          }
+          pop(m); // get vector off the stack
+        } else {
+          // <vector> <matrix> add: add vector to matrix columns
+          int k = 0;
+          for (size_t j = 0; j < count_vec; j++) {
+            for (size_t i = 0; i < count_mat / count_vec; i++) {
+              mat[k++] += vec[j];
+            }
+          }
+          stack.back().swap(stack[prev]); // move vector to the back
+          pop(m); // get vector off the stack
+        }
+
+        // Leave matrix at the back of the stack
+        break;
+
+      } else {
         for (size_t i = 0; i < count_back; i++) {
-          dot += stack.back()[i] * stack[prev][i];
+          stack[prev][i] += stack.back()[i];
+        }
+      }
+    }
+    pop(m);
+    break;
+
+  case OP_DIV: {
+    bool zero = false;
+    for (size_t i = 0; i < count_back; i++) {if (stack.back()[i] == 0.0) zero = true;}
+    if (zero) {
+      Tcl_SetResult(interp, (char *) "vecexpr: divide by zero in function div", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if ( count_back == 1 || count_prev == 1 ) {
+      if (count_back > 1) {
+        stack.back().swap(stack[prev]);
+        count_prev = count_back;
+        for (size_t i = 0; i < count_prev; i++) {
+          stack[prev][i] = stack.back()[0] / stack[prev][i];
+        }
+      } else {
+        for (size_t i = 0; i < count_prev; i++) {
+          stack[prev][i] /= stack.back()[0];
+        }
+      }
+    } else {
+      if ( mismatched ) {
+        Tcl_SetResult(interp, (char *)  "vecexpr: attempting binary function on different-length vectors", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      for (size_t i = 0; i < count_back; i++) {
+        stack[prev][i] /= stack.back()[i];
+      }
+    }
+    pop(m);
+    break;
+  }
+
+  case OP_DOT: {
+    if (mismatched) {
+      Tcl_SetResult(interp, (char *) "vecexpr: function dot requires vectors of same length", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    double dot = 0.0;
+    for (size_t i = 0; i < count_back; i++) {
+      dot += stack.back()[i] * stack[prev][i];
+    }
+    pop(m);
+    stack.back().resize (1);
+    stack.back()[0] = dot;
+    break;
+  }
+
+  case OP_MIN_EW: {
+    if (count_back != 1) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: top of the stack should be scalar (number of lines) for min_ew", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (stack.back()[0] < 1) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: number of lines should be positive for min_ew", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    size_t nl = stack.back()[0];
+    pop(m);
+
+    if (count_prev % nl) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: number of lines does not divide length of unrolled matrix", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    size_t length = count_prev / nl;
+    if (length == 0 || nl < 2) { // No work to do
+      break;
+    }
+    std::vector<double> result;
+    m.buffers->take(result, length);
+    std::vector<double> &source = stack.back();
+
+    for (size_t j = 0; j < length; j++) {
+      result[j] = source[j];
+      for (size_t i = 1; i < nl; i++) {
+        if (source[i*length + j] < result[j])
+          result[j] = source[i*length + j];
+      }
+    }
+    stack.back().swap(result);
+    m.buffers->give(result);
+    break;
+  }
+
+  case OP_MULT:
+    if ( count_back == 1 || count_prev == 1 ) {
+      if (count_back > 1) {
+        stack.back().swap(stack[prev]);
+        count_prev = count_back;
+      }
+      for (size_t i = 0; i < count_prev; i++) {
+        stack[prev][i] *= stack.back()[0];
+      }
+    } else {
+      if ( mismatched ) {
+        Tcl_SetResult(interp, (char *)  "vecexpr: cannot element-wise multiply different-length vectors", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      for (size_t i = 0; i < count_back; i++) {
+        stack[prev][i] *= stack.back()[i];
+      }
+    }
+    pop(m);
+    break;
+
+  case OP_SUB:
+    if ( count_back == 1 || count_prev == 1 ) { // subtract scalar from vector or reverse
+      if (count_back > 1) {
+        stack.back().swap(stack[prev]);
+        count_prev = count_back;
+        for (size_t i = 0; i < count_prev; i++) {
+          stack[prev][i] = stack.back()[0] - stack[prev][i];
+        }
+      } else {
+        for (size_t i = 0; i < count_prev; i++) {
+          stack[prev][i] -= stack.back()[0];
+        }
+      }
+    } else {
+      if ( mismatched ) {
+        Tcl_SetResult(interp, (char *)  "vecexpr: cannot element-wise subtract different-length vectors", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      for (size_t i = 0; i < count_back; i++) {
+        stack[prev][i] -= stack.back()[i];
+      }
+    }
+    pop(m);
+    break;
+
+  case OP_ATAN2: // ATAN2(Y, X)
+    if ( mismatched ) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: function atan2 requires two vectors of same length", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    for (size_t i = 0; i < count_back; i++) {
+      stack[prev][i] = atan2(stack[prev][i], stack[back][i]);
+    }
+    pop(m);
+    break;
+
+  case OP_TRANSP: {
+    if (count_back != 1) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: top of the stack should be scalar (number of lines) for transp", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (stack.back()[0] < 1) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: number of lines should be positive for transp", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    size_t ni = stack.back()[0];
+    pop(m);
+
+    if (count_prev % ni) {
+      Tcl_SetResult(interp, (char *)  "vecexpr: number of lines does not divide length of unrolled matrix", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    size_t nj = count_prev / ni;
+    if (ni < 2 || nj < 2) { // Same layout: no work to do
+      break;
+    }
+    TranspJob job;
+    job.ni = ni;
+    job.nj = nj;
+    if (ni == nj) {
+      job.source = job.dest = stack.back().data();
+      run_tasks(m, count_prev, (ni + TRANSP_TILE - 1) / TRANSP_TILE, transp_square_task, &job);
+      break;
+    }
+    std::vector<double> buf;
+    m.buffers->take(buf, count_prev);
+    job.source = stack.back().data();
+    job.dest = buf.data();
+    run_tasks(m, count_prev, (ni + TRANSP_TILE - 1) / TRANSP_TILE, transp_task, &job);
+    stack.back().swap(buf);
+    m.buffers->give(buf);
+    break;
+  }
+
+  // end of binary functions
+
+  case OP_MATMULT: {
+    if (count_back != 1) {
+        Tcl_SetResult (interp, (char *) "matmult: common dimension specifier should be a scalar", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    // Range-checked before converting: a dimension larger than the second
+    // matrix cannot divide its size
+    const double dim = item_elem(m, back, 0);
+    if (!(dim >= 1)) {
+        Tcl_SetResult (interp, (char *) "matmult: common dimension should be positive", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    const size_t nj1 = (dim <= (double) stack_length(m, prev)) ? (size_t) dim : 0;
+    const size_t ni2 = nj1;
+
+    pop(m);
+    std::vector<double> * mat1 = &(stack[stack.size() - 2]);
+    std::vector<double> * mat2 = &(stack.back());
+
+    if (!nj1 || mat1->size() % nj1 || mat2->size() % ni2) {
+        Tcl_SetResult (interp, (char *) "matmult: matrix size not a multiple of common dimension", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    size_t ni1 = mat1->size() / nj1;
+    size_t nj2 = mat2->size() / ni2;
+
+    std::vector<double> result;
+    m.buffers->take(result, ni1 * nj2);
+    run_matmult(m, mat1->data(), mat2->data(), result.data(), ni1, nj1, nj2);
+    // The operands are consumed
+    pop(m);
+    stack.back().swap(result);
+    m.buffers->give(result);
+    break;
+  }
+
+  case OP_SLICE: case OP_STRIDE: case OP_ROW: case OP_COL: {
+    // Only the type of the vector changes: it becomes a view of its buffer
+    const size_t vec = stack.size() - 3;
+    const size_t n = stack_length(m, vec);
+    int64_t      a, b;
+    if (stack_length(m, prev) != 1 || stack_length(m, back) != 1
+        || !floor_i64(item_elem(m, prev, 0), a) || !floor_i64(item_elem(m, back, 0), b)
+        || a != item_elem(m, prev, 0) || b != item_elem(m, back, 0)) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: the last two operands of %s should be integer scalars",
+                                             op_name(instr.op)));
+      return TCL_ERROR;
+    }
+    size_t first, step, count;
+    if (instr.op == OP_ROW || instr.op == OP_COL) {
+      if (a < 1) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: number of lines should be positive for %s",
+                                               op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      if (n % a) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: number of lines does not divide length of unrolled matrix for %s",
+                                               op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      const size_t ncols = n / a;
+      const bool   row = (instr.op == OP_ROW);
+      if (b < 0 || (size_t) b >= (row ? (size_t) a : ncols)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s index out of range", op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      first = row ? b * ncols : b;
+      step = row ? 1 : ncols;
+      count = row ? ncols : a;
+    } else {
+      // slice: first count, stride: first step
+      if (a < 0 || (size_t) a >= n || b < 1 || (instr.op == OP_SLICE && (size_t) b > n - a)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s out of range of a vector of %lu elements",
+                                               op_name(instr.op), (unsigned long) n));
+        return TCL_ERROR;
+      }
+      first = a;
+      step = (instr.op == OP_SLICE) ? 1 : b;
+      count = (instr.op == OP_SLICE) ? b : (n - a + b - 1) / b;
+    }
+    pop(m);
+    pop(m);
+    // A view of a view selects from the same buffer
+    ItemType &t = m.types[vec];
+    const size_t base_stride = t.stride ? t.stride : 1;
+    t.offset += first * base_stride;
+    t.stride = step * base_stride;
+    t.length = count;
+    break;
+  }
+
+  // end of ternary functions
+
+  case OP_NORM3: case OP_NORMALIZE3: case OP_CROSS3: case OP_DOT3: case OP_COM3: case OP_TRANSFORM3: {
+    const int arity = op_arity(instr.op);
+    const std::vector<double> *points = &stack[stack.size() - arity];
+    const std::vector<double> *other = (arity > 1) ? &stack[stack.size() - arity + 1] : NULL;
+    XyzJob job;
+    job.op = instr.op;
+    job.b = NULL;
+    job.broadcast = false;
+    job.reversed = false;
+    job.out = (instr.op == OP_NORM3 || instr.op == OP_DOT3) ? 1 : 3;
+    if (instr.op == OP_CROSS3 || instr.op == OP_DOT3) {
+      // Either operand may be a single 3-vector
+      if (points->size() == 3 && other->size() != 3) {
+        std::swap(points, other);
+        job.reversed = true;
+      }
+      job.broadcast = (other->size() == 3 && points->size() != 3);
+      if (!job.broadcast && other->size() != points->size()) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: function %s requires the same number of 3-vectors, or a single one",
+                                               op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      job.b = other->data();
+    }
+    if (points->size() % 3 != 0) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: function %s requires packed 3-vectors (x y z ...), got %lu numbers",
+                                             op_name(instr.op), (unsigned long) points->size()));
+      return TCL_ERROR;
+    }
+    job.a = points->data();
+    job.n = points->size() / 3;
+    if (instr.op == OP_COM3) {
+      job.broadcast = (other->size() == 1);
+      if (!job.broadcast && other->size() != job.n) {
+        Tcl_SetResult(interp, (char *) "vecexpr: function com3 requires one weight per 3-vector, or a scalar", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      job.b = other->data();
+    }
+    if (instr.op == OP_TRANSFORM3) {
+      const std::vector<double> &shift = stack.back();
+      if (other->size() != 9 || (shift.size() != 3 && shift.size() != 1)) {
+        Tcl_SetResult(interp, (char *) "vecexpr: transform3 needs a 3x3 matrix and a translation (3-vector or scalar)", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      memcpy(job.xform, other->data(), 9 * sizeof(double));
+      for (int k = 0; k < 3; k++) job.xform[9 + k] = shift[(shift.size() > 1) ? k : 0];
+      job.b = job.xform;
+    }
+
+    const size_t ntasks = (job.n + TASK_SIZE - 1) / TASK_SIZE;
+    std::vector<double> result;
+    m.buffers->take(result, (instr.op == OP_COM3) ? 3 : job.n * job.out);
+    job.t = result.data();
+    if (instr.op == OP_COM3) job.partial.assign(4 * ntasks, 0.0);
+    run_tasks(m, 3 * job.n, ntasks, xyz_task, &job);
+    if (instr.op == OP_COM3) {
+      double sums[4] = { 0.0, 0.0, 0.0, 0.0 };
+      for (size_t task = 0; task < ntasks; task++) {
+        for (int k = 0; k < 4; k++) sums[k] += job.partial[4 * task + k];
+      }
+      if (sums[3] == 0.0) {
+        m.buffers->give(result);
+        Tcl_SetResult(interp, (char *) "vecexpr: weights add up to zero in function com3", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      for (int k = 0; k < 3; k++) result[k] = sums[k] / sums[3];
+    }
+    for (int i = 1; i < arity; i++) pop(m);
+    stack.back().swap(result);
+    m.types.back() = item_type(VEC_F64, stack.back().size());
+    m.buffers->give(result);
+    break;
+  }
+
+  case OP_NEIGHBORS3: case OP_PAIRS3: case OP_PAIRHIST3:
+  case OP_SELFNEIGHBORS3: case OP_SELFPAIRS3: case OP_SELFPAIRHIST3: {
+    // The self operators run as the others, with one set for both
+    const bool self = (instr.op == OP_SELFNEIGHBORS3 || instr.op == OP_SELFPAIRS3 || instr.op == OP_SELFPAIRHIST3);
+    const Opcode op = (instr.op == OP_SELFNEIGHBORS3) ? OP_NEIGHBORS3 : (instr.op == OP_SELFPAIRS3) ? OP_PAIRS3
+      : (instr.op == OP_SELFPAIRHIST3) ? OP_PAIRHIST3 : instr.op;
+    const int arity = op_arity(instr.op);
+    const size_t first = stack.size() - arity, sets = self ? 1 : 2;
+    const std::vector<double> &a = stack[first], &b = stack[first + sets - 1], &box = stack[first + sets];
+    const std::vector<double> &cutoff = stack[first + sets + 1];
+    for (size_t i = first; i < first + sets; i++) {
+      if (stack[i].size() % 3 != 0) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: function %s requires packed 3-vectors (x y z ...), got %lu numbers",
+                                               op_name(instr.op), (unsigned long) stack[i].size()));
+        return TCL_ERROR;
+      }
+      for (size_t k = 0; k < stack[i].size(); k++) {
+        if (!std::isfinite(stack[i][k])) {
+          Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: coordinates should be finite for %s", op_name(instr.op)));
+          return TCL_ERROR;
+        }
+      }
+    }
+    if (cutoff.size() != 1 || !(cutoff[0] > 0.0)) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: the cutoff should be a positive scalar for %s", op_name(instr.op)));
+      return TCL_ERROR;
+    }
+    if (box.size() != 1 && box.size() != 3) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: the box should be 0, a scalar or a 3-vector for %s", op_name(instr.op)));
+      return TCL_ERROR;
+    }
+    for (size_t d = 0; d < box.size(); d++) {
+      if ((box.size() == 3 || box[0] != 0.0) && !(box[d] >= 2 * cutoff[0] && box[d] < HUGE_VAL)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: the box should be at least twice the cutoff for %s", op_name(instr.op)));
+        return TCL_ERROR;
+      }
+    }
+    PairJob job;
+    job.op = op;
+    job.nbins = 0;
+    job.hist_scale = 0.0;
+    if (op == OP_PAIRHIST3) {
+      if (stack.back().size() != 1 || !(stack.back()[0] >= 1.0 && stack.back()[0] <= (double) (SIZE_MAX / sizeof(double)))) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: nbins should be a positive scalar for %s", op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      job.nbins = (size_t) stack.back()[0];
+      job.hist_scale = job.nbins / cutoff[0];
+    }
+    CellGrid grid;
+    build_grid(grid, a.data(), a.size() / 3, b.data(), b.size() / 3, box, cutoff[0]);
+    job.grid = &grid;
+    job.a = a.data();
+    job.n1 = a.size() / 3;
+    job.same = self;
+    job.cutoff2 = cutoff[0] * cutoff[0];
+    job.counts = NULL;
+    job.hist = NULL;
+    job.order = NULL;
+    std::vector<size_t> order, start;
+    if (op != OP_PAIRS3) {
+      if (!job.same) sort_by_cell(grid, job.a, job.n1, start, order);
+      job.order = job.same ? grid.index.data() : order.data();
+    }
+
+    const size_t ntasks = (job.n1 + PAIR_TASK - 1) / PAIR_TASK;
+    std::vector<double> result;
+    if (op == OP_NEIGHBORS3) {
+      m.buffers->take(result, job.n1);
+      job.counts = result.data();
+    } else if (op == OP_PAIRHIST3) {
+      take_per_worker(m, job.nbins, task_workers(m, job.n1 * PAIR_WORK, ntasks));
+      for (size_t w = 0; w < m.per_worker.size(); w++) {
+        memset(m.per_worker[w].data(), 0, job.nbins * sizeof(double));
+      }
+      job.hist = &m.per_worker;
+    } else {
+      job.pairs.resize(ntasks);
+    }
+    run_tasks(m, job.n1 * PAIR_WORK, ntasks, pair_task, &job);
+    if (op == OP_PAIRHIST3) {
+      i64_alias *hist = (i64_alias *) m.per_worker[0].data();
+      for (size_t w = 1; w < m.per_worker.size(); w++) {
+        const i64_alias *counts = (const i64_alias *) m.per_worker[w].data();
+        for (size_t k = 0; k < job.nbins; k++) hist[k] += counts[k];
+      }
+      result.swap(m.per_worker[0]);
+      give_per_worker(m);
+    } else if (op == OP_PAIRS3) {
+      size_t total = 0;
+      for (size_t task = 0; task < ntasks; task++) total += job.pairs[task].size();
+      m.buffers->take(result, total);
+      i64_alias *dest = (i64_alias *) result.data();
+      for (size_t task = 0; task < ntasks; task++) {
+        if (!job.pairs[task].empty()) memcpy(dest, job.pairs[task].data(), job.pairs[task].size() * sizeof(int64_t));
+        dest += job.pairs[task].size();
+      }
+    }
+    for (int i = 1; i < arity; i++) pop(m);
+    stack.back().swap(result);
+    m.types.back() = item_type(VEC_I64, stack.back().size());
+    m.buffers->give(result);
+    break;
+  }
+
+  case OP_BIN: case OP_BINND: case OP_WBINND: {
+    // The coordinates keep their type, the weights are f64; the histogram
+    // holds i64 counts (bin, binnd) or f64 sums of weights (wbinnd)
+    const bool weighted = (instr.op == OP_WBINND);
+    widen_top(m, weighted ? 4 : 3);
+    const std::vector<double> &min = stack[stack.size()-3], &dx = stack[stack.size()-2], &nbins = stack.back();
+    size_t dims = 1;
+    for (size_t i = stack.size() - 3; i < stack.size(); i++) {
+      if (stack[i].size() > dims) dims = stack[i].size();
+    }
+    if (instr.op == OP_BIN && dims != 1) {
+        Tcl_SetResult (interp, (char *) "bin needs 3 scalars on the stack: min, dx, and nbins.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    BinJob job;
+    job.dims = dims;
+    job.bins = 1;
+    job.min.resize(dims);
+    job.inv_dx.resize(dims);
+    job.nbins.resize(dims);
+    for (size_t d = 0; d < dims; d++) {
+      if ((min.size() != 1 && min.size() != dims) || (dx.size() != 1 && dx.size() != dims)
+          || (nbins.size() != 1 && nbins.size() != dims)) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: min, dx and nbins should be scalars or have the same length for %s",
+                                               op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      job.min[d] = min[(min.size() > 1) ? d : 0];
+      job.inv_dx[d] = 1.0 / dx[(dx.size() > 1) ? d : 0];
+      job.nbins[d] = floor(nbins[(nbins.size() > 1) ? d : 0]);
+      if (!(job.nbins[d] >= 0) || job.nbins[d] * job.bins > (double) (SIZE_MAX / sizeof(double))) {
+        Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: bad number of bins for %s", op_name(instr.op)));
+        return TCL_ERROR;
+      }
+      job.bins *= (size_t) job.nbins[d];
+    }
+    pop(m); pop(m); pop(m);
+
+    const size_t data = stack.size() - (weighted ? 2 : 1);
+    const size_t length = stack_length(m, data);
+    if (length % dims != 0) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %lu coordinates are not a whole number of %lu-dimensional samples for %s",
+                                             (unsigned long) length, (unsigned long) dims, op_name(instr.op)));
+      return TCL_ERROR;
+    }
+    job.data = stack[data].data();
+    job.type = m.types[data].type;
+    job.count = length / dims;
+    job.weights = NULL;
+    if (weighted) {
+      if (stack.back().size() != job.count) {
+        Tcl_SetResult(interp, (char *) "vecexpr: wbinnd needs one weight per sample", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      job.weights = stack.back().data();
+    }
+    // One task, and histogram, per worker that runs
+    const size_t ntasks = task_workers(m, length, (job.count + TASK_SIZE - 1) / TASK_SIZE);
+    job.per_task = (job.count + ntasks - 1) / ntasks;
+    take_per_worker(m, job.bins, ntasks);
+    job.hist = &m.per_worker;
+    for (size_t w = 0; w < ntasks; w++) {
+      memset(m.per_worker[w].data(), 0, job.bins * sizeof(double));
+    }
+    run_tasks(m, length, ntasks, bin_task, &job);
+    if (ntasks > 1) {
+      run_tasks(m, job.bins * m.per_worker.size(), (job.bins + TASK_SIZE - 1) / TASK_SIZE, bin_sum_task, &job);
+    }
+    // Replace the data (and weights) with the histogram
+    if (weighted) pop(m);
+    stack.back().swap(m.per_worker[0]);
+    m.types.back() = item_type(weighted ? VEC_F64 : VEC_I64, job.bins);
+    give_per_worker(m);
+    break;
+  }
+
+  case OP_SORT: case OP_ARGSORT: case OP_UNIQUE: case OP_COUNT: {
+    // Elements keep their type; argsort and count give i64
+    const VecType type = m.types[back].type;
+    const size_t  n = stack_length(m, back);
+    std::vector<double> keys, index;
+    m.buffers->take(keys, n);
+    u64_alias *k = (u64_alias *) keys.data();
+    for (size_t i = 0; i < n; i++) k[i] = sort_key(stack[back].data(), type, i);
+    if (instr.op == OP_ARGSORT) {
+      m.buffers->take(index, n);
+      for (size_t i = 0; i < n; i++) ((i64_alias *) index.data())[i] = i;
+    }
+    sort_keys(m, keys, (instr.op == OP_ARGSORT) ? &index : NULL, n);
+    k = (u64_alias *) keys.data();
+    if (instr.op == OP_SORT) {
+      for (size_t i = 0; i < n; i++) store_key(stack[back].data(), type, i, k[i]);
+    } else if (instr.op == OP_ARGSORT) {
+      stack[back].swap(index);
+      m.types[back] = item_type(VEC_I64, n);
+      m.buffers->give(index);
+    } else {
+      // Runs of equal values: the first of each (unique) or their lengths (count)
+      size_t nu = 0;
+      i64_alias *counts = (i64_alias *) keys.data();  // behind the keys still to read
+      for (size_t i = 0; i < n; nu++) {
+        size_t j = i + 1;
+        while (j < n && same_key(k[j - 1], k[j], type)) j++;
+        if (instr.op == OP_UNIQUE) {
+          store_key(stack[back].data(), type, nu, k[i]);
+        } else {
+          counts[nu] = j - i;
+        }
+        i = j;
+      }
+      if (instr.op == OP_COUNT) {
+        stack[back].swap(keys);
+        m.types[back] = item_type(VEC_I64, nu);
+      } else {
+        m.types[back] = item_type(type, nu);
+      }
+      stack[back].resize(buffer_words(m.types[back].type, nu));
+    }
+    m.buffers->give(keys);
+    break;
+  }
+
+  case OP_MEDIAN: case OP_PERCENTILE: {
+    // The data are kept; median pushes its result, percentile replaces the
+    // percents with theirs
+    const size_t data = (instr.op == OP_MEDIAN) ? back : prev;
+    const size_t n = stack_length(m, data);
+    const size_t np = (instr.op == OP_MEDIAN) ? 1 : stack_length(m, back);
+    std::vector<double> p(np, 50.0);
+    if (instr.op == OP_PERCENTILE) {
+      for (size_t i = 0; i < np; i++) {
+        p[i] = item_elem(m, back, i);
+        if (!(p[i] >= 0.0 && p[i] <= 100.0)) {
+          Tcl_SetResult(interp, (char *) "vecexpr: percentiles should be between 0 and 100", TCL_STATIC);
+          return TCL_ERROR;
         }
-        stack.pop_back();
-        stack.back().resize (1);
-        stack.back()[0] = dot;
+      }
+    }
+    std::vector<double> x, result;
+    m.buffers->take(x, n);
+    to_doubles(x.data(), stack[data].data(), m.types[data].type, 0, 1, n);
+    m.buffers->take(result, np);
+    percentiles(m, x, n, p.data(), np, result.data());
+    m.buffers->give(x);
+    if (instr.op == OP_PERCENTILE) pop(m);
+    stack.push_back(std::vector<double>());
+    m.types.push_back(F64_ITEM);
+    stack.back().swap(result);
+    break;
+  }
+
+  case OP_CUMSUM: case OP_CUMPROD: {
+    // Sums of i64 stay i64; others are computed in f64
+    const bool integer = (instr.op == OP_CUMSUM && m.types[back].type == VEC_I64);
+    if (!integer) convert_item(NULL, m, back, VEC_F64);
+    scan(m, stack[back].data(), stack_length(m, back), instr.op, integer);
+    break;
+  }
+
+  case OP_DIFF: case OP_BLOCKAVG: case OP_WSUM: case OP_WMEAN: case OP_WMIN: case OP_WMAX: {
+    const size_t data = (instr.op == OP_DIFF) ? back : prev;
+    const size_t n = stack_length(m, data);
+    WindowJob job;
+    job.op = instr.op;
+    job.w = 1;
+    job.count = n - 1;
+    if (instr.op == OP_DIFF && n < 2) {
+      Tcl_SetResult(interp, (char *) "vecexpr: diff needs at least two elements", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (instr.op != OP_DIFF) {
+      const double length = item_elem(m, back, 0);
+      if (check_window(interp, instr.op, n, stack_length(m, back), true, length, job.count) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      job.w = (size_t) length;
+      pop(m);
+    }
+    // wmin and wmax keep the type, diff and wsum keep i64; others are computed in f64
+    const VecType type = m.types[data].type;
+    if (instr.op != OP_WMIN && instr.op != OP_WMAX
+        && !((instr.op == OP_DIFF || instr.op == OP_WSUM) && type == VEC_I64)) {
+      convert_item(NULL, m, data, VEC_F64);
+    }
+    job.type = m.types[data].type;
+    job.x = stack[data].data();
+    std::vector<double> result;
+    m.buffers->take(result, buffer_words(job.type, job.count));
+    job.out = result.data();
+    // Windows are combined by blocks of w, which tasks do not split
+    job.per_task = std::max((size_t) 1, TASK_SIZE / job.w);
+    if (instr.op != OP_DIFF && instr.op != OP_BLOCKAVG) job.per_task *= job.w;
+    const size_t ntasks = (job.count + job.per_task - 1) / job.per_task;
+    run_tasks(m, n, ntasks, window_task, &job);
+    stack[data].swap(result);
+    m.buffers->give(result);
+    m.types[data] = item_type(job.type, job.count);
+    break;
+  }
+  default:
+    break;
+  }
+  return TCL_OK;
+}
+
+// SIMD math kernels
+// Element-wise operators run through ew_kernel, reductions through
+// reduce_kernel, matrix products through gemm_kernel, and 3-vector operators
+// through xyz_kernel. All are compiled for several instruction sets (baseline
+// SSE2, AVX2+FMA, AVX-512) and selected at load time in Vecexpr_Init from the
+// CPU features (the VECEXPR_ISA environment variable can force a lower one:
+// sse2, avx2 or avx512). The transcendental
+// functions below are branch-free so that the compiler vectorizes them; this
+// requires -fno-math-errno -fno-trapping-math (see Makefile).
+// Accuracy, measured against glibc libm (see test_math.tcl):
+//   exp, log          <= 1 ulp over the whole range, incl. subnormals
+//   sin, cos          <= 1 ulp for |x| <= 10, <= 2 ulp for |x| <= 1e5
+//   tan               <= 4 ulp for |x| <= 1e5
+//   atan2             <= 2 ulp
+//   sqrt, arithmetic  correctly rounded (same as scalar code)
+// For |x| > 1e5, sin cos and tan fall back to libm, as does atan2 for infinite
+// arguments.
+
+#define VK_INLINE static inline __attribute__((always_inline))
+
+VK_INLINE uint64_t vk_bits(double x) { uint64_t u; memcpy(&u, &x, 8); return u; }
+VK_INLINE double vk_double(uint64_t u) { double x; memcpy(&x, &u, 8); return x; }
+
+static const double VK_SHIFT = 6755399441055744.0; // 0x1.8p52: x + VK_SHIFT rounds x to an integer
+static const double VK_TRIG_MAX = 1e5;             // larger arguments of sin cos tan use libm
+
+VK_INLINE double vk_exp(double x)
+{
+  const double LOG2E  = 1.4426950408889634074;
+  const double LN2_HI = 6.93147180369123816490e-01;
+  const double LN2_LO = 1.90821492927058770002e-10;
+  double xc = (x < -746.0) ? -746.0 : x;
+  xc = (xc > 710.0) ? 710.0 : xc;
+  // x = k ln(2) + r, |r| <= ln(2)/2
+  const double k = (xc * LOG2E + VK_SHIFT) - VK_SHIFT;
+  const double r = (xc - k * LN2_HI) - k * LN2_LO;
+  // exp(r): Taylor series to degree 13
+  double p = 1.0 / 6227020800.0;
+  p = p * r + 1.0 / 479001600.0;
+  p = p * r + 1.0 / 39916800.0;
+  p = p * r + 1.0 / 3628800.0;
+  p = p * r + 1.0 / 362880.0;
+  p = p * r + 1.0 / 40320.0;
+  p = p * r + 1.0 / 5040.0;
+  p = p * r + 1.0 / 720.0;
+  p = p * r + 1.0 / 120.0;
+  p = p * r + 1.0 / 24.0;
+  p = p * r + 1.0 / 6.0;
+  p = p * r + 0.5;
+  p = 1.0 + (r + r * r * p);
+  // 2^k as two factors, so that both stay normal down to the subnormal range
+  const double k1 = (k * 0.5 + VK_SHIFT) - VK_SHIFT;
+  const double k2 = k - k1;
+  const double s1 = vk_double((vk_bits(k1 + 1023.0 + VK_SHIFT) - vk_bits(VK_SHIFT)) << 52);
+  const double s2 = vk_double((vk_bits(k2 + 1023.0 + VK_SHIFT) - vk_bits(VK_SHIFT)) << 52);
+  return (p * s1) * s2;
+}
+
+VK_INLINE double vk_log(double x)
+{
+  // fdlibm's e_log.c algorithm
+  const double LN2_HI = 6.93147180369123816490e-01;
+  const double LN2_LO = 1.90821492927058770002e-10;
+  const double Lg1 = 6.666666666666735130e-01;
+  const double Lg2 = 3.999999999940941908e-01;
+  const double Lg3 = 2.857142874366239149e-01;
+  const double Lg4 = 2.222219843214978396e-01;
+  const double Lg5 = 1.818357216161805012e-01;
+  const double Lg6 = 1.531383769920937332e-01;
+  const double Lg7 = 1.479819860511658591e-01;
+  const double TWO52 = 4503599627370496.0;
+  // bring subnormals to the normal range
+  const bool   sub = (x < 2.2250738585072014e-308);
+  const double xs  = sub ? x * TWO52 : x;
+  const uint64_t u = vk_bits(xs);
+  double e = vk_double((u >> 52) | vk_bits(TWO52)) - TWO52 - 1023.0;
+  e = sub ? e - 52.0 : e;
+  // x = 2^e m, sqrt(2)/2 < m <= sqrt(2)
+  double m = vk_double((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+  const bool big = (m > 1.4142135623730951);
+  m = big ? m * 0.5 : m;
+  e = big ? e + 1.0 : e;
+  const double f = m - 1.0;
+  const double s = f / (2.0 + f);
+  const double z = s * s;
+  const double w = z * z;
+  const double t1 = w * (Lg2 + w * (Lg4 + w * Lg6));
+  const double t2 = z * (Lg1 + w * (Lg3 + w * (Lg5 + w * Lg7)));
+  const double R = t2 + t1;
+  const double hfsq = 0.5 * f * f;
+  double res = e * LN2_HI - ((hfsq - (s * (hfsq + R) + e * LN2_LO)) - f);
+  res = (x == HUGE_VAL) ? x : res;
+  res = (x == 0.0) ? -HUGE_VAL : res;
+  res = (x < 0.0 || x != x) ? NAN : res;
+  return res;
+}
+
+// Reduce x to r in [-pi/4, pi/4], x = r + n pi/2; returns n in the low bits
+VK_INLINE uint64_t vk_reduce(double x, double *r)
+{
+  const double TWO_OVER_PI = 6.36619772367581382433e-01;
+  const double PIO2_1 = 1.57079632673412561417e+00; // 33 bits, n * PIO2_1 is exact
+  const double PIO2_2 = 6.07710050630396597660e-11;
+  const double PIO2_3 = 2.02226624871116645580e-21;
+  const double t = x * TWO_OVER_PI + VK_SHIFT;
+  const double n = t - VK_SHIFT;
+  *r = ((x - n * PIO2_1) - n * PIO2_2) - n * PIO2_3;
+  return vk_bits(t);
+}
+
+// fdlibm's __kernel_sin and __kernel_cos on [-pi/4, pi/4]
+VK_INLINE double vk_sin_poly(double r)
+{
+  const double S1 = -1.66666666666666324348e-01;
+  const double S2 =  8.33333333332248946124e-03;
+  const double S3 = -1.98412698298579493134e-04;
+  const double S4 =  2.75573137070700676789e-06;
+  const double S5 = -2.50507602534068634195e-08;
+  const double S6 =  1.58969099521155010221e-10;
+  const double z = r * r;
+  const double p = S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)));
+  return r + z * r * (S1 + z * p);
+}
+
+VK_INLINE double vk_cos_poly(double r)
+{
+  const double C1 =  4.16666666666666019037e-02;
+  const double C2 = -1.38888888888741095749e-03;
+  const double C3 =  2.48015872894767294178e-05;
+  const double C4 = -2.75573143513906633035e-07;
+  const double C5 =  2.08757232129817482790e-09;
+  const double C6 = -1.13596475577881948265e-11;
+  const double z = r * r;
+  const double p = z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+  const double hz = 0.5 * z;
+  const double w = 1.0 - hz;
+  return w + (((1.0 - w) - hz) + p);
+}
+
+// Pick a or b according to bit 0 of q, then flip the sign if bit 1 of s is set
+VK_INLINE double vk_quadrant(double a, double b, uint64_t q, uint64_t s)
+{
+  const uint64_t mask = 0 - (q & 1);
+  const uint64_t res = (vk_bits(b) & mask) | (vk_bits(a) & ~mask);
+  return vk_double(res ^ ((s & 2) << 62));
+}
+
+VK_INLINE double vk_sin(double x)
+{
+  double r;
+  const uint64_t q = vk_reduce(x, &r);
+  return vk_quadrant(vk_sin_poly(r), vk_cos_poly(r), q, q);
+}
+
+VK_INLINE double vk_cos(double x)
+{
+  double r;
+  const uint64_t q = vk_reduce(x, &r);
+  return vk_quadrant(vk_cos_poly(r), vk_sin_poly(r), q, q + 1);
+}
+
+VK_INLINE double vk_tan(double x)
+{
+  double r;
+  const uint64_t q = vk_reduce(x, &r);
+  const double s = vk_sin_poly(r);
+  const double c = vk_cos_poly(r);
+  return vk_quadrant(s / c, c / s, q, q << 1);
+}
+
+VK_INLINE double vk_atan2(double y, double x)
+{
+  // Cephes' atan.c rational approximation, on the octant given by |y| and |x|
+  const double P0 = -8.750608600031904122785e-01;
+  const double P1 = -1.615753718733365076637e+01;
+  const double P2 = -7.500855792314704667340e+01;
+  const double P3 = -1.228866684490136173410e+02;
+  const double P4 = -6.485021904942025371773e+01;
+  const double Q0 =  2.485846490142306297962e+01;
+  const double Q1 =  1.650270098316988542046e+02;
+  const double Q2 =  4.328810604912902668951e+02;
+  const double Q3 =  4.853903996359136964868e+02;
+  const double Q4 =  1.945506571482613964425e+02;
+  const double PIO4 = 7.85398163397448309616e-01;
+  const double PIO2 = 1.57079632679489661923e+00;
+  const double PI   = 3.14159265358979323846e+00;
+  const double MOREBITS = 6.123233995736765886130e-17; // pi/2 - PIO2
+  const double ax = fabs(x), ay = fabs(y);
+  const bool   swap = (ay > ax);
+  const double num = swap ? ax : ay;
+  const double den = swap ? ay : ax;
+  double t = num / ((den == 0.0) ? 1.0 : den);
+  const bool   mid = (t > 0.66);
+  t = mid ? (t - 1.0) / (t + 1.0) : t;
+  const double z = t * t;
+  const double p = (((P0 * z + P1) * z + P2) * z + P3) * z + P4;
+  const double q = ((((z + Q0) * z + Q1) * z + Q2) * z + Q3) * z + Q4;
+  double a = t + t * z * p / q;
+  a = mid ? (PIO4 + 0.5 * MOREBITS) + a : a;
+  a = swap ? (PIO2 + MOREBITS) - a : a;
+  a = (copysign(1.0, x) < 0.0) ? (PI + 2.0 * MOREBITS) - a : a;
+  return copysign(a, y);
+}
+
+VK_INLINE bool vk_any_above(const double *t, size_t n, double max)
+{
+  bool any = false;
+  for (size_t i = 0; i < n; i++) any |= (fabs(t[i]) > max);
+  return any;
+}
+
+// Apply an element-wise operator to t, with either vector operand x or scalar s
+// (s is the first operand if reversed)
+VK_INLINE void ew_kernel_body(Opcode op, double *t, const double *x, double s, bool reversed, size_t n)
+{
+  switch (op) {
+  case OP_ABS:   for (size_t i = 0; i < n; i++) t[i] = fabs(t[i]); break;
+  case OP_EXP:   for (size_t i = 0; i < n; i++) t[i] = vk_exp(t[i]); break;
+  case OP_LOG:   for (size_t i = 0; i < n; i++) t[i] = vk_log(t[i]); break;
+  case OP_FLOOR: for (size_t i = 0; i < n; i++) t[i] = floor(t[i]); break;
+  case OP_ROUND: for (size_t i = 0; i < n; i++) t[i] = round(t[i]); break;
+  case OP_SQ:    for (size_t i = 0; i < n; i++) t[i] *= t[i]; break;
+  case OP_SQRT:  for (size_t i = 0; i < n; i++) t[i] = sqrt(t[i]); break;
+  case OP_COS:
+    if (vk_any_above(t, n, VK_TRIG_MAX))
+      for (size_t i = 0; i < n; i++) t[i] = (fabs(t[i]) > VK_TRIG_MAX) ? cos(t[i]) : vk_cos(t[i]);
+    else
+      for (size_t i = 0; i < n; i++) t[i] = vk_cos(t[i]);
+    break;
+  case OP_SIN:
+    if (vk_any_above(t, n, VK_TRIG_MAX))
+      for (size_t i = 0; i < n; i++) t[i] = (fabs(t[i]) > VK_TRIG_MAX) ? sin(t[i]) : vk_sin(t[i]);
+    else
+      for (size_t i = 0; i < n; i++) t[i] = vk_sin(t[i]);
+    break;
+  case OP_TAN:
+    if (vk_any_above(t, n, VK_TRIG_MAX))
+      for (size_t i = 0; i < n; i++) t[i] = (fabs(t[i]) > VK_TRIG_MAX) ? tan(t[i]) : vk_tan(t[i]);
+    else
+      for (size_t i = 0; i < n; i++) t[i] = vk_tan(t[i]);
+    break;
+  case OP_ADD:
+    if (x) for (size_t i = 0; i < n; i++) t[i] += x[i];
+    else   for (size_t i = 0; i < n; i++) t[i] += s;
+    break;
+  case OP_MULT:
+    if (x) for (size_t i = 0; i < n; i++) t[i] *= x[i];
+    else   for (size_t i = 0; i < n; i++) t[i] *= s;
+    break;
+  case OP_SUB:
+    if (x)             for (size_t i = 0; i < n; i++) t[i] -= x[i];
+    else if (reversed) for (size_t i = 0; i < n; i++) t[i] = s - t[i];
+    else               for (size_t i = 0; i < n; i++) t[i] -= s;
+    break;
+  case OP_DIV:
+    if (x)             for (size_t i = 0; i < n; i++) t[i] /= x[i];
+    else if (reversed) for (size_t i = 0; i < n; i++) t[i] = s / t[i];
+    else               for (size_t i = 0; i < n; i++) t[i] /= s;
+    break;
+  case OP_ATAN2:
+    if (!x) {
+      for (size_t i = 0; i < n; i++) t[i] = atan2(t[i], s);
+    } else if (vk_any_above(t, n, DBL_MAX) || vk_any_above(x, n, DBL_MAX)) {
+      for (size_t i = 0; i < n; i++) t[i] = atan2(t[i], x[i]);
+    } else {
+      for (size_t i = 0; i < n; i++) t[i] = vk_atan2(t[i], x[i]);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+typedef void (*EwKernel)(Opcode op, double *t, const double *x, double s, bool reversed, size_t n);
+
+static void ew_kernel_generic(Opcode op, double *t, const double *x, double s, bool reversed, size_t n)
+{
+  ew_kernel_body(op, t, x, s, reversed, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void ew_kernel_avx2(Opcode op, double *t, const double *x, double s, bool reversed, size_t n)
+{
+  ew_kernel_body(op, t, x, s, reversed, n);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void ew_kernel_avx512(Opcode op, double *t, const double *x, double s, bool reversed, size_t n)
+{
+  ew_kernel_body(op, t, x, s, reversed, n);
+}
+#endif
+
+// Reductions of a chunk of n doubles (see fused_task): the sum of x (OP_SUM),
+// of x y (OP_DOT) or of (x - s)^2 (OP_SQ), or the min or max of s and x
+// (OP_MIN OP_MAX; NaNs in x are skipped, as in a scalar loop). The loops keep
+// 16 accumulators, so that the additions do not wait for each other; they are
+// summed pairwise in a fixed order, so that results do not depend on the
+// instruction set.
+typedef double ReduceVec __attribute__((vector_size(128)));
+static const size_t REDUCE_LANES = sizeof(ReduceVec) / sizeof(double);
+
+VK_INLINE double reduce_kernel_body(Opcode op, const double *x, const double *y, double s, size_t n)
+{
+  const size_t nv = n - n % REDUCE_LANES;
+  double       r;
+  if (op == OP_MIN || op == OP_MAX) {
+    // Plain arrays: the selects of a ReduceVec would be split into scalars
+    double lanes[REDUCE_LANES];
+    for (size_t k = 0; k < REDUCE_LANES; k++) lanes[k] = s;
+    for (size_t i = 0; i < nv; i += REDUCE_LANES) {
+      if (op == OP_MIN) {
+        for (size_t k = 0; k < REDUCE_LANES; k++) lanes[k] = (x[i+k] < lanes[k]) ? x[i+k] : lanes[k];
+      } else {
+        for (size_t k = 0; k < REDUCE_LANES; k++) lanes[k] = (x[i+k] > lanes[k]) ? x[i+k] : lanes[k];
+      }
+    }
+    r = s;
+    for (size_t k = 0; k < REDUCE_LANES; k++) {
+      if (op == OP_MIN ? lanes[k] < r : lanes[k] > r) r = lanes[k];
+    }
+    for (size_t i = nv; i < n; i++) {
+      if (op == OP_MIN ? x[i] < r : x[i] > r) r = x[i];
+    }
+    return r;
+  }
+  ReduceVec acc, v, w, c;
+  for (size_t k = 0; k < REDUCE_LANES; k++) {
+    acc[k] = 0.0;
+    c[k] = s;
+  }
+  for (size_t i = 0; i < nv; i += REDUCE_LANES) {
+    memcpy(&v, x + i, sizeof(v));
+    switch (op) {
+    case OP_SUM: acc += v; break;
+    case OP_DOT: memcpy(&w, y + i, sizeof(w)); acc += v * w; break;
+    default:     v -= c; acc += v * v; break;
+    }
+  }
+  for (size_t width = REDUCE_LANES / 2; width > 0; width /= 2) {
+    for (size_t k = 0; k < width; k++) acc[k] += acc[k + width];
+  }
+  r = acc[0];
+  switch (op) {
+  case OP_SUM: for (size_t i = nv; i < n; i++) r += x[i]; break;
+  case OP_DOT: for (size_t i = nv; i < n; i++) r += x[i] * y[i]; break;
+  default:     for (size_t i = nv; i < n; i++) r += (x[i] - s) * (x[i] - s); break;
+  }
+  return r;
+}
+
+typedef double (*ReduceKernel)(Opcode op, const double *x, const double *y, double s, size_t n);
+
+static double reduce_kernel_generic(Opcode op, const double *x, const double *y, double s, size_t n)
+{
+  return reduce_kernel_body(op, x, y, s, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static double reduce_kernel_avx2(Opcode op, const double *x, const double *y, double s, size_t n)
+{
+  return reduce_kernel_body(op, x, y, s, n);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static double reduce_kernel_avx512(Opcode op, const double *x, const double *y, double s, size_t n)
+{
+  return reduce_kernel_body(op, x, y, s, n);
+}
+#endif
+
+// The micro-kernel holds its GEMM_MR x GEMM_NR block of C in vector registers
+// of type V: 2, 4 or 8 doubles, depending on the instruction set. Vectors are
+// loaded and stored with memcpy, since C and the packed panels are not aligned
+typedef double GemmVec2 __attribute__((vector_size(16)));
+typedef double GemmVec4 __attribute__((vector_size(32)));
+typedef double GemmVec8 __attribute__((vector_size(64)));
+
+template <typename V>
+VK_INLINE void gemm_kernel_body(size_t kc, const double *a, const double *b, double *c, size_t ldc,
+                                bool accumulate)
+{
+  const size_t W = sizeof(V) / sizeof(double);
+  const size_t NV = GEMM_NR / W;
+  V acc[GEMM_MR][NV];
+#pragma GCC unroll 16
+  for (size_t r = 0; r < GEMM_MR; r++) {
+#pragma GCC unroll 16
+    for (size_t v = 0; v < NV; v++) {
+      acc[r][v] = V();
+      if (accumulate) memcpy(&acc[r][v], c + r * ldc + v * W, sizeof(V));
+    }
+  }
+  for (size_t k = 0; k < kc; k++) {
+    V bk[NV];
+#pragma GCC unroll 16
+    for (size_t v = 0; v < NV; v++) memcpy(&bk[v], b + k * GEMM_NR + v * W, sizeof(V));
+#pragma GCC unroll 16
+    for (size_t r = 0; r < GEMM_MR; r++) {
+      const double ar = a[k * GEMM_MR + r];
+#pragma GCC unroll 16
+      for (size_t v = 0; v < NV; v++) acc[r][v] += ar * bk[v];
+    }
+  }
+#pragma GCC unroll 16
+  for (size_t r = 0; r < GEMM_MR; r++) {
+#pragma GCC unroll 16
+    for (size_t v = 0; v < NV; v++) memcpy(c + r * ldc + v * W, &acc[r][v], sizeof(V));
+  }
+}
+
+static void gemm_kernel_generic(size_t kc, const double *a, const double *b, double *c, size_t ldc,
+                                bool accumulate)
+{
+  gemm_kernel_body<GemmVec2>(kc, a, b, c, ldc, accumulate);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2(size_t kc, const double *a, const double *b, double *c, size_t ldc,
+                             bool accumulate)
+{
+  gemm_kernel_body<GemmVec4>(kc, a, b, c, ldc, accumulate);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void gemm_kernel_avx512(size_t kc, const double *a, const double *b, double *c, size_t ldc,
+                               bool accumulate)
+{
+  gemm_kernel_body<GemmVec8>(kc, a, b, c, ldc, accumulate);
+}
+#endif
+
+// Kernel of the 3-vector operators (see XyzJob). The points are loaded into
+// locals before anything is stored, and the sums of com3 are in point order
+VK_INLINE void xyz_kernel_body(Opcode op, double *__restrict t, const double *__restrict a,
+                               const double *__restrict b, bool broadcast, bool reversed, size_t n)
+{
+  switch (op) {
+  case OP_NORM3:
+    for (size_t i = 0; i < n; i++) {
+      const double x = a[3*i], y = a[3*i+1], z = a[3*i+2];
+      t[i] = sqrt(x * x + y * y + z * z);
+    }
+    break;
+  case OP_NORMALIZE3:
+    // Null vectors stay null
+    for (size_t i = 0; i < n; i++) {
+      const double x = a[3*i], y = a[3*i+1], z = a[3*i+2];
+      const double len = sqrt(x * x + y * y + z * z);
+      const double d = (len > 0.0) ? len : 1.0;
+      t[3*i] = x / d;
+      t[3*i+1] = y / d;
+      t[3*i+2] = z / d;
+    }
+    break;
+  case OP_DOT3:
+    if (broadcast) {
+      const double bx = b[0], by = b[1], bz = b[2];
+      for (size_t i = 0; i < n; i++) t[i] = a[3*i] * bx + a[3*i+1] * by + a[3*i+2] * bz;
+    } else {
+      for (size_t i = 0; i < n; i++) t[i] = a[3*i] * b[3*i] + a[3*i+1] * b[3*i+1] + a[3*i+2] * b[3*i+2];
+    }
+    break;
+  case OP_CROSS3:
+    if (broadcast) {
+      // b x a = a x (-b)
+      const double sign = reversed ? -1.0 : 1.0;
+      const double bx = sign * b[0], by = sign * b[1], bz = sign * b[2];
+      for (size_t i = 0; i < n; i++) {
+        const double x = a[3*i], y = a[3*i+1], z = a[3*i+2];
+        t[3*i] = y * bz - z * by;
+        t[3*i+1] = z * bx - x * bz;
+        t[3*i+2] = x * by - y * bx;
+      }
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        const double x = a[3*i], y = a[3*i+1], z = a[3*i+2];
+        const double bx = b[3*i], by = b[3*i+1], bz = b[3*i+2];
+        t[3*i] = y * bz - z * by;
+        t[3*i+1] = z * bx - x * bz;
+        t[3*i+2] = x * by - y * bx;
+      }
+    }
+    break;
+  case OP_COM3: {
+    double sx = 0.0, sy = 0.0, sz = 0.0, sw = 0.0;
+    if (broadcast) {
+      for (size_t i = 0; i < n; i++) {
+        sx += a[3*i];
+        sy += a[3*i+1];
+        sz += a[3*i+2];
+      }
+      sx *= b[0];
+      sy *= b[0];
+      sz *= b[0];
+      sw = b[0] * n;
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        sx += b[i] * a[3*i];
+        sy += b[i] * a[3*i+1];
+        sz += b[i] * a[3*i+2];
+        sw += b[i];
+      }
+    }
+    t[0] = sx;
+    t[1] = sy;
+    t[2] = sz;
+    t[3] = sw;
+    break;
+  }
+  case OP_TRANSFORM3: {
+    const double r00 = b[0], r01 = b[1], r02 = b[2];
+    const double r10 = b[3], r11 = b[4], r12 = b[5];
+    const double r20 = b[6], r21 = b[7], r22 = b[8];
+    const double dx = b[9], dy = b[10], dz = b[11];
+    for (size_t i = 0; i < n; i++) {
+      const double x = a[3*i], y = a[3*i+1], z = a[3*i+2];
+      t[3*i] = r00 * x + r01 * y + r02 * z + dx;
+      t[3*i+1] = r10 * x + r11 * y + r12 * z + dy;
+      t[3*i+2] = r20 * x + r21 * y + r22 * z + dz;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static void xyz_kernel_generic(Opcode op, double *t, const double *a, const double *b, bool broadcast,
+                               bool reversed, size_t n)
+{
+  xyz_kernel_body(op, t, a, b, broadcast, reversed, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void xyz_kernel_avx2(Opcode op, double *t, const double *a, const double *b, bool broadcast,
+                            bool reversed, size_t n)
+{
+  xyz_kernel_body(op, t, a, b, broadcast, reversed, n);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void xyz_kernel_avx512(Opcode op, double *t, const double *a, const double *b, bool broadcast,
+                              bool reversed, size_t n)
+{
+  xyz_kernel_body(op, t, a, b, broadcast, reversed, n);
+}
+#endif
+
+static EwKernel     ew_kernel = ew_kernel_generic;
+static ReduceKernel reduce_kernel = reduce_kernel_generic;
+static const char * ew_kernel_isa = "generic";
+
+// Pick the best kernel supported by the CPU, unless VECEXPR_ISA asks for a lower one
+static void select_kernels()
+{
+  const char *want = getenv("VECEXPR_ISA");
+  ew_kernel = ew_kernel_generic;
+  reduce_kernel = reduce_kernel_generic;
+  gemm_kernel = gemm_kernel_generic;
+  xyz_kernel = xyz_kernel_generic;
+#if defined(__x86_64__) || defined(__i386__)
+  ew_kernel_isa = "sse2";
+  if (want && !strcmp(want, "sse2")) return;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")
+      && !(want && !strcmp(want, "avx2"))) {
+    ew_kernel = ew_kernel_avx512;
+    reduce_kernel = reduce_kernel_avx512;
+    gemm_kernel = gemm_kernel_avx512;
+    xyz_kernel = xyz_kernel_avx512;
+    ew_kernel_isa = "avx512";
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    ew_kernel = ew_kernel_avx2;
+    reduce_kernel = reduce_kernel_avx2;
+    gemm_kernel = gemm_kernel_avx2;
+    xyz_kernel = xyz_kernel_avx2;
+    ew_kernel_isa = "avx2";
+  }
+#else
+  (void) want;
+#endif
+}
+
+// A step of the whole command: either an instruction, or a data argument to push
+struct Step {
+  const Instr *instr;
+  Tcl_Obj     *data;
+  bool         last_use;  // store or recall, see plan_registers
+};
+
+// Loop fusion
+// A run of element-wise operators is applied to the vector on top of the stack
+// in a single pass: the data are processed in chunks small enough to stay in L1
+// cache, and every operator of the run is applied to a chunk before moving on
+// to the next one. Binary operators are fused when their second operand is
+// pushed right before them (a data argument or a scalar constant), so that
+// operand is read straight from its Tcl_Obj and never copied onto the stack.
+// A reduction (sum mean min max dot) may end the run. f32 and i64 data are
+// converted to f64 a chunk at a time, so the operators always compute in
+// double precision, and f32 results are rounded once, when stored.
+
+static const size_t FUSE_CHUNK = 1024;
+
+static inline bool is_unary_ew(Opcode op)
+{
+  switch (op) {
+  case OP_ABS: case OP_COS: case OP_SIN: case OP_TAN: case OP_EXP: case OP_LOG:
+  case OP_FLOOR: case OP_ROUND: case OP_SQ: case OP_SQRT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static inline bool is_binary_ew(Opcode op)
+{
+  return op == OP_ADD || op == OP_SUB || op == OP_MULT || op == OP_DIV || op == OP_ATAN2;
+}
+
+static inline bool is_reduction(Opcode op)
+{
+  return op == OP_SUM || op == OP_MEAN || op == OP_MIN || op == OP_MAX || op == OP_STATS;
+}
+
+struct FusedOp {
+  Opcode        op;
+  const double *vec;      // vector operand, or NULL
+  VecType       type;     // of vec
+  size_t        offset;   // of the elements of vec used (a view)
+  size_t        stride;
+  double        scalar;   // scalar operand
+  bool          reversed; // scalar is the first operand (s - x, s / x)
+};
+
+// Apply f to t, with x the chunk of its vector operand (or NULL).
+// Returns an error message, or NULL
+static const char * apply_fused(const FusedOp &f, double *t, const double *x, size_t n)
+{
+  if (f.op == OP_LOG) {
+    bool nonpos = false;
+    for (size_t i = 0; i < n; i++) {if (t[i] <= 0.0) nonpos = true;}
+    if (nonpos) {
+      return "vecexpr: taking log of non-positive value";
+    }
+  }
+#ifdef DEBUG
+  if (f.op == OP_SQRT) {
+    for (size_t i = 0; i < n; i++) {
+      if (t[i] < 0.0) {
+        return "vecexpr: taking sqrt of negative value";
+      }
+    }
+  }
+#endif
+  if (f.op == OP_DIV) {
+    bool zero = (!x && f.scalar == 0.0 && !f.reversed);
+    for (size_t i = 0; x && i < n; i++) {if (x[i] == 0.0) zero = true;}
+    for (size_t i = 0; f.reversed && i < n; i++) {if (t[i] == 0.0) zero = true;}
+    if (zero) {
+      return "vecexpr: divide by zero in function div";
+    }
+  }
+  ew_kernel(f.op, t, x, f.scalar, f.reversed, n);
+  return NULL;
+}
+
+// Length of a pushed operand, or 0 if the step is not a push
+static size_t operand_length(const Step &step)
+{
+  if (step.data) {
+    int num = 0;
+    if (step.data->typePtr == &vector_type) return vector_length(*get_vector(step.data));
+    if (is_text(step.data) && (num = count_words(step.data->bytes, step.data->length))) return num;
+    if (Tcl_ListObjLength(NULL, step.data, &num) != TCL_OK) return 0;
+    return num;
+  }
+  if (step.instr->op == OP_SCALAR || step.instr->op == OP_PI) return 1;
+  return 0;
+}
+
+// Sums are compensated (Neumaier): the error of a sum of chunks, or of tasks,
+// does not grow with their number. Once the sum is infinite (or NaN) the
+// correction would be Inf - Inf, and it is left as it was, so that sum + comp
+// is the Inf of a plain sum
+static inline void add_compensated(double &sum, double &comp, double x)
+{
+  const double t = sum + x;
+  if (std::isfinite(t)) comp += (fabs(sum) >= fabs(x)) ? (sum - t) + x : (x - t) + sum;
+  sum = t;
+}
+
+// Statistics of some elements (stats): count, compensated sum, mean, sum of
+// squared deviations from the mean, min and max. Each chunk makes two passes
+// (for the mean, then the deviations), and chunks are merged with the
+// formulas of Chan et al., so that the variance stays accurate when the mean
+// is large compared with the spread.
+struct Moments {
+  double n, sum, comp, mean, m2, min, max;
+};
+
+static const Moments NO_MOMENTS = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+static Moments chunk_moments(const double *x, size_t n)
+{
+  Moments mo;
+  mo.n = n;
+  mo.sum = reduce_kernel(OP_SUM, x, NULL, 0.0, n);
+  mo.comp = 0.0;
+  mo.mean = mo.sum / n;
+  mo.m2 = reduce_kernel(OP_SQ, x, NULL, mo.mean, n);
+  mo.min = reduce_kernel(OP_MIN, x, NULL, x[0], n);
+  mo.max = reduce_kernel(OP_MAX, x, NULL, x[0], n);
+  return mo;
+}
+
+// Merge the moments b of elements that come after those of a into a
+static void merge_moments(Moments &a, const Moments &b)
+{
+  if (b.n == 0.0) return;
+  if (a.n == 0.0) {
+    a = b;
+    return;
+  }
+  const double n = a.n + b.n;
+  const double delta = b.mean - a.mean;
+  a.mean += delta * (b.n / n);
+  a.m2 += b.m2 + delta * delta * (a.n * b.n / n);
+  add_compensated(a.sum, a.comp, b.sum);
+  a.comp += b.comp;
+  if (b.min < a.min) a.min = b.min;
+  if (b.max > a.max) a.max = b.max;
+  a.n = n;
+}
+
+// Result of stats: count sum mean variance (of a sample) stddev min max
+static const size_t STATS_LENGTH = 7;
+
+static void stats_result(const Moments &mo, double *r)
+{
+  r[0] = mo.n;
+  r[1] = mo.sum + mo.comp;
+  r[2] = r[1] / mo.n;
+  r[3] = (mo.n > 1.0) ? mo.m2 / (mo.n - 1.0) : 0.0;
+  // Deviations from an infinite mean (infinite elements, or a sum that overflows)
+  if (!std::isfinite(r[1])) r[3] = NAN;
+  r[4] = sqrt(r[3]);
+  r[5] = mo.min;
+  r[6] = mo.max;
+}
+
+// Moments from a result of stats (see combine_partial)
+static Moments stats_moments(const double *r)
+{
+  Moments mo;
+  mo.n = r[0];
+  mo.sum = r[1];
+  mo.comp = 0.0;
+  mo.mean = r[2];
+  mo.m2 = r[3] * (r[0] - 1.0);
+  mo.min = r[5];
+  mo.max = r[6];
+  return mo;
+}
+
+// A fused chain, split into tasks of TASK_SIZE elements that may run on
+// several threads. Reductions are computed per task and combined in task
+// order, so results do not depend on the number of threads.
+struct FusedJob {
+  std::vector<FusedOp>       ops;
+  double *                   t;
+  VecType                    t_type;      // i64 only without ops
+  size_t                     t_offset;    // of a view
+  size_t                     t_stride;
+  double *                   out;         // results: t, or a new buffer if t is a view
+  size_t                     n;
+  Opcode                     reduction;   // OP_SCALAR if none
+  const double *             dot_vec;
+  VecType                    dot_type;
+  size_t                     dot_offset;
+  size_t                     dot_stride;
+  double                     dot_scalar;
+  std::vector<double>        partial;     // per task
+  std::vector<Moments>       moments;     // per task, for stats
+  std::vector<const char *>  error;       // per task
+};
+
+// Stack slot, as seen by check_steps
+struct ShapeSlot {
+  size_t length;  // 0 if unknown
+  bool   known;   // value is known
+  double value;   // of a one-element item
+};
+
+// Scratch space of a Machine, kept between calls so that they do not allocate
+struct MachineScratch {
+  std::vector<Step>                 steps;     // the whole command (obj_vecexpr)
+  std::vector<Program *>            progs;     // programs held while running
+  FusedJob                          fused;     // see run_fused
+  std::vector<const Step *>         operands;
+  std::vector<std::vector<double> > temps;
+  std::vector<const double *>       vecs;
+  std::vector<VecType>              vec_types;
+  std::vector<double>               scalars;
+  std::vector<ShapeSlot>            shapes;    // see check_steps
+  std::vector<std::pair<std::string, ShapeSlot> > reg_shapes;
+};
+
+// Return the temporaries of run_fused to the pool
+static void release_temps(Machine &m)
+{
+  std::vector<std::vector<double> > &temps = m.scratch->temps;
+  for (size_t t = 0; t < temps.size(); t++) m.buffers->give(temps[t]);
+  temps.clear();
+}
+
+static Machine * new_machine(BufferPool *buffers)
+{
+  Machine *m = new Machine;
+  m->pool = NULL;
+  m->threshold = 0;
+  m->buffers = buffers;
+  m->scratch = new MachineScratch;
+  m->stream = NULL;
+  m->profile = NULL;
+  m->var_writes = NULL;
+  m->cancel = NULL;
+  m->decimals = -1;
+  return m;
+}
+
+// Get an idle machine of the interpreter, or a new one (vecexpr may be
+// called recursively, e.g. from a variable trace)
+static Machine * acquire_machine(VecexprState *state)
+{
+  state->running++;
+  if (!state->machines.empty()) {
+    Machine *m = state->machines.back();
+    state->machines.pop_back();
+    return m;
+  }
+  return new_machine(&state->buffers);
+}
+
+// Return the stack, registers and temporaries of m to the pool
+static void reset_machine(Machine &m)
+{
+  clear_stack(m);
+  for (size_t r = 0; r < m.regs.size(); r++) release_shared(m, m.regs[r].item);
+  m.regs.clear();
+  release_temps(m);
+}
+
+// Return the buffers of m to the pool, and m to the idle machines
+static void release_machine(VecexprState *state, Machine *m)
+{
+  reset_machine(*m);
+  std::vector<Program *> &progs = m->scratch->progs;
+  for (size_t i = 0; i < progs.size(); i++) program_release(progs[i]);
+  progs.clear();
+  m->scratch->steps.clear();
+  state->machines.push_back(m);
+  state->running--;
+}
+
+static void delete_machine(Machine *m)
+{
+  for (size_t i = 0; i < m->free_shared.size(); i++) delete m->free_shared[i];
+  delete m->scratch;
+  delete m;
+}
+
+// Holds a machine while a command runs
+struct MachineHolder {
+  VecexprState *state;
+  Machine *     m;
+  explicit MachineHolder(VecexprState *s) : state(s), m(acquire_machine(s)) {}
+  ~MachineHolder() { release_machine(state, m); }
+};
+
+// Chunk of n elements of a typed vector, every stride-th from offset, as
+// doubles (in buf if converted or gathered from a view)
+static inline const double * chunk_doubles(const double *vec, VecType type, size_t offset, size_t stride,
+                                           size_t n, double *buf)
+{
+  if (type == VEC_F64 && stride == 1) return vec + offset;
+  to_doubles(buf, vec, type, offset, stride, n);
+  return buf;
+}
+
+static void fused_task(void *ctx, size_t task, int)
+{
+  FusedJob &job = *(FusedJob *) ctx;
+  const size_t begin = task * TASK_SIZE;
+  const size_t end = (job.n - begin < TASK_SIZE) ? job.n : begin + TASK_SIZE;
+  double acc = 0.0, comp = 0.0;
+  Moments moments = NO_MOMENTS;
+  double tbuf[FUSE_CHUNK], xbuf[FUSE_CHUNK];  // converted chunks of f32 and i64 data, and of views
+
+  for (size_t start = begin; start < end; start += FUSE_CHUNK) {
+    const size_t len = (end - start < FUSE_CHUNK) ? end - start : FUSE_CHUNK;
+    double *chunk = tbuf;
+    if (job.out == job.t) {
+      chunk = (double *) chunk_doubles(job.t, job.t_type, job.t_offset + start * job.t_stride, job.t_stride, len, tbuf);
+    } else {
+      // Never write into the buffer of a view
+      to_doubles(tbuf, job.t, job.t_type, job.t_offset + start * job.t_stride, job.t_stride, len);
+    }
+    for (size_t o = 0; o < job.ops.size(); o++) {
+      const FusedOp &f = job.ops[o];
+      const double *x = f.vec ? chunk_doubles(f.vec, f.type, f.offset + start * f.stride, f.stride, len, xbuf) : NULL;
+      const char *error = apply_fused(f, chunk, x, len);
+      if (error) {
+        job.error[task] = error;
+        return;
+      }
+    }
+    if (chunk == tbuf && !job.ops.empty()) {
+      if (job.t_type == VEC_F32) {
+        f32_alias *t = (f32_alias *) job.out + start;
+        for (size_t i = 0; i < len; i++) t[i] = chunk[i];
+      } else {
+        memcpy(job.out + start, chunk, len * sizeof(double));
+      }
+    }
+    const double *dot = job.dot_vec
+      ? chunk_doubles(job.dot_vec, job.dot_type, job.dot_offset + start * job.dot_stride, job.dot_stride, len, xbuf)
+      : &job.dot_scalar;  // of a single element
+    switch (job.reduction) {
+    case OP_SUM: case OP_MEAN:
+      add_compensated(acc, comp, reduce_kernel(OP_SUM, chunk, NULL, 0.0, len));
+      break;
+    case OP_DOT:
+      add_compensated(acc, comp, reduce_kernel(OP_DOT, chunk, dot, 0.0, len));
+      break;
+    case OP_MIN: case OP_MAX:
+      acc = reduce_kernel(job.reduction, chunk, NULL, (start == begin) ? chunk[0] : acc, len);
+      break;
+    case OP_STATS:
+      merge_moments(moments, chunk_moments(chunk, len));
+      break;
+    default:
+      break;
+    }
+  }
+  job.partial[task] = acc + comp;
+  if (job.reduction == OP_STATS) job.moments[task] = moments;
+}
+
+// Try to run a fused chain of operators starting at steps[k].
+// Returns the number of steps consumed (0 if there is nothing to fuse), or -1 on error
+static int run_fused(Tcl_Interp *interp, const std::vector<Step> &steps, size_t k, Machine &m)
+{
+  std::vector<std::vector<double> > &stack = m.stack;
+  FusedJob &job = m.scratch->fused;
+  std::vector<const Step *> &operands = m.scratch->operands; // pushed operands, parallel to ops (NULL if none)
+  FusedOp f;
+  size_t  j = k;
+  bool    swap_head = false;  // head result is the top item rather than the one below
+  bool    pop_head = false;   // head consumed the top of the stack
+
+  if (!steps[k].instr) return 0;
+  const Opcode head = steps[k].instr->op;
+  job.ops.clear();
+  operands.clear();
+  f.vec = NULL;
+  f.type = VEC_F64;
+  f.offset = 0;
+  f.stride = 1;
+  f.scalar = 0.0;
+  f.reversed = false;
+  job.reduction = OP_SCALAR;
+  job.dot_vec = NULL;
+  job.dot_type = VEC_F64;
+  job.dot_offset = 0;
+  job.dot_stride = 1;
+  job.dot_scalar = 0.0;
+
+  if (is_unary_ew(head)) {
+    f.op = head;
+    job.ops.push_back(f);
+    operands.push_back(NULL);
+  } else if (is_reduction(head)) {
+    job.reduction = head;
+  } else if (is_binary_ew(head) || head == OP_DOT) {
+    const ItemType &b_type = m.types.back();
+    const size_t    p_len = stack_length(m, stack.size()-2);
+    const size_t    b_len = stack_length(m, stack.size()-1);
+    f.op = head;
+    if (p_len == b_len) {
+      f.vec = item_data(m, stack.size()-1);
+      f.type = b_type.type;
+      f.offset = b_type.offset;
+      f.stride = b_type.stride ? b_type.stride : 1;
+    } else if (head == OP_ATAN2 || head == OP_DOT) {
+      return 0;
+    } else if (b_len == 1) {
+      f.scalar = item_elem(m, stack.size()-1, 0);
+    } else if (p_len == 1) {
+      f.scalar = item_elem(m, stack.size()-2, 0);
+      f.reversed = true;
+      swap_head = true;
+    } else {
+      return 0; // matrix-vector operation
+    }
+    if (head == OP_DOT) {
+      job.reduction = OP_DOT;
+      job.dot_vec = (b_len > 1) ? f.vec : NULL;
+      job.dot_type = f.type;
+      job.dot_offset = f.offset;
+      job.dot_stride = f.stride;
+      job.dot_scalar = item_elem(m, stack.size()-1, 0);
+    } else {
+      job.ops.push_back(f);
+      operands.push_back(NULL);
+    }
+    pop_head = true;
+  } else {
+    return 0;
+  }
+  // The chain runs on the target, whose result replaces the head operands
+  const size_t target = stack.size() - ((pop_head && !swap_head) ? 2 : 1);
+  const size_t n = stack_length(m, target);
+  j++;
+
+  // Extend the chain as far as possible
+  while (job.reduction == OP_SCALAR && j < steps.size()) {
+    const Step &s = steps[j];
+    if (s.instr && is_unary_ew(s.instr->op)) {
+      f.op = s.instr->op; f.vec = NULL; f.type = VEC_F64; f.offset = 0; f.stride = 1; f.scalar = 0.0; f.reversed = false;
+      job.ops.push_back(f);
+      operands.push_back(NULL);
+      j++;
+      continue;
+    }
+    if (s.instr && is_reduction(s.instr->op)) {
+      job.reduction = s.instr->op;
+      j++;
+      break;
+    }
+    if (j + 1 < steps.size() && steps[j+1].instr
+        && (is_binary_ew(steps[j+1].instr->op) || steps[j+1].instr->op == OP_DOT)) {
+      const Opcode op = steps[j+1].instr->op;
+      const size_t len = operand_length(s);
+      if (len == 0 || !(len == n || (len == 1 && op != OP_ATAN2 && op != OP_DOT))) break;
+      if (op == OP_DOT) {
+        job.reduction = OP_DOT;
+        operands.push_back(&s);
+        j += 2;
+        break;
+      }
+      f.op = op; f.vec = NULL; f.type = VEC_F64; f.offset = 0; f.stride = 1; f.scalar = 0.0; f.reversed = false;
+      job.ops.push_back(f);
+      operands.push_back(&s);
+      j += 2;
+      continue;
+    }
+    break;
+  }
+
+  // Resolve pushed operands: vector objects, plain numbers (parsed into the
+  // object's vector rep) and constants are used in place, other lists are
+  // parsed once into temporaries
+  std::vector<std::vector<double> > &temps = m.scratch->temps;
+  std::vector<const double *> &vecs = m.scratch->vecs;
+  std::vector<VecType> &vec_types = m.scratch->vec_types;
+  std::vector<double> &scalars = m.scratch->scalars;
+  release_temps(m);
+  vecs.assign(operands.size(), (const double *) NULL);
+  vec_types.assign(operands.size(), VEC_F64);
+  scalars.assign(operands.size(), 0.0);
+  temps.reserve(operands.size());  // the temporaries stay in place
+  for (size_t o = 0; o < operands.size(); o++) {
+    const Step *s = operands[o];
+    const VectorRep *rep;
+    if (!s) continue;
+    if (!s->data) {
+      scalars[o] = (s->instr->op == OP_PI) ? M_PI : s->instr->value;
+    } else if ((rep = data_vector(s->data)) != NULL) {
+      const VectorRep &v = *rep;
+      if (vector_length(v) == 1) scalars[o] = get_elem(v.data->buf.data(), v.type.type, 0);
+      else                       vecs[o] = v.data->buf.data();
+      vec_types[o] = v.type.type;
+    } else {
+      ItemType type;
+      temps.push_back(std::vector<double>());
+      if (load_data(interp, s->data, m, temps.back(), type) != TCL_OK) return -1;
+      if (temps.back().size() == 1) scalars[o] = temps.back()[0];
+      else                          vecs[o] = temps.back().data();
+    }
+  }
+  for (size_t o = 0; o < job.ops.size(); o++) {
+    if (!operands[o]) continue;
+    job.ops[o].vec = vecs[o];
+    job.ops[o].type = vec_types[o];
+    job.ops[o].scalar = scalars[o];
+  }
+  if (operands.size() > job.ops.size()) {
+    // dot with a pushed operand
+    job.dot_vec = vecs.back();
+    job.dot_type = vec_types.back();
+    job.dot_scalar = scalars.back();
+  }
+
+  // The target keeps its type if the vector operands have the same one
+  // (scalars do not count) and if it can hold the results
+  bool widen = (m.types[target].type == VEC_I64 && !job.ops.empty());
+  for (size_t o = 0; o < job.ops.size(); o++) {
+    if (job.ops[o].vec && job.ops[o].type != m.types[target].type) widen = true;
+  }
+  if (widen) convert_item(NULL, m, target, VEC_F64);
+
+  // Run the chain; a view is read in place, and its results go to a new buffer
+  const ItemType &t = m.types[target];
+  std::vector<double> out;
+  if (!job.ops.empty()) reclaim(m, target);  // no copy if nothing else uses the buffer
+  job.t = (double *) item_data(m, target);
+  job.t_type = t.type;
+  job.t_offset = t.offset;
+  job.t_stride = t.stride ? t.stride : 1;
+  job.out = job.t;
+  if (t.stride && !job.ops.empty()) {
+    m.buffers->take(out, buffer_words(t.type, n));
+    job.out = out.data();
+  }
+  job.n = n;
+  const size_t ntasks = (n + TASK_SIZE - 1) / TASK_SIZE;
+  job.partial.resize(ntasks);
+  if (job.reduction == OP_STATS) job.moments.resize(ntasks);
+  job.error.assign(ntasks, (const char *) NULL);
+  run_tasks(m, n, ntasks, fused_task, &job);
+  for (size_t task = 0; task < ntasks; task++) {
+    if (job.error[task]) {
+      m.buffers->give(out);
+      Tcl_SetResult(interp, (char *) job.error[task], TCL_STATIC);
+      return -1;
+    }
+  }
+  if (job.out != job.t) {
+    stack[target].swap(out);
+    m.buffers->give(out);
+    release_shared(m, m.types[target]);
+    m.types[target] = item_type(m.types[target].type, n);
+  }
+
+  double acc = job.partial[0], comp = 0.0;
+  for (size_t task = 1; task < ntasks; task++) {
+    const double p = job.partial[task];
+    switch (job.reduction) {
+    case OP_MIN: if (p < acc) acc = p; break;
+    case OP_MAX: if (p > acc) acc = p; break;
+    case OP_STATS: merge_moments(job.moments[0], job.moments[task]); break;
+    default:     add_compensated(acc, comp, p); break;
+    }
+  }
+  acc += comp;
+
+  release_temps(m);
+  if (pop_head) {
+    if (swap_head) swap_items(m, stack.size()-1, stack.size()-2);
+    pop(m);
+  }
+  if (job.reduction == OP_MEAN) acc /= n;
+  if (job.reduction == OP_DOT) {
+    release_shared(m, m.types.back());
+    stack.back().resize(1);
+    stack.back()[0] = acc;
+    m.types.back() = F64_ITEM;
+  } else if (job.reduction == OP_STATS) {
+    stats_result(job.moments[0], push_new(m, STATS_LENGTH).data());
+  } else if (job.reduction != OP_SCALAR) {
+    push_new(m, 1)[0] = acc;
+  }
+  return j - k;
+}
+
+// Integer kernels
+// Operators that are exact on integers keep i64 vectors in i64: abs sq floor
+// round, add sub mult with an i64 vector or i64 scalar as the other operand,
+// and sum min max dot. Overflows wrap around. Other operators, and operands of
+// other types (even f64 scalars with integer values: the type of the result
+// does not depend on the data), convert i64 vectors to f64.
+
+// Is item i an i64 scalar?
+static bool int_scalar(const Machine &m, size_t i, int64_t &value)
+{
+  if (stack_length(m, i) != 1 || m.types[i].type != VEC_I64) return false;
+  value = ((const i64_alias *) item_data(m, i))[m.types[i].offset];
+  return true;
+}
+
+// Can op run on the stack with integer kernels?
+static bool int_kernel(const Machine &m, Opcode op)
+{
+  const size_t size = m.stack.size();
+  int64_t scalar;
+  if (size == 0) return false;
+  const bool back = (m.types[size-1].type == VEC_I64);
+  switch (op) {
+  case OP_ABS: case OP_SQ: case OP_FLOOR: case OP_ROUND:
+  case OP_SUM: case OP_MIN: case OP_MAX:
+    return back;
+  case OP_ADD: case OP_SUB: case OP_MULT: case OP_DOT: {
+    if (size < 2) return false;
+    const bool prev = (m.types[size-2].type == VEC_I64);
+    if (back && prev && stack_length(m, size-1) == stack_length(m, size-2)) return true;
+    if (op == OP_DOT) return false;
+    return (prev && int_scalar(m, size-1, scalar)) || (back && int_scalar(m, size-2, scalar));
+  }
+  default:
+    return false;
+  }
+}
+
+static inline int64_t wrap_op(Opcode op, int64_t a, int64_t b)
+{
+  switch (op) {
+  case OP_ADD: return (int64_t) ((uint64_t) a + (uint64_t) b);
+  case OP_SUB: return (int64_t) ((uint64_t) a - (uint64_t) b);
+  default:     return (int64_t) ((uint64_t) a * (uint64_t) b);
+  }
+}
+
+// Run op, for which int_kernel is true
+static void run_int(Machine &m, Opcode op)
+{
+  std::vector<std::vector<double> > &stack = m.stack;
+  const size_t back = stack.size() - 1;
+  i64_alias *   x = (i64_alias *) stack[back].data();
+  const size_t  n = stack_length(m, back);
+
+  switch (op) {
+  case OP_ABS:
+    for (size_t i = 0; i < n; i++) if (x[i] < 0) x[i] = wrap_op(OP_SUB, 0, x[i]);
+    break;
+  case OP_SQ:
+    for (size_t i = 0; i < n; i++) x[i] = wrap_op(OP_MULT, x[i], x[i]);
+    break;
+  case OP_FLOOR: case OP_ROUND:
+    break;
+  case OP_SUM: case OP_MIN: case OP_MAX: {
+    int64_t acc = x[0];
+    for (size_t i = 1; i < n; i++) {
+      if (op == OP_SUM) acc = wrap_op(OP_ADD, acc, x[i]);
+      else if (op == OP_MIN ? x[i] < acc : x[i] > acc) acc = x[i];
+    }
+    ((i64_alias *) push_typed(m, 1, VEC_I64).data())[0] = acc;
+    break;
+  }
+  case OP_DOT: {
+    const i64_alias *y = (const i64_alias *) stack[back-1].data();
+    int64_t acc = 0;
+    for (size_t i = 0; i < n; i++) acc = wrap_op(OP_ADD, acc, wrap_op(OP_MULT, x[i], y[i]));
+    pop(m);
+    stack.back().resize(1);
+    ((i64_alias *) stack.back().data())[0] = acc;
+    m.types.back() = item_type(VEC_I64, 1);
+    break;
+  }
+  default: {
+    // add sub mult
+    const size_t prev = back - 1;
+    const size_t n_prev = stack_length(m, prev);
+    int64_t scalar;
+    i64_alias *y = (i64_alias *) stack[prev].data();
+    if (m.types[prev].type == VEC_I64 && n == n_prev && m.types[back].type == VEC_I64) {
+      for (size_t i = 0; i < n; i++) y[i] = wrap_op(op, y[i], x[i]);
+    } else if (m.types[prev].type == VEC_I64 && int_scalar(m, back, scalar)) {
+      for (size_t i = 0; i < n_prev; i++) y[i] = wrap_op(op, y[i], scalar);
+    } else {
+      int_scalar(m, prev, scalar);
+      for (size_t i = 0; i < n; i++) x[i] = wrap_op(op, scalar, x[i]);
+      swap_items(m, back, prev);
+    }
+    pop(m);
+    break;
+  }
+  }
+}
+
+// Length of the longest of the top arity items of the stack
+static size_t top_elements(const Machine &m, int arity)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < (size_t) arity && i < m.stack.size(); i++) {
+    const size_t len = stack_length(m, m.stack.size() - 1 - i);
+    if (len > n) n = len;
+  }
+  return n;
+}
+
+// Record the count steps from k, run as one fused chain
+static void profile_chain(Profile &profile, const std::vector<Step> &steps, size_t k, int count,
+                          size_t elements, Tcl_WideInt start)
+{
+  std::string name;
+  Opcode      op = OP_SCALAR;
+  int         ops = 0;
+  for (size_t j = k; j < k + count; j++) {
+    if (!steps[j].instr || steps[j].instr->op == OP_SCALAR || steps[j].instr->op == OP_PI) continue;
+    op = steps[j].instr->op;
+    if (ops++) name += ' ';
+    name += op_name(op);
+  }
+  if (ops == 1) {
+    profile_add(profile.ops[op], elements, start);
+  } else {
+    ProfileEntry &entry = profile.chains[name];  // value-initialized if new
+    profile_add(entry, elements, start);
+  }
+}
+
+// Last recall of a register (see plan_registers): its item moves to the
+// stack. Returns false if the register is empty
+static bool take_register(Machine &m, const Instr &instr)
+{
+  for (size_t r = 0; r < m.regs.size(); r++) {
+    if (m.regs[r].name != instr.name) continue;
+    m.stack.push_back(std::vector<double>());
+    m.types.push_back(m.regs[r].item);
+    m.regs.erase(m.regs.begin() + r);
+    return true;
+  }
+  return false;
+}
+
+// Run steps on the stack of m, fusing element-wise operators
+static int run_steps(Tcl_Interp *interp, const std::vector<Step> &steps, Machine &m)
+{
+  for (size_t k = 0; k < steps.size(); ) {
+    if (m.cancel && *m.cancel) {
+      Tcl_SetResult(interp, (char *) "vecexpr: cancelled", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    const Tcl_WideInt start = m.profile ? profile_clock() : 0;
+    // A list (argument or variable) converted to i64 at once is read as integers
+    const bool ints = (k + 1 < steps.size() && steps[k+1].instr && steps[k+1].instr->op == OP_I64);
+    Tcl_Obj *data = steps[k].data;
+    if (ints && !data && steps[k].instr->op == OP_PUSH_VAR && !m.var_writes) {
+      data = Tcl_GetVar2Ex(interp, steps[k].instr->name.c_str(), NULL, 0);
+      if (!data) {
+        Tcl_SetResult(interp, (char *) "vecexpr: tried to push unknown Tcl variable", TCL_STATIC);
+        return TCL_ERROR;
+      }
+    }
+    if (data) {
+      const bool read_ints = ints && reads_ints(data);
+      if (read_ints) {
+        m.stack.push_back(std::vector<double>());
+        m.types.push_back(F64_ITEM);
+      }
+      if ((read_ints ? load_ints(interp, data, m, m.stack.back(), m.types.back())
+           : push_data(interp, data, m)) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      if (m.profile) profile_add(m.profile->phases[PHASE_INPUT], stack_length(m, m.stack.size() - 1), start);
+      k += read_ints ? 2 : 1;
+      continue;
+    }
+    const Opcode op = steps[k].instr->op;
+    size_t elements = m.profile ? top_elements(m, op_arity(op)) : 0;
+    int fused;
+    if (int_kernel(m, op)) {
+      materialize_top(m, op_arity(op));
+      run_int(m, op);
+      fused = 1;
+    } else {
+      fused = run_fused(interp, steps, k, m);
+    }
+    if (fused < 0) {
+      return TCL_ERROR;
+    }
+    if (fused > 0) {
+      if (m.profile) profile_chain(*m.profile, steps, k, fused, elements, start);
+      k += fused;
+      continue;
+    }
+    const bool moved = steps[k].last_use && (op == OP_STORE || take_register(m, *steps[k].instr));
+    if (!moved && run_instr(interp, *steps[k].instr, m) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (m.profile) {
+      // Operators without operands count the elements they push
+      if (elements == 0 && !m.stack.empty()) elements = stack_length(m, m.stack.size() - 1);
+      profile_add((op == OP_SCALAR || op == OP_PI) ? m.profile->phases[PHASE_INPUT] : m.profile->ops[op],
+                  elements, start);
+    }
+    k++;
+  }
+  return TCL_OK;
+}
+
+// Checking and optimizing
+// Programs are optimized once, when compiled (see compile_program): runs of
+// scalar constants and element-wise operators on them are folded into a
+// single constant, computed by the same kernels as at run time (so that
+// "pi 180 div" costs nothing per call), and moves that cancel out (dup pop,
+// swap swap, a constant then pop, dup swap) are removed. The stack heights
+// are those of the program as written. Constants split between arguments
+// ("$x pi 180 div mult", where 180 is data) are folded for each command by
+// fold_steps.
+
+// Apply a unary (b NULL) or binary element-wise operator to constants; false
+// if it fails (it is then left to fail at run time)
+static bool fold_constant(Opcode op, double &a, const double *b)
+{
+  FusedOp f;
+  f.op = op;
+  f.vec = NULL;
+  f.type = VEC_F64;
+  f.offset = 0;
+  f.stride = 1;
+  f.scalar = 0.0;
+  f.reversed = false;
+  return apply_fused(f, &a, b, 1) == NULL;
+}
+
+// Fold constants and drop moves that cancel out, in place
+static void optimize_program(Program &prog)
+{
+  std::vector<Instr> &code = prog.code;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 0; i < code.size() && !changed; i++) {
+      const Opcode op = code[i].op;
+      const bool   pushes = (op == OP_SCALAR || op == OP_PI);
+      const Opcode next = (i + 1 < code.size()) ? code[i+1].op : OP_NUM;
+      double a = (op == OP_PI) ? M_PI : code[i].value;
+      if (pushes && is_unary_ew(next)) {
+        if (!fold_constant(next, a, NULL)) continue;
+        code.erase(code.begin() + i + 1);
+      } else if (pushes && i + 2 < code.size() && (code[i+1].op == OP_SCALAR || code[i+1].op == OP_PI)
+                 && is_binary_ew(code[i+2].op)) {
+        // Both operands are one-element vectors at run time
+        double b = (code[i+1].op == OP_PI) ? M_PI : code[i+1].value;
+        if (!fold_constant(code[i+2].op, a, &b)) continue;
+        code.erase(code.begin() + i + 1, code.begin() + i + 3);
+      } else if ((op == OP_DUP && (next == OP_POP || next == OP_SWAP))
+                 || (op == OP_SWAP && next == OP_SWAP) || ((pushes || op == OP_HEIGHT) && next == OP_POP)) {
+        code.erase(code.begin() + i + (next == OP_SWAP && op == OP_DUP), code.begin() + i + 2);
+        changed = true;
+        continue;
+      } else {
         continue;
       }
+      code[i].op = OP_SCALAR;
+      code[i].value = a;
+      changed = true;
+    }
+  }
+}
+
+// Value of a step that pushes a constant: a scalar instruction, or data
+// holding a single f64 number (other types keep their own rules)
+static bool constant_value(const Step &step, double &value)
+{
+  if (!step.data) {
+    if (step.instr->op != OP_SCALAR && step.instr->op != OP_PI) return false;
+    value = (step.instr->op == OP_PI) ? M_PI : step.instr->value;
+    return true;
+  }
+  Tcl_Obj *obj = step.data;
+  if (obj->typePtr == &vector_type) {
+    const VectorRep &vec = *get_vector(obj);
+    if (vec.type.type != VEC_F64 || vector_length(vec) != 1) return false;
+    value = vec.data->buf[0];
+    return true;
+  }
+  if (!is_text(obj)) return false;
+  const char *p = obj->bytes;
+  const char *const end = p + obj->length;
+  while (p < end && is_list_space(*p)) p++;
+  if (p == end || !(p = read_decimal(p, end, value))) return false;
+  while (p < end && is_list_space(*p)) p++;
+  return p == end;
+}
+
+// Fold constants across the steps of a command, as optimize_program does
+// within a program. The folded constants are instructions of a program of
+// their own, held by the command like the others (progs)
+static void fold_steps(std::vector<Step> &steps, std::vector<Program *> &progs)
+{
+  Program *folded = NULL;
+  for (size_t i = 0; i + 1 < steps.size(); ) {
+    double a, b;
+    size_t used = 0;
+    if (constant_value(steps[i], a)) {
+      const Step &next = steps[i+1];
+      if (!next.data && is_unary_ew(next.instr->op)) {
+        if (fold_constant(next.instr->op, a, NULL)) used = 2;
+      } else if (i + 2 < steps.size() && !steps[i+2].data && is_binary_ew(steps[i+2].instr->op)
+                 && constant_value(next, b)) {
+        if (fold_constant(steps[i+2].instr->op, a, &b)) used = 3;
+      }
+    }
+    if (!used) {
+      i++;
+      continue;
+    }
+    if (!folded) {
+      // At most one constant per step: the instructions never move
+      folded = new Program;
+      folded->code.reserve(steps.size());
+      folded->depth_needed = 0;
+      folded->depth_change = 0;
+      folded->refs = 1;
+      progs.push_back(folded);
+    }
+    Instr instr = Instr();
+    instr.op = OP_SCALAR;
+    instr.value = a;
+    folded->code.push_back(instr);
+    steps[i].instr = &folded->code.back();
+    steps[i].data = NULL;
+    steps.erase(steps.begin() + i + 1, steps.begin() + i + used);
+    // The result may fold with the constant before it
+    if (i > 0) i--;
+  }
+}
+
+// Before any vector work, check_steps runs the whole command on lengths
+// alone: each stack slot holds the length of its item when it is known (data
+// arguments, constants, registers, and the results of operators on known
+// lengths), and the value of one-element data and constants. Shapes that
+// would fail at run time are reported with the same messages, so that a long
+// command does not fail after doing most of its work. Lengths that depend on
+// the data (files, variables, unique, pair searches...) are unknown, and so
+// are the results of operators on them: they are checked when they run.
+
+static const ShapeSlot UNKNOWN_SHAPE = { 0, false, 0.0 };
+
+static inline ShapeSlot shape(size_t length)
+{
+  ShapeSlot s = { length, false, 0.0 };
+  return s;
+}
+
+// Values used as sizes are only known if they are in range of an int
+static inline void set_value(ShapeSlot &s, double value)
+{
+  s.known = (value >= -INT_MAX && value <= INT_MAX);
+  s.value = value;
+}
+
+// Shape of a data argument
+static ShapeSlot operand_shape(const Step &step)
+{
+  ShapeSlot s = shape(operand_length(step));
+  if (s.length != 1) return s;
+  if (step.data->typePtr == &vector_type) {
+    const VectorRep &vec = *get_vector(step.data);
+    set_value(s, get_elem(vec.data->buf.data(), vec.type.type, 0));
+  } else {
+    Tcl_Obj *elem;
+    double   value;
+    if (Tcl_ListObjIndex(NULL, step.data, 0, &elem) == TCL_OK && elem
+        && Tcl_GetDoubleFromObj(NULL, elem, &value) == TCL_OK) {
+      set_value(s, value);
+    }
+  }
+  return s;
+}
+
+// Check a binary operator on known lengths a (below) and b (top); sets the
+// length of the result
+static const char * check_binary(Opcode op, size_t a, size_t b, size_t &length)
+{
+  length = (a == 1) ? b : (b == 1) ? a : (a && b) ? std::max(a, b) : 0;
+  if (op == OP_DOT) length = 1;
+  if (!a || !b || a == b) return NULL;
+  switch (op) {
+  case OP_DOT:   return "vecexpr: function dot requires vectors of same length";
+  case OP_ATAN2: return "vecexpr: function atan2 requires two vectors of same length";
+  default:       break;
+  }
+  if (a == 1 || b == 1) return NULL;
+  switch (op) {
+  case OP_ADD:  return (std::max(a, b) % std::min(a, b)) ? "vecexpr: matrix-vector add with non-divisor vector length" : NULL;
+  case OP_MULT: return "vecexpr: cannot element-wise multiply different-length vectors";
+  case OP_SUB:  return "vecexpr: cannot element-wise subtract different-length vectors";
+  default:      return "vecexpr: attempting binary function on different-length vectors";
+  }
+}
+
+// Check a view (slice stride row col) of a vector of n elements; sets the
+// length of the view
+static int check_view(Tcl_Interp *interp, Opcode op, size_t n, const ShapeSlot &first, const ShapeSlot &second,
+                      size_t &length)
+{
+  length = 0;
+  if ((first.length && first.length != 1) || (second.length && second.length != 1)
+      || (first.known && first.value != floor(first.value)) || (second.known && second.value != floor(second.value))) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: the last two operands of %s should be integer scalars",
+                                           op_name(op)));
+    return TCL_ERROR;
+  }
+  if (!n || !first.known || !second.known) return TCL_OK;
+  const double a = first.value, b = second.value;
+  if (op == OP_ROW || op == OP_COL) {
+    if (a < 1) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: number of lines should be positive for %s", op_name(op)));
+      return TCL_ERROR;
+    }
+    if (n % (size_t) a) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: number of lines does not divide length of unrolled matrix for %s",
+                                             op_name(op)));
+      return TCL_ERROR;
+    }
+    const size_t ncols = n / (size_t) a;
+    if (b < 0 || b >= ((op == OP_ROW) ? a : (double) ncols)) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s index out of range", op_name(op)));
+      return TCL_ERROR;
+    }
+    length = (op == OP_ROW) ? ncols : (size_t) a;
+    return TCL_OK;
+  }
+  if (a < 0 || a >= n || b < 1 || (op == OP_SLICE && b > n - a)) {
+    Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s out of range of a vector of %lu elements",
+                                           op_name(op), (unsigned long) n));
+    return TCL_ERROR;
+  }
+  length = (op == OP_SLICE) ? (size_t) b : (n - (size_t) a + (size_t) b - 1) / (size_t) b;
+  return TCL_OK;
+}
+
+// Smaller commands are not checked: they fail fast enough when they run
+static const size_t CHECK_MIN = 4096;  // elements of data arguments
+
+// height: items on the stack before the steps (of unknown lengths)
+static int check_steps(Tcl_Interp *interp, const std::vector<Step> &steps, int height, Machine &m)
+{
+  std::vector<ShapeSlot> &st = m.scratch->shapes;
+  std::vector<std::pair<std::string, ShapeSlot> > &regs = m.scratch->reg_shapes;
+  st.assign(height, UNKNOWN_SHAPE);
+  regs.clear();
+
+  for (size_t k = 0; k < steps.size(); k++) {
+    if (steps[k].data) {
+      st.push_back(operand_shape(steps[k]));
+      continue;
+    }
+    const Instr &instr = *steps[k].instr;
+    const Opcode op = instr.op;
+    const size_t n = st.size();
+    ShapeSlot    result = UNKNOWN_SHAPE;
+    const char * error = NULL;
+    switch (op) {
+    case OP_SCALAR:
+      result = shape(1);
+      set_value(result, instr.value);
+      st.push_back(result);
+      continue;
+    case OP_PI: case OP_HEIGHT:
+      st.push_back(shape(1));
+      continue;
+    case OP_RECALL:
+      for (size_t r = 0; r < regs.size(); r++) {
+        if (regs[r].first == instr.name) result = regs[r].second;
+      }
+      st.push_back(result);
+      continue;
+    case OP_STORE: {
+      size_t r = 0;
+      while (r < regs.size() && regs[r].first != instr.name) r++;
+      if (r == regs.size()) regs.push_back(std::make_pair(instr.name, UNKNOWN_SHAPE));
+      regs[r].second = st.back();
+      continue;
+    }
+    case OP_DUP:
+      st.push_back(st.back());
+      continue;
+    case OP_SWAP:
+      std::swap(st[n-1], st[n-2]);
+      continue;
+    case OP_MEAN: case OP_MIN: case OP_MAX: case OP_SUM: case OP_MEDIAN: case OP_STATS:
+      st.push_back(shape(op == OP_STATS ? STATS_LENGTH : 1));
+      continue;
+    case OP_CONCAT:
+      result = shape((st[n-2].length && st[n-1].length) ? st[n-2].length + st[n-1].length : 0);
+      break;
+    case OP_ADD: case OP_SUB: case OP_MULT: case OP_DIV: case OP_ATAN2: case OP_DOT:
+      error = check_binary(op, st[n-2].length, st[n-1].length, result.length);
+      break;
+    case OP_MIN_EW: case OP_TRANSP: {
+      const ShapeSlot &mat = st[n-2], &nl = st[n-1];
+      if (nl.length > 1) {
+        error = (op == OP_TRANSP) ? "vecexpr: top of the stack should be scalar (number of lines) for transp"
+          : "vecexpr: top of the stack should be scalar (number of lines) for min_ew";
+      } else if (nl.known && nl.value < 1) {
+        error = (op == OP_TRANSP) ? "vecexpr: number of lines should be positive for transp"
+          : "vecexpr: number of lines should be positive for min_ew";
+      } else if (nl.known && mat.length % (size_t) nl.value) {
+        error = "vecexpr: number of lines does not divide length of unrolled matrix";
+      }
+      result = shape(op == OP_TRANSP ? mat.length : (nl.known && nl.value >= 2) ? mat.length / (size_t) nl.value : 0);
+      break;
+    }
+    case OP_MATMULT: {
+      const ShapeSlot &a = st[n-3], &b = st[n-2], &d = st[n-1];
+      const int nj = d.known ? (int) d.value : 0;
+      if (d.length > 1) {
+        error = "matmult: common dimension specifier should be a scalar";
+      } else if (d.known && nj < 1) {
+        error = "matmult: common dimension should be positive";
+      } else if (d.known && ((a.length % nj) || (b.length % nj))) {
+        error = "matmult: matrix size not a multiple of common dimension";
+      } else if (d.known && a.length && b.length) {
+        result = shape((a.length / nj) * (b.length / nj));
+      }
+      break;
+    }
+    case OP_DIFF:
+      if (st.back().length == 1) error = "vecexpr: diff needs at least two elements";
+      result = shape(st.back().length ? st.back().length - 1 : 0);
+      break;
+    case OP_BLOCKAVG: case OP_WSUM: case OP_WMEAN: case OP_WMIN: case OP_WMAX:
+      if (check_window(interp, op, st[n-2].length, st[n-1].length, st[n-1].known, st[n-1].value,
+                       result.length) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      break;
+    case OP_SLICE: case OP_STRIDE: case OP_ROW: case OP_COL:
+      if (check_view(interp, op, st[n-3].length, st[n-2], st[n-1], result.length) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      break;
+    default:
+      if (is_unary_ew(op) || op == OP_SORT || op == OP_ARGSORT || op == OP_F64 || op == OP_F32 || op == OP_I64
+          || op == OP_CUMSUM || op == OP_CUMPROD) {
+        result = shape(st.back().length);
+      }
+      break;
+    }
+    if (error) {
+      Tcl_SetResult(interp, (char *) error, TCL_STATIC);
+      return TCL_ERROR;
+    }
+    // Replace the operands with the results
+    const int arity = op_arity(op);
+    const int pushed = arity + op_change(op);
+    st.resize(n - arity);
+    if (pushed > 0) st.resize(n - arity + pushed, UNKNOWN_SHAPE);
+    if (pushed > 0) st.back() = result;
+  }
+  return TCL_OK;
+}
+
+// Registers are live from a store to its last recall: plan_registers marks
+// stores that are never recalled, which then do nothing, and the last recall
+// of each store, which takes the vector out of the register instead of
+// sharing it, so that an operator writing it does not need a copy.
+static void plan_registers(std::vector<Step> &steps)
+{
+  for (size_t k = 0; k < steps.size(); k++) {
+    const Instr *instr = steps[k].instr;
+    if (!instr || (instr->op != OP_STORE && instr->op != OP_RECALL)) continue;
+    // Unless the next use of the register reads it
+    steps[k].last_use = true;
+    for (size_t j = k + 1; j < steps.size(); j++) {
+      const Instr *later = steps[j].instr;
+      if (later && (later->op == OP_STORE || later->op == OP_RECALL) && later->name == instr->name) {
+        steps[k].last_use = (later->op == OP_STORE);
+        break;
+      }
+    }
+  }
+}
+
+// Streaming
+// vecexpr -chunk N runs a program over its <file: inputs N elements at a time,
+// so that memory use depends on N rather than on the size of the files. The
+// steps up to the last one that needs streamed data (the head) run once per
+// chunk; the others (the tail) run once, on the combined results. In the head,
+// streamed vectors go through element-wise operators (with each other or with
+// scalars), reductions (sum mean min max dot stats bin binnd wbinnd, whose
+// results are combined across chunks), data moves (dup pop swap store recall)
+// and >file:. The results of reductions can only be moved before the tail.
+
+enum SlotKind { SLOT_SCALAR, SLOT_VECTOR, SLOT_STREAM, SLOT_REDUCED };
+
+// Stack item, as seen by plan_stream
+struct StreamSlot {
+  SlotKind kind;
+  Opcode   reduction;   // SLOT_REDUCED: how partial results are combined
+};
+
+static int stream_error(Tcl_Interp *interp, const char *what, Opcode op)
+{
+  Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: %s \"%s\" while streaming", what, op_name(op)));
+  return TCL_ERROR;
+}
+
+// Check that steps can be streamed and split them into head and tail; slots
+// receives the stack items at the end of the head, and st the inputs and
+// outputs (not opened yet)
+static int plan_stream(Tcl_Interp *interp, const std::vector<Step> &steps, Stream &st,
+                       std::vector<Step> &head, std::vector<Step> &tail, std::vector<StreamSlot> &slots)
+{
+  std::vector<StreamSlot> stack;
+  StreamSlot item = { SLOT_SCALAR, OP_SCALAR };
+  std::map<std::string, StreamSlot> regs;
+  size_t split = 0;         // steps before split are the head
+  size_t first_reduced = steps.size();  // first step using the result of a reduction
+  Opcode reduced_op = OP_SCALAR;
+
+  for (size_t k = 0; k < steps.size(); k++) {
+    if (steps[k].data) {
+      item.kind = (operand_length(steps[k]) == 1) ? SLOT_SCALAR : SLOT_VECTOR;
+      stack.push_back(item);
+      continue;
+    }
+    const Opcode op = steps[k].instr->op;
+    const OpInfo *info = lookup_op(op_name(op));
+    const int arity = info ? info->arity
+      : (op == OP_PUSH_VAR || op == OP_SCALAR || op == OP_READ_FILE || op == OP_READ_BYTES) ? 0 : 1;
+    const int change = info ? info->change : (arity == 0) ? +1 : -1;
+    bool streamed = false, reduced = false, scalars = true;
+    for (int i = stack.size() - arity; i < (int) stack.size(); i++) {
+      streamed |= (stack[i].kind == SLOT_STREAM);
+      reduced |= (stack[i].kind == SLOT_REDUCED);
+      scalars &= (stack[i].kind == SLOT_SCALAR);
+    }
+    const bool moves = (op == OP_DUP || op == OP_POP || op == OP_SWAP);  // store is not: see run_stream
+    bool needs = streamed && op != OP_POP && op != OP_SWAP;
+    if (reduced && !moves && first_reduced == steps.size()) {
+      first_reduced = k;
+      reduced_op = op;
+    }
+
+    item.kind = scalars ? SLOT_SCALAR : SLOT_VECTOR;
+    item.reduction = OP_SCALAR;
+    switch (op) {
+    case OP_READ_FILE: {
+      StreamInput in = StreamInput();
+      in.instr = steps[k].instr;
+      in.fd = -1;
+      st.inputs.push_back(in);
+      item.kind = SLOT_STREAM;
+      needs = true;
+      break;
+    }
+    case OP_WRITE_FILE:
+      if (streamed) {
+        StreamOutput out;
+        out.instr = steps[k].instr;
+        out.fd = -1;
+        st.outputs.push_back(out);
+      }
+      break;
+    case OP_SCALAR: case OP_PI: case OP_HEIGHT:
+      item.kind = SLOT_SCALAR;
+      break;
+    case OP_PUSH_VAR: case OP_READ_BYTES:
+      item.kind = SLOT_VECTOR;
+      break;
+    case OP_RECALL:
+      item = regs[steps[k].instr->name];  // a scalar if never stored (an error when run)
+      needs = (item.kind == SLOT_STREAM);
+      break;
+    case OP_STORE:
+      regs[steps[k].instr->name] = stack.back();
+      break;
+    case OP_DUP:
+      item = stack.back();
+      break;
+    case OP_POP:
+      break;
+    case OP_SWAP:
+      std::swap(stack[stack.size()-1], stack[stack.size()-2]);
+      break;
+    case OP_MEAN: case OP_MIN: case OP_MAX: case OP_SUM: case OP_STATS:
+      item.kind = (op == OP_STATS) ? SLOT_VECTOR : SLOT_SCALAR;
+      if (streamed) {
+        item.kind = SLOT_REDUCED;
+        item.reduction = op;
+      }
+      break;
+    case OP_DOT:
+      item.kind = SLOT_SCALAR;
+      if (streamed) {
+        if (stack[stack.size()-1].kind != SLOT_STREAM || stack[stack.size()-2].kind != SLOT_STREAM) {
+          return stream_error(interp, "streamed data can only be combined with streamed data in", op);
+        }
+        item.kind = SLOT_REDUCED;
+        item.reduction = op;
+      }
+      break;
+    case OP_BIN: case OP_BINND: case OP_WBINND:
+      item.kind = SLOT_VECTOR;
+      if (streamed) {
+        // Samples, and their weights, are streamed; min dx nbins are not
+        for (int i = stack.size() - arity; i < (int) stack.size() - 3; i++) {
+          if (stack[i].kind != SLOT_STREAM) {
+            return stream_error(interp, "samples and weights should both be streamed data in", op);
+          }
+        }
+        for (int i = stack.size() - 3; i < (int) stack.size(); i++) {
+          if (stack[i].kind == SLOT_STREAM || (op == OP_BIN && stack[i].kind != SLOT_SCALAR)) {
+            return stream_error(interp, (op == OP_BIN) ? "min, dx and nbins should be scalars for"
+                                : "min, dx and nbins cannot be streamed data in", op);
+          }
+        }
+        item.kind = SLOT_REDUCED;
+        item.reduction = op;
+      }
+      break;
+    default:
+      if (is_unary_ew(op)) {
+        item = stack.back();
+        if (reduced) item.kind = SLOT_SCALAR;
+      } else if (is_binary_ew(op)) {
+        if (streamed) {
+          for (size_t i = stack.size() - 2; i < stack.size(); i++) {
+            if (stack[i].kind != SLOT_STREAM && stack[i].kind != SLOT_SCALAR) {
+              return stream_error(interp, "streamed data can only be combined with streamed data or scalars in", op);
+            }
+          }
+          item.kind = SLOT_STREAM;
+        }
+      } else if (streamed) {
+        // concat min_ew transp matmult >varName &varName
+        return stream_error(interp, "cannot apply", op);
+      } else if (op == OP_CONCAT) {
+        item.kind = SLOT_VECTOR;
+      }
+      break;
+    }
+    // Operators replace their operands with their result, except those that
+    // keep some (reductions, dup, median, percentile)
+    if (op != OP_SWAP && op != OP_STORE) {
+      const int kept = (arity + change > 0) ? arity + change - 1 : 0;
+      stack.resize(stack.size() - arity + kept);
+      if (arity + change > 0) stack.push_back(item);
+    }
+    if (needs) {
+      split = k + 1;
+      slots = stack;
+    }
+  }
+
+  if (st.inputs.empty()) {
+    Tcl_SetResult(interp, (char *) "vecexpr: -chunk needs at least one <file: input", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (first_reduced < split) {
+    return stream_error(interp, "the result of a reduction is used by", reduced_op);
+  }
+  if (!stack.empty() && stack.back().kind == SLOT_STREAM) {
+    Tcl_SetResult(interp, (char *) "vecexpr: the result of a streamed program should be reduced (sum mean min max dot stats bin binnd wbinnd) or written with >file:", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  head.assign(steps.begin(), steps.begin() + split);
+  tail.assign(steps.begin() + split, steps.end());
+  return TCL_OK;
+}
+
+// Open the inputs and outputs found by plan_stream, and start the reader
+static int open_stream(Tcl_Interp *interp, Stream &st)
+{
+  for (size_t i = 0; i < st.inputs.size(); i++) {
+    StreamInput &in = st.inputs[i];
+    // Only the header of the file is accessed through the mapping
+    MappedFile map;
+    size_t     count;
+    if (map_file(interp, in.instr->name, map) != TCL_OK
+        || file_window(interp, *in.instr, map, in.type, in.first, count) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (i > 0 && count != st.total) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: streamed inputs have different lengths (%lu and %lu elements)",
+                                             (unsigned long) st.total, (unsigned long) count));
+      return TCL_ERROR;
+    }
+    st.total = count;
+    in.stride = in.instr->file.stride;
+    in.fd = open_file(interp, in.instr->name, O_RDONLY);
+    if (in.fd < 0) return TCL_ERROR;
+  }
+  for (size_t o = 0; o < st.outputs.size(); o++) {
+    StreamOutput &out = st.outputs[o];
+    if (check_stream_output(interp, st, out.instr->name) != TCL_OK) return TCL_ERROR;
+    // The type of the data is not known yet: .npy outputs hold f64
+    out.fd = open_output(interp, *out.instr, st.total, VEC_F64, out.type);
+    if (out.fd < 0) return TCL_ERROR;
+  }
+  st.nchunks = (st.total + st.chunk - 1) / st.chunk;
+#ifdef TCL_THREADS
+  st.threaded = (Tcl_CreateThread(&st.reader, stream_reader, (ClientData) &st,
+                                  TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK);
+#endif
+  return TCL_OK;
+}
+
+// Stop the reader and close the files
+static int close_stream(Tcl_Interp *interp, Stream &st, int result)
+{
+  if (st.threaded) {
+    Tcl_MutexLock(&st.mutex);
+    st.stop = true;
+    Tcl_ConditionNotify(&st.cond);
+    Tcl_MutexUnlock(&st.mutex);
+    int status;
+    Tcl_JoinThread(st.reader, &status);
+  }
+  Tcl_ConditionFinalize(&st.cond);
+  Tcl_MutexFinalize(&st.mutex);
+  for (size_t i = 0; i < st.inputs.size(); i++) {
+    if (st.inputs[i].fd >= 0) close(st.inputs[i].fd);
+  }
+  for (size_t o = 0; o < st.outputs.size(); o++) {
+    if (st.outputs[o].fd >= 0 && close(st.outputs[o].fd) != 0 && result == TCL_OK) {
+      result = file_error(interp, "cannot write", st.outputs[o].instr->name);
+    }
+  }
+  return result;
+}
+
+// Combine the partial result of a reduction over n elements into acc
+static void combine_partial(Opcode reduction, std::vector<double> &acc, ItemType &acc_type,
+                            std::vector<double> &partial, const ItemType &type, size_t n, bool first)
+{
+  if (reduction == OP_MEAN) partial[0] *= n;
+  if (first) {
+    acc.swap(partial);
+    acc_type = type;
+    return;
+  }
+  if (type.type == VEC_I64) {
+    // sum min max dot of i64 data, and bin binnd
+    i64_alias *a = (i64_alias *) acc.data();
+    const i64_alias *p = (const i64_alias *) partial.data();
+    switch (reduction) {
+    case OP_MIN: if (p[0] < a[0]) a[0] = p[0]; break;
+    case OP_MAX: if (p[0] > a[0]) a[0] = p[0]; break;
+    default:
+      for (size_t i = 0; i < acc.size(); i++) a[i] = wrap_op(OP_ADD, a[i], p[i]);
+      break;
+    }
+    return;
+  }
+  switch (reduction) {
+  case OP_STATS: {
+    Moments mo = stats_moments(acc.data());
+    merge_moments(mo, stats_moments(partial.data()));
+    stats_result(mo, acc.data());
+    break;
+  }
+  case OP_MIN:
+    if (partial[0] < acc[0]) acc[0] = partial[0];
+    break;
+  case OP_MAX:
+    if (partial[0] > acc[0]) acc[0] = partial[0];
+    break;
+  default:  // sum mean dot bin wbinnd
+    for (size_t i = 0; i < acc.size(); i++) acc[i] += partial[i];
+    break;
+  }
+}
+
+static int run_stream(Tcl_Interp *interp, const std::vector<Step> &steps, Machine &m, size_t chunk)
+{
+  Stream st;
+  std::vector<Step> head, tail;
+  std::vector<StreamSlot> slots;
+  st.total = 0;
+  st.chunk = chunk;
+  st.nchunks = 0;
+  st.current = 0;
+  st.mutex = NULL;
+  st.cond = NULL;
+  for (size_t s = 0; s < STREAM_SLOTS; s++) st.loaded[s] = -1;
+  st.stop = false;
+  st.threaded = false;
+
+  if (plan_stream(interp, steps, st, head, tail, slots) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  int result = open_stream(interp, st);
+  std::vector<std::vector<double> > acc(slots.size());
+  std::vector<ItemType> acc_types(slots.size(), F64_ITEM);
+  for (size_t k = 0; result == TCL_OK && k < st.nchunks; k++) {
+    result = wait_chunk(interp, st, k);
+    if (result != TCL_OK) break;
+    clear_stack(m);
+    st.current = k;
+    m.stream = &st;
+    result = run_steps(interp, head, m);
+    m.stream = NULL;
+    release_chunk(st, k);
+    for (size_t i = 0; result == TCL_OK && i < slots.size(); i++) {
+      if (slots[i].kind != SLOT_REDUCED) continue;
+      combine_partial(slots[i].reduction, acc[i], acc_types[i], m.stack[i], m.types[i], chunk_length(st, k), k == 0);
+    }
+  }
+  result = close_stream(interp, st, result);
+  if (result != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  // Replace partial results with the combined ones; streamed data are not
+  // used by the tail, which runs as usual
+  for (size_t i = 0; i < slots.size(); i++) {
+    if (slots[i].kind == SLOT_REDUCED) {
+      m.stack[i].swap(acc[i]);
+      m.types[i] = acc_types[i];
+      if (slots[i].reduction == OP_MEAN) m.stack[i][0] /= st.total;
+    } else if (slots[i].kind == SLOT_STREAM) {
+      m.buffers->give(m.stack[i]);
+    }
+  }
+  return run_steps(interp, tail, m);
+}
+
+// Holds references to Tcl_Objs while a command runs
+struct ItemHolder {
+  const std::vector<Tcl_Obj *> &objs;
+  explicit ItemHolder(const std::vector<Tcl_Obj *> &o) : objs(o) {
+    for (size_t i = 0; i < objs.size(); i++) Tcl_IncrRefCount(objs[i]);
+  }
+  ~ItemHolder() {
+    for (size_t i = 0; i < objs.size(); i++) Tcl_DecrRefCount(objs[i]);
+  }
+};
+
+// Batches
+// vecexpr -map list ... runs the program once for each element of list, with
+// that element pushed first, and returns the list of results (with -matrix:
+// the results, which must have the same length, as the lines of a matrix).
+// The arguments are compiled and checked once for the whole batch. When the
+// items add up to at least the threshold and the program only uses the stack
+// (no Tcl variables or files), items run in parallel, one per task, each
+// worker with a machine and buffer pool of its own that runs serially. Such
+// batches run on private vector objects of the data arguments and items (see
+// private_vector), made beforehand, which workers only read, and the caller's
+// objects are left as they are. Workers report errors to a scratch
+// interpreter of their thread (see ThreadPool::scratch_interp); the message of
+// the first item that failed goes to the caller.
+struct MapWorker {
+  Machine *    m;
+  BufferPool   buffers;
+};
+
+struct MapJob {
+  const std::vector<Step> *  steps;
+  Tcl_Obj * const *          items;
+  ThreadPool *               pool;
+  std::vector<MapWorker *> * workers;
+  std::vector<std::vector<double> > results;
+  std::vector<ItemType>      types;
+  std::vector<std::string>   errors;   // per item, empty if it ran
+};
+
+// Can items of a batch run this operator on a worker?
+static inline bool map_parallel_op(Opcode op)
+{
+  return op != OP_PUSH_VAR && op != OP_POP_VAR && op != OP_POP_INT_VAR && op != OP_READ_FILE
+    && op != OP_WRITE_FILE && op != OP_READ_BYTES && op != OP_WRITE_BYTES;
+}
+
+// Run steps on m, emptied first, with item pushed first; the result (the top
+// of the stack, 0 if it is empty) goes to result, a buffer of m's pool
+static int run_map_item(Tcl_Interp *interp, const std::vector<Step> &steps, Machine &m, Tcl_Obj *item,
+                        std::vector<double> &result, ItemType &type)
+{
+  reset_machine(m);
+  if (push_data(interp, item, m) != TCL_OK || run_steps(interp, steps, m) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (m.stack.empty()) push_new(m, 1)[0] = 0.0;
+  materialize(m, m.stack.size() - 1);
+  result.swap(m.stack.back());
+  type = m.types.back();
+  pop(m);
+  return TCL_OK;
+}
 
-      if (!strcmp(funct, "min_ew")) { // FUNCTION: MIN_EW
-        if (count_back != 1) {
-          Tcl_SetResult(interp, (char *)  "vecexpr: top of the stack should be scalar (number of lines) for min_ew", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        size_t nl = stack.back()[0];
-        stack.pop_back();
+static void map_task(void *ctx, size_t task, int worker)
+{
+  MapJob &job = *(MapJob *) ctx;
+  MapWorker &w = *(*job.workers)[worker];
+  Tcl_Interp *interp = job.pool->scratch_interp(worker);
+  if (run_map_item(interp, *job.steps, *w.m, job.items[task], job.results[task], job.types[task]) != TCL_OK) {
+    job.errors[task] = Tcl_GetStringResult(interp);
+    Tcl_ResetResult(interp);
+  }
+}
 
-        if (count_prev % nl) {
-          Tcl_SetResult(interp, (char *)  "vecexpr: number of lines does not divide length of unrolled matrix", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        size_t length = count_prev / nl;
-        if (length == 0 || nl < 2) { // No work to do
-          continue;
-        }
-        std::vector<double> result(length);
-        std::vector<double> &source = stack.back();
-
-        for (size_t j = 0; j < length; j++) {
-          result[j] = source[j];
-          for (size_t i = 1; i < nl; i++) {
-            if (source[i*length + j] < result[j])
-              result[j] = source[i*length + j];
-          }
-        }
-        stack.pop_back();
-        stack.push_back(result);
-        continue;
-      }
+// Result of a batch: a list of vectors, or their lines in a matrix
+static int map_result(Tcl_Interp *interp, Machine &m, MapJob &job, bool matrix)
+{
+  const size_t n = job.results.size();
+  if (!matrix) {
+    Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+    for (size_t i = 0; i < n; i++) {
+      Tcl_ListObjAppendElement(NULL, list, new_result_obj(job.results[i], job.types[i], m.decimals));
+    }
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+  }
+  const size_t ncols = item_length(job.results[0], job.types[0]);
+  VecType      type = job.types[0].type;
+  for (size_t i = 1; i < n; i++) {
+    if (item_length(job.results[i], job.types[i]) != ncols) {
+      Tcl_SetResult(interp, (char *) "vecexpr: the results of -map -matrix should have the same length", TCL_STATIC);
+      return TCL_ERROR;
+    }
+    if (job.types[i].type != type) type = VEC_F64;
+  }
+  std::vector<double> buf;
+  m.buffers->take(buf, buffer_words(type, n * ncols));
+  for (size_t i = 0; i < n; i++) {
+    const double *line = job.results[i].data();
+    if (type != job.types[i].type) {
+      to_doubles(buf.data() + i * ncols, line, job.types[i].type, 0, 1, ncols);
+    } else if (type == VEC_F32) {
+      memcpy((f32_alias *) buf.data() + i * ncols, line, ncols * sizeof(float));
+    } else {
+      memcpy(buf.data() + i * ncols, line, ncols * sizeof(double));
+    }
+  }
+  Tcl_SetObjResult(interp, new_result_obj(buf, item_type(type, n * ncols), m.decimals));
+  m.buffers->give(buf);
+  return TCL_OK;
+}
 
-      if (!strcmp(funct, "mult")) { // FUNCTION: MULT
-        if ( count_back == 1 || count_prev == 1 ) {
-          if (count_back > 1) {
-            stack.back().swap(stack[prev]);
-            count_prev = count_back;
-          }
-          for (size_t i = 0; i < count_prev; i++) {
-            stack[prev][i] *= stack.back()[0];
-          }
-        } else {
-          if ( mismatched ) {
-            Tcl_SetResult(interp, (char *)  "vecexpr: cannot element-wise multiply different-length vectors", TCL_STATIC);
-            return TCL_ERROR;
-          }
-          for (size_t i = 0; i < count_back; i++) {
-            stack[prev][i] *= stack.back()[i];
-          }
-        }
-        stack.pop_back();
-        continue;
-      }
+static int run_map(Tcl_Interp *interp, VecexprState *state, const std::vector<Step> &steps, Machine &m,
+                   const std::vector<Tcl_Obj *> &items, bool matrix)
+{
+  const size_t n = items.size();
+  if (n == 0) {
+    return TCL_OK;
+  }
+  MapJob job;
+  job.steps = &steps;
+  job.items = items.data();
+  job.pool = m.pool;
+  job.workers = &state->map_workers;
+  job.results.resize(n);
+  job.types.resize(n, F64_ITEM);
 
-      if ( !strcmp(funct, "sub") ) { // FUNCTION: SUB
-        if ( count_back == 1 || count_prev == 1 ) { // subtract scalar from vector or reverse
-          if (count_back > 1) {
-            stack.back().swap(stack[prev]);
-            count_prev = count_back;
-            for (size_t i = 0; i < count_prev; i++) {
-              stack[prev][i] = stack.back()[0] - stack[prev][i];
-            }
-          } else {
-            for (size_t i = 0; i < count_prev; i++) {
-              stack[prev][i] -= stack.back()[0];
-            }
-          }
-        } else {
-          if ( mismatched ) {
-            Tcl_SetResult(interp, (char *)  "vecexpr: cannot element-wise subtract different-length vectors", TCL_STATIC);
-            return TCL_ERROR;
-          }
-          for (size_t i = 0; i < count_back; i++) {
-            stack[prev][i] -= stack.back()[i];
-          }
-        }
-        stack.pop_back();
-        continue;
+  bool parallel = (m.pool && !m.profile && n > 1);
+  for (size_t k = 0; k < steps.size() && parallel; k++) {
+    if (!steps[k].data) parallel = map_parallel_op(steps[k].instr->op);
+  }
+  // The batch then runs on private objects, even serially; a value that
+  // cannot be read is left to the serial run on the caller's, which reports it
+  std::vector<Step>      own_steps;
+  std::vector<Tcl_Obj *> own;
+  size_t                 total = 0;
+  if (parallel) {
+    own_steps = steps;
+    for (size_t k = 0; k < own_steps.size() && parallel; k++) {
+      if (!own_steps[k].data) continue;
+      const bool ints = (k + 1 < steps.size() && steps[k+1].instr && steps[k+1].instr->op == OP_I64);
+      own_steps[k].data = private_vector(interp, steps[k].data, m, ints);
+      parallel = (own_steps[k].data != NULL);
+      if (parallel) own.push_back(own_steps[k].data);
+    }
+    for (size_t i = 0; i < n && parallel; i++) {
+      Tcl_Obj *item = private_vector(interp, items[i], m, false);
+      parallel = (item != NULL);
+      if (parallel) {
+        own.push_back(item);
+        total += vector_length(*get_vector(item));
       }
+    }
+    if (parallel) {
+      job.steps = &own_steps;
+      job.items = &own[own.size() - n];
+    } else {
+      Tcl_ResetResult(interp);
+    }
+  }
+  ItemHolder hold(own);
 
-      if ( !strcmp(funct, "atan2") ) { // FUNCTION: ATAN2(Y, X)
-        if ( mismatched ) {
-          Tcl_SetResult(interp, (char *)  "vecexpr: function atan2 requires two vectors of same length", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        for (size_t i = 0; i < count_back; i++) {
-          stack[prev][i] = atan2(stack[prev][i], stack[back][i]);
-        }
-        stack.pop_back();
-        continue;
+  int result = TCL_OK;
+  if (parallel && total >= m.threshold) {
+    while (state->map_workers.size() < (size_t) m.pool->size()) {
+      MapWorker *w = new MapWorker;
+      w->m = new_machine(&w->buffers);
+      state->map_workers.push_back(w);
+    }
+    job.errors.resize(n);
+    run_tasks(m, total, n, map_task, &job);
+    for (size_t i = 0; i < n && result == TCL_OK; i++) {
+      if (!job.errors[i].empty()) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(job.errors[i].c_str(), -1));
+        result = TCL_ERROR;
       }
+    }
+    for (size_t w = 0; w < state->map_workers.size(); w++) reset_machine(*state->map_workers[w]->m);
+  } else {
+    for (size_t i = 0; i < n && result == TCL_OK; i++) {
+      result = run_map_item(interp, *job.steps, m, job.items[i], job.results[i], job.types[i]);
+    }
+  }
+  if (result == TCL_OK) {
+    result = map_result(interp, m, job, matrix);
+  }
+  // Buffers of the workers' pools end up in the interpreter's
+  for (size_t i = 0; i < n; i++) m.buffers->give(job.results[i]);
+  return result;
+}
 
-      if ( !strcmp(funct, "transp") ) { // FUNCTION: TRANSP
-        if (count_back != 1) {
-          Tcl_SetResult(interp, (char *)  "vecexpr: top of the stack should be scalar (number of lines) for transp", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        size_t ni = stack.back()[0];
-        stack.pop_back();
+// Asynchronous commands
+// vecexpr -async callback ... returns a job id at once and runs the program on
+// a runner thread of the interpreter; when it is done, the callback is called
+// from the event loop with two more words: ok and the result, or error and
+// the message. The inputs are snapshots taken when the command is called:
+// data arguments and variables read by <varName are taken into vector
+// objects of the job (see private_vector), which the runner only reads; the
+// buffer of a vector object is shared, as it is never written. Variables set
+// by >varName and &varName (global ones) are set right before the callback.
+// Runners have a machine, a buffer pool and a scratch interpreter (for error
+// messages) of their own, created on their thread. At most -jobs jobs run at
+// once, and at most -queue wait for a runner (see vecexpr::configure).
 
-        if (count_prev % ni) {
-          Tcl_SetResult(interp, (char *)  "vecexpr: number of lines does not divide length of unrolled matrix", TCL_STATIC);
-          return TCL_ERROR;
-        }
-        size_t nj = count_prev / ni;
-        if (ni < 2 || nj < 2) { // No work to do
-          continue;
-        }
-        std::vector<double> buf(count_prev);
-        std::vector<double> &source = stack.back();
+struct AsyncJob {
+  int                    id;
+  std::vector<Step>      steps;
+  std::vector<Program *> progs;     // held until the job is freed
+  std::vector<Tcl_Obj *> data;      // snapshots, private to the job
+  Tcl_Obj *              callback;
+  int                    threads;
+  size_t                 threshold;
+  Tcl_WideInt            chunk;
+  int                    decimals;
+  std::atomic<bool>      cancel;
+  // Set by the runner
+  std::vector<double>    result;
+  ItemType               type;
+  std::vector<VarWrite>  vars;
+  std::string            error;     // empty if the job ran
+};
 
-        for (size_t i = 0; i < ni; i++) {
-          for (size_t j = 1; j < nj; j++) {
-              buf[ni * j + i] = source[nj * i + j];
-          }
-        }
-        source = buf;
-        continue;
-      }
+struct AsyncQueue {
+  Tcl_Interp *           interp;
+  Tcl_ThreadId           owner;     // the interpreter's thread
+  std::map<int, AsyncJob *> jobs;   // not delivered yet (owner only)
+  int                    next_id;
+  std::vector<Tcl_ThreadId> runners;
+  // Guarded by mutex
+  Tcl_Mutex              mutex;
+  Tcl_Condition          wake;
+  std::deque<AsyncJob *> waiting;
+  int                    running;
+  int                    max_running;
+  int                    max_waiting;
+  bool                   quit;
+};
 
-      // end of binary functions
+struct AsyncEvent {
+  Tcl_Event   header;
+  AsyncJob *  job;
+  AsyncQueue *queue;
+};
 
-      if (stack.size() < 3) {
-        Tcl_SetResult(interp, (char *)  "vecexpr: unrecognized vector function, or too few items on stack", TCL_STATIC);
-        return TCL_ERROR;
-      }
+static const int DEFAULT_ASYNC_JOBS = 2;
+static const int DEFAULT_ASYNC_QUEUE = 16;
 
-      if ( !strcmp(funct, "matmult") ) { // FUNCTION: MATMULT
+static void free_async_job(AsyncJob *job)
+{
+  for (size_t i = 0; i < job->progs.size(); i++) program_release(job->progs[i]);
+  for (size_t i = 0; i < job->data.size(); i++) Tcl_DecrRefCount(job->data[i]);
+  Tcl_DecrRefCount(job->callback);
+  delete job;
+}
 
-        if (count_back != 1) {
-            Tcl_SetResult (interp, (char *) "matmult: common dimension specifier should be a scalar", TCL_STATIC);
-            return TCL_ERROR;
-        }
-        int nj1 = stack.back()[0];
-        int ni2 = nj1;
+// Run a job on a runner's machine
+static void run_async_job(Tcl_Interp *interp, Machine &m, ThreadPool *&pool, int &pool_threads, AsyncJob &job)
+{
+  if (job.threads > 1 && pool_threads != job.threads) {
+    delete pool;
+    pool = new ThreadPool(job.threads);
+    pool_threads = job.threads;
+  }
+  m.pool = (job.threads > 1 && pool->size() > 1) ? pool : NULL;
+  m.threshold = job.threshold;
+  m.var_writes = &job.vars;
+  m.cancel = &job.cancel;
+  if ((job.chunk ? run_stream(interp, job.steps, m, job.chunk) : run_steps(interp, job.steps, m)) != TCL_OK) {
+    job.error = Tcl_GetStringResult(interp);
+    Tcl_ResetResult(interp);
+  } else {
+    if (m.stack.empty()) push_new(m, 1)[0] = 0.0;
+    materialize(m, m.stack.size() - 1);
+    job.result.swap(m.stack.back());
+    job.type = m.types.back();
+  }
+  reset_machine(m);
+}
 
-        stack.pop_back();
-        std::vector<double> * mat1 = &(stack[stack.size() - 2]);
-        std::vector<double> * mat2 = &(stack.back());
+static int async_event(Tcl_Event *event, int flags);
 
-        if (mat1->size() % nj1 || mat2->size() % ni2) {
-            Tcl_SetResult (interp, (char *) "matmult: matrix size not a multiple of common dimension", TCL_STATIC);
-            return TCL_ERROR;
-        }
-        size_t ni1 = mat1->size() / nj1;
-        size_t nj2 = mat2->size() / ni2;
-
-        stack.push_back (std::vector<double> (ni1 * nj2, 0.0));
-
-        double sum;
-        int index1 = 0;
-        int index2 = 0;
-        int index = 0;
-        for (size_t i = 0; i < ni1; i++) {
-            for (size_t j = 0; j < nj2; j++) {
-                sum = 0.0;
-                index2 = j;
-                for (int k = 0; k < nj1; k++) {
-                    sum += (*mat1)[index1] * (*mat2)[index2];
-                    index1++;
-                    index2 += nj2;
-                }
-                index1 -= nj1;
-                stack.back()[index++] = sum;
-            }
-            index1 += nj1;
-        }
-        // TODO: pop the previous matrices?
-        // stack.erase(...) may incur a peformance penalty
-        continue;
+static Tcl_ThreadCreateType async_runner(ClientData clientData)
+{
+  AsyncQueue &q = *(AsyncQueue *) clientData;
+  BufferPool  buffers;
+  Machine *   m = new_machine(&buffers);
+  Tcl_Interp *interp = Tcl_CreateInterp();
+  ThreadPool *pool = NULL;
+  int         pool_threads = 0;
+
+  for (;;) {
+    Tcl_MutexLock(&q.mutex);
+    while (!q.quit && (q.waiting.empty() || q.running >= q.max_running)) {
+      Tcl_ConditionWait(&q.wake, &q.mutex, NULL);
+    }
+    if (q.quit) {
+      Tcl_MutexUnlock(&q.mutex);
+      break;
+    }
+    AsyncJob *job = q.waiting.front();
+    q.waiting.pop_front();
+    q.running++;
+    Tcl_MutexUnlock(&q.mutex);
+
+    run_async_job(interp, *m, pool, pool_threads, *job);
+
+    Tcl_MutexLock(&q.mutex);
+    q.running--;
+    Tcl_ConditionNotify(&q.wake);
+    Tcl_MutexUnlock(&q.mutex);
+
+    AsyncEvent *event = (AsyncEvent *) ckalloc(sizeof(AsyncEvent));
+    event->header.proc = async_event;
+    event->job = job;
+    event->queue = &q;
+    Tcl_ThreadQueueEvent(q.owner, &event->header, TCL_QUEUE_TAIL);
+    Tcl_ThreadAlert(q.owner);
+  }
+  delete pool;
+  delete_machine(m);
+  Tcl_DeleteInterp(interp);
+  Tcl_ExitThread(0);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+// Deliver a job that ran: set its variables and call its callback
+static void deliver_async(Tcl_Interp *interp, AsyncJob &job)
+{
+  Tcl_Obj *status = Tcl_NewStringObj(job.error.empty() ? "ok" : "error", -1);
+  Tcl_Obj *value;
+  if (job.error.empty()) {
+    value = new_result_obj(job.result, job.type, job.decimals);
+    for (size_t i = 0; i < job.vars.size() && job.error.empty(); i++) {
+      VarWrite &w = job.vars[i];
+      Tcl_Obj *obj = w.binary ? Tcl_NewByteArrayObj(w.bytes.data(), w.bytes.size())
+        : new_result_obj(w.buf, w.type, job.decimals);
+      if (!Tcl_SetVar2Ex(interp, w.name.c_str(), NULL, obj, TCL_GLOBAL_ONLY | TCL_LEAVE_ERR_MSG)) {
+        job.error = Tcl_GetStringResult(interp);
       }
+    }
+    if (!job.error.empty()) {
+      Tcl_DecrRefCount(value);
+      Tcl_SetStringObj(status, "error", -1);
+      value = Tcl_NewStringObj(job.error.c_str(), -1);
+    }
+  } else {
+    value = Tcl_NewStringObj(job.error.c_str(), -1);
+  }
+  Tcl_Obj *cmd = Tcl_DuplicateObj(job.callback);
+  Tcl_IncrRefCount(cmd);
+  int result = Tcl_ListObjAppendElement(interp, cmd, status);
+  if (result == TCL_OK) {
+    Tcl_ListObjAppendElement(NULL, cmd, value);
+    result = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_GLOBAL);
+  } else {
+    Tcl_DecrRefCount(status);
+    Tcl_DecrRefCount(value);
+  }
+  Tcl_DecrRefCount(cmd);
+  if (result != TCL_OK) Tcl_BackgroundException(interp, result);
+}
+
+static int async_event(Tcl_Event *event, int)
+{
+  AsyncJob *  job = ((AsyncEvent *) event)->job;
+  AsyncQueue &q = *((AsyncEvent *) event)->queue;
+  q.jobs.erase(job->id);
+  if (!job->cancel) {
+    Tcl_Interp *interp = q.interp;
+    Tcl_Preserve(interp);
+    deliver_async(interp, *job);
+    Tcl_Release(interp);
+  }
+  free_async_job(job);
+  return 1;
+}
+
+static AsyncQueue * new_async_queue(Tcl_Interp *interp)
+{
+  AsyncQueue *q = new AsyncQueue;
+  q->interp = interp;
+  q->owner = Tcl_GetCurrentThread();
+  q->next_id = 1;
+  q->mutex = NULL;
+  q->wake = NULL;
+  q->running = 0;
+  q->max_running = DEFAULT_ASYNC_JOBS;
+  q->max_waiting = DEFAULT_ASYNC_QUEUE;
+  q->quit = false;
+  return q;
+}
+
+static int drop_async_event(Tcl_Event *event, ClientData clientData)
+{
+  return event->proc == async_event && ((AsyncEvent *) event)->queue == (AsyncQueue *) clientData;
+}
+
+// Stop the runners and drop the jobs that were not delivered
+static void delete_async_queue(AsyncQueue *q)
+{
+  Tcl_MutexLock(&q->mutex);
+  q->quit = true;
+  for (std::map<int, AsyncJob *>::iterator i = q->jobs.begin(); i != q->jobs.end(); ++i) {
+    i->second->cancel = true;
+  }
+  Tcl_ConditionNotify(&q->wake);
+  Tcl_MutexUnlock(&q->mutex);
+  for (size_t r = 0; r < q->runners.size(); r++) {
+    int result;
+    Tcl_JoinThread(q->runners[r], &result);
+  }
+  Tcl_DeleteEvents(drop_async_event, (ClientData) q);
+  for (std::map<int, AsyncJob *>::iterator i = q->jobs.begin(); i != q->jobs.end(); ++i) {
+    free_async_job(i->second);
+  }
+  Tcl_ConditionFinalize(&q->wake);
+  Tcl_MutexFinalize(&q->mutex);
+  delete q;
+}
+
+// Start a runner for each waiting job that may run, up to max_running
+// runners; called with the mutex held
+static void start_runners(AsyncQueue &q)
+{
+  while (q.runners.size() < (size_t) q.max_running
+         && q.runners.size() - q.running < q.waiting.size()) {
+    Tcl_ThreadId id;
+    if (Tcl_CreateThread(&id, async_runner, (ClientData) &q, TCL_THREAD_STACK_DEFAULT,
+                         TCL_THREAD_JOINABLE) != TCL_OK) {
+      break;
+    }
+    q.runners.push_back(id);
+  }
+  Tcl_ConditionNotify(&q.wake);
+}
+
+// Take the value of a data argument or a variable into a vector object of the
+// job (see private_vector)
+static int snapshot(Tcl_Interp *interp, Tcl_Obj *obj, Machine &m, AsyncJob &job, Step &step, bool ints)
+{
+  Tcl_Obj *data = private_vector(interp, obj, m, ints);
+  if (!data) {
+    return TCL_ERROR;
+  }
+  step.instr = NULL;
+  step.data = data;
+  Tcl_IncrRefCount(step.data);
+  job.data.push_back(step.data);
+  return TCL_OK;
+}
+
+// Snapshot of the byte array value read by a <bytes: step
+static int snapshot_bytes(Tcl_Interp *interp, Tcl_Obj *value, Machine &m, AsyncJob &job, Step &step)
+{
+  int size;
+  const unsigned char *data = Tcl_GetByteArrayFromObj(value, &size);
+  if (read_bytes(interp, *step.instr, data, size, m) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  step.instr = NULL;
+  step.data = new_vector_obj(m.stack.back(), m.types.back());
+  Tcl_IncrRefCount(step.data);
+  job.data.push_back(step.data);
+  m.stack.pop_back();
+  m.types.pop_back();
+  return TCL_OK;
+}
+
+// Queue the steps of a command as a job; its id is the result
+static int submit_async(Tcl_Interp *interp, AsyncQueue &q, const std::vector<Step> &steps, Machine &m,
+                        Tcl_Obj *callback, int threads, Tcl_WideInt chunk)
+{
+#ifndef TCL_THREADS
+  Tcl_SetResult(interp, (char *) "vecexpr: -async needs a Tcl built with threads", TCL_STATIC);
+  return TCL_ERROR;
+#endif
+  Tcl_MutexLock(&q.mutex);
+  const bool full = q.waiting.size() >= (size_t) q.max_waiting;
+  Tcl_MutexUnlock(&q.mutex);
+  if (full) {
+    Tcl_SetResult(interp, (char *) "vecexpr: too many jobs waiting (see vecexpr::configure -queue)", TCL_STATIC);
+    return TCL_ERROR;
+  }
 
-      // end of ternary functions
+  AsyncJob *job = new AsyncJob;
+  job->steps = steps;
+  job->progs = m.scratch->progs;
+  for (size_t i = 0; i < job->progs.size(); i++) job->progs[i]->refs++;
+  job->callback = callback;
+  Tcl_IncrRefCount(callback);
+  job->threads = threads;
+  job->threshold = m.threshold;
+  job->chunk = chunk;
+  job->decimals = m.decimals;
+  job->cancel = false;
+  job->type = F64_ITEM;
 
-      if (stack.size() < 3) {
-        Tcl_SetResult(interp, (char *)  "vecexpr: unrecognized vector function, or too few items on stack", TCL_STATIC);
+  // Variables written by the command are read back from the job
+  std::vector<std::string> written;
+  for (size_t k = 0; k < job->steps.size(); k++) {
+    Step &step = job->steps[k];
+    const bool ints = (k + 1 < job->steps.size() && job->steps[k+1].instr && job->steps[k+1].instr->op == OP_I64);
+    if (step.data) {
+      if (snapshot(interp, step.data, m, *job, step, ints) != TCL_OK) {
+        free_async_job(job);
+        return TCL_ERROR;
+      }
+      continue;
+    }
+    const Instr &instr = *step.instr;
+    if (instr.op == OP_POP_VAR || instr.op == OP_POP_INT_VAR || instr.op == OP_WRITE_BYTES) {
+      written.push_back(instr.name);
+    } else if ((instr.op == OP_PUSH_VAR || instr.op == OP_READ_BYTES)
+               && std::find(written.begin(), written.end(), instr.name) == written.end()) {
+      Tcl_Obj *value = Tcl_GetVar2Ex(interp, instr.name.c_str(), NULL, 0);
+      if (!value) {
+        Tcl_SetResult(interp, (char *) "vecexpr: tried to push unknown Tcl variable", TCL_STATIC);
+      }
+      if (!value || (instr.op == OP_READ_BYTES ? snapshot_bytes(interp, value, m, *job, step)
+                     : snapshot(interp, value, m, *job, step, ints)) != TCL_OK) {
+        free_async_job(job);
         return TCL_ERROR;
       }
+    }
+  }
 
-      if ( !strcmp(funct, "bin") ) { // FUNCTION: BIN
+  job->id = q.next_id++;
+  q.jobs[job->id] = job;
+  Tcl_MutexLock(&q.mutex);
+  q.waiting.push_back(job);
+  start_runners(q);
+  const bool stuck = q.runners.empty();
+  if (stuck) q.waiting.pop_back();
+  Tcl_MutexUnlock(&q.mutex);
+  if (stuck) {
+    q.jobs.erase(job->id);
+    free_async_job(job);
+    Tcl_SetResult(interp, (char *) "vecexpr: cannot start a thread for -async", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr#%d", job->id));
+  return TCL_OK;
+}
 
-        if (stack.back().size() * stack[stack.size()-2].size() * stack[stack.size()-3].size() != 1 ) {
-            Tcl_SetResult (interp, (char *) "bin needs 3 scalars on the stack: min, dx, and nbins.", TCL_STATIC);
-            return TCL_ERROR;
-        }
-        const double nbins = stack.back()[0]; stack.pop_back();
-        const double dx = stack.back()[0]; stack.pop_back();
-        const double min = stack.back()[0]; stack.pop_back();
-        stack.push_back(std::vector<double> (static_cast<size_t>(nbins), 0.0)); // Histogram
-        back = stack.size()-1; // histogram
-        prev = stack.size()-2; // data to bin
-
-        const size_t count = stack[prev].size();
-        for (size_t i = 0; i < count; i++) {
-          int bin = floor((stack[prev][i] - min) / dx);
-          if (bin >= 0 && bin < nbins) stack[back][bin] += 1.0;
-        }
-        stack.back().swap(stack[prev]); // move data to the back
-        stack.pop_back(); // get data off the stack
-        continue;
+// Is obj the literal option name opt? Avoids generating string reps of data
+static inline bool is_option(Tcl_Obj *obj, const char *opt)
+{
+  return obj->bytes && obj->bytes[0] == '-' && !strcmp(obj->bytes, opt);
+}
+
+static int obj_vecexpr(ClientData clientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+{
+  VecexprState *state = (VecexprState *) clientData;
+  int threads = state->threads;
+  Tcl_WideInt chunk = 0;
+  Tcl_Obj *   map = NULL;
+  bool        matrix = false;
+  Tcl_Obj *   callback = NULL;
+  int         decimals = -1;
+  int first = 1;
+
+  while (first < argc && (is_option(objv[first], "-threads") || is_option(objv[first], "-chunk")
+                          || is_option(objv[first], "-map") || is_option(objv[first], "-matrix")
+                          || is_option(objv[first], "-async") || is_option(objv[first], "-decimals"))) {
+    if (is_option(objv[first], "-matrix")) {
+      matrix = true;
+      first++;
+      continue;
+    }
+    if (objv[first]->bytes[1] == 't') {
+      if (first + 1 >= argc || Tcl_GetIntFromObj(interp, objv[first+1], &threads) != TCL_OK) {
+        Tcl_SetResult(interp, (char *) "vecexpr: -threads needs an integer argument", TCL_STATIC);
+        return TCL_ERROR;
+      }
+    } else if (objv[first]->bytes[1] == 'c') {
+      if (first + 1 >= argc || Tcl_GetWideIntFromObj(interp, objv[first+1], &chunk) != TCL_OK || chunk < 1) {
+        Tcl_SetResult(interp, (char *) "vecexpr: -chunk needs a positive integer argument", TCL_STATIC);
+        return TCL_ERROR;
       }
+    } else if (objv[first]->bytes[1] == 'a') {
+      if (first + 1 >= argc) {
+        Tcl_SetResult(interp, (char *) "vecexpr: -async needs a callback", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      callback = objv[first+1];
+    } else if (objv[first]->bytes[1] == 'd') {
+      if (first + 1 >= argc || Tcl_GetIntFromObj(interp, objv[first+1], &decimals) != TCL_OK
+          || decimals < 0 || decimals > 17) {
+        Tcl_SetResult(interp, (char *) "vecexpr: -decimals needs an integer from 0 to 17", TCL_STATIC);
+        return TCL_ERROR;
+      }
+    } else {
+      if (first + 1 >= argc) {
+        Tcl_SetResult(interp, (char *) "vecexpr: -map needs a list of vectors", TCL_STATIC);
+        return TCL_ERROR;
+      }
+      map = objv[first+1];
+    }
+    first += 2;
+  }
+
+  if (argc - first < 1) {
+    Tcl_WrongNumArgs(interp, 1, objv, (char *)"?-threads N? ?-chunk N? ?-map list ?-matrix?? ?-async callback? ?-decimals N? data data/funct ?data/funct? ...");
+    return TCL_ERROR;
+  }
+  if (matrix && !map) {
+    Tcl_SetResult(interp, (char *) "vecexpr: -matrix needs -map", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (map && chunk) {
+    Tcl_SetResult(interp, (char *) "vecexpr: -map and -chunk cannot be combined", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  if (map && callback) {
+    Tcl_SetResult(interp, (char *) "vecexpr: -map and -async cannot be combined", TCL_STATIC);
+    return TCL_ERROR;
+  }
+  // The items of -map, held in case the list changes while they run
+  std::vector<Tcl_Obj *> items;
+  if (map) {
+    Tcl_Obj **elems;
+    int       nelems;
+    if (Tcl_ListObjGetElements(interp, map, &nelems, &elems) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    items.assign(elems, elems + nelems);
+  }
+  ItemHolder held_items(items);
+
+  Profile *         profile = state->profiling ? &state->profile : NULL;
+  const Tcl_WideInt start = profile ? profile_clock() : 0;
+  Program *         prog;
+  MachineHolder     held(state);
+  Machine &         m = *held.m;
+  std::vector<Step> &steps = m.scratch->steps;
+  Step              step;
+  step.last_use = false;
 
-      Tcl_SetResult(interp, (char *) "vecexpr: unrecognized function keyword", TCL_STATIC);
+  // Compile (or fetch) all programs and check stack heights before doing any work
+  int height = map ? 1 : 0;
+  bool registers = false;   // store or recall
+  bool unsized = (map != NULL);  // data of unknown length (-map, variables, files)
+  size_t data_length = 0;
+  for (int a = first; a < argc; a++) {
+    if (classify_arg(interp, objv[a], &prog) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if ( !prog ) {
+      height++;
+      step.instr = NULL;
+      step.data = objv[a];
+      steps.push_back(step);
+      data_length += operand_length(step);
+      continue;
+    }
+    if (height < prog->depth_needed) {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr: too few items on stack for \"%s\"",
+                                             Tcl_GetString(objv[a])));
       return TCL_ERROR;
     }
+    height += prog->depth_change;
+    // Keep the program alive even if its Tcl_Obj changes type while we run
+    prog->refs++;
+    m.scratch->progs.push_back(prog);
+    step.data = NULL;
+    for (size_t i = 0; i < prog->code.size(); i++) {
+      step.instr = &prog->code[i];
+      steps.push_back(step);
+      const Opcode op = step.instr->op;
+      if (op == OP_STORE || op == OP_RECALL) registers = true;
+      if (op == OP_PUSH_VAR || op == OP_READ_FILE || op == OP_READ_BYTES) unsized = true;
+    }
+  }
+
+  fold_steps(steps, m.scratch->progs);
+  if ((unsized || data_length >= CHECK_MIN) && check_steps(interp, steps, map ? 1 : 0, m) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  // Streamed steps run in a loop, which plan_registers does not follow
+  if (registers && !chunk) plan_registers(steps);
+
+  if (profile) profile_add(profile->phases[PHASE_COMPILE], argc - first, start);
+
+  std::vector<std::vector<double> > &stack = m.stack;
+  m.threshold = state->threshold;
+  m.decimals = decimals;
+  if (callback) {
+    return submit_async(interp, *state->async, steps, m, callback, threads, chunk);
+  }
+  m.pool = get_pool(state, threads);
+  m.profile = profile;
+
+  if (map) {
+    const int result = run_map(interp, state, steps, m, items, matrix);
+    if (profile && result == TCL_OK) profile_add(profile->phases[PHASE_TOTAL], items.size(), start);
+    return result;
+  }
+  if ((chunk ? run_stream(interp, steps, m, chunk) : run_steps(interp, steps, m)) != TCL_OK) {
+    return TCL_ERROR;
   }
 
   if ( stack.size() == 0 ) {
     // Stack is empty at end of evaluation, just return 0
-    stack.push_back(std::vector<double> (1, 0.0));
+    push_new(m, 1)[0] = 0.0;
+  }
+  materialize(m, stack.size() - 1);
+
+  if (!profile) {
+    Tcl_SetObjResult(interp, new_result_obj(stack.back(), m.types.back(), m.decimals));
+    return TCL_OK;
+  }
+  const size_t      elements = stack_length(m, stack.size() - 1);  // the result may take over the buffer
+  const Tcl_WideInt result_start = profile_clock();
+  Tcl_SetObjResult(interp, new_result_obj(stack.back(), m.types.back(), m.decimals));
+  profile_add(profile->phases[PHASE_RESULT], elements, result_start);
+  profile_add(profile->phases[PHASE_TOTAL], elements, start);
+  return TCL_OK;
+}
+
+// vecexpr::configure ?-threads N? ?-threshold N? ?-jobs N? ?-queue N?
+// Sets the defaults for this interpreter; returns the current settings
+static int obj_configure(ClientData clientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+{
+  VecexprState *state = (VecexprState *) clientData;
+  AsyncQueue &  q = *state->async;
+
+  if (argc % 2 == 0) {
+    Tcl_WrongNumArgs(interp, 1, objv, (char *)"?-threads N? ?-threshold N? ?-jobs N? ?-queue N?");
+    return TCL_ERROR;
+  }
+  for (int a = 1; a < argc; a += 2) {
+    const char *opt = Tcl_GetString(objv[a]);
+    Tcl_WideInt value;
+    if (Tcl_GetWideIntFromObj(interp, objv[a+1], &value) != TCL_OK) {
+      return TCL_ERROR;
+    }
+    if (!strcmp(opt, "-threads")) {
+      if (value < 1) value = 1;
+      state->threads = value;
+    } else if (!strcmp(opt, "-threshold")) {
+      if (value < 0) value = 0;
+      state->threshold = value;
+    } else if (!strcmp(opt, "-jobs") || !strcmp(opt, "-queue")) {
+      if (value < 1) value = 1;
+      Tcl_MutexLock(&q.mutex);
+      if (opt[1] == 'j') {
+        q.max_running = value;
+        start_runners(q);
+      } else {
+        q.max_waiting = value;
+      }
+      Tcl_MutexUnlock(&q.mutex);
+    } else {
+      Tcl_SetObjResult(interp, Tcl_ObjPrintf("vecexpr::configure: unknown option \"%s\"", opt));
+      return TCL_ERROR;
+    }
+  }
+
+  Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("-threads", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewIntObj(state->threads));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("-threshold", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(state->threshold));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("-jobs", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewIntObj(q.max_running));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("-queue", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewIntObj(q.max_waiting));
+  Tcl_SetObjResult(interp, result);
+  return TCL_OK;
+}
+
+// vecexpr::buffers ?-reset?
+// Counters of the interpreter's buffer pool: heap allocations, reuses of
+// pooled buffers and buffers freed since the last reset, and the number and
+// size of the buffers currently cached.
+static int obj_buffers(ClientData clientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+{
+  VecexprState *state = (VecexprState *) clientData;
+  BufferPool &pool = state->buffers;
+
+  if (argc > 2 || (argc == 2 && strcmp(Tcl_GetString(objv[1]), "-reset"))) {
+    Tcl_WrongNumArgs(interp, 1, objv, (char *)"?-reset?");
+    return TCL_ERROR;
+  }
+
+  Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("allocations", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(pool.allocations));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("reuses", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(pool.reuses));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("frees", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(pool.frees));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("cached", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj((Tcl_WideInt) pool.cached));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("bytes", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj((Tcl_WideInt) pool.cached_bytes));
+  Tcl_SetObjResult(interp, result);
+  if (argc == 2) pool.reset_counters();
+  return TCL_OK;
+}
+
+static Tcl_Obj * new_profile_entry(Tcl_Interp *interp, const ProfileEntry &entry)
+{
+  Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("calls", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(entry.calls));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("elements", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(entry.elements));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("ns", -1));
+  Tcl_ListObjAppendElement(interp, result, Tcl_NewWideIntObj(entry.ns));
+  return result;
+}
+
+// vecexpr::stats ?-enable boolean? ?-reset?
+// Profile of the commands run while profiling was enabled, since the last
+// reset: calls, elements processed and time in ns of each phase (total,
+// compile, input, result) and of each operator or fused chain that ran.
+// Time not spent in the phases and operators is the dispatching overhead.
+static int obj_stats(ClientData clientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+{
+  VecexprState *state = (VecexprState *) clientData;
+  Profile &profile = state->profile;
+  bool reset = false;
+
+  for (int a = 1; a < argc; a++) {
+    const char *opt = Tcl_GetString(objv[a]);
+    int enable;
+    if (!strcmp(opt, "-reset")) {
+      reset = true;
+    } else if (!strcmp(opt, "-enable") && a + 1 < argc) {
+      if (Tcl_GetBooleanFromObj(interp, objv[++a], &enable) != TCL_OK) {
+        return TCL_ERROR;
+      }
+      state->profiling = enable;
+    } else {
+      Tcl_WrongNumArgs(interp, 1, objv, (char *)"?-enable boolean? ?-reset?");
+      return TCL_ERROR;
+    }
+  }
+
+  Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(phase_names[p], -1));
+    Tcl_ListObjAppendElement(interp, result, new_profile_entry(interp, profile.phases[p]));
+  }
+  for (int op = 0; op < OP_NUM; op++) {
+    if (!profile.ops[op].calls) continue;
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(op_name((Opcode) op), -1));
+    Tcl_ListObjAppendElement(interp, result, new_profile_entry(interp, profile.ops[op]));
   }
+  for (std::map<std::string, ProfileEntry>::const_iterator i = profile.chains.begin();
+       i != profile.chains.end(); ++i) {
+    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(i->first.c_str(), -1));
+    Tcl_ListObjAppendElement(interp, result, new_profile_entry(interp, i->second));
+  }
+  Tcl_SetObjResult(interp, result);
+  if (reset) profile_reset(profile);
+  return TCL_OK;
+}
+
+// vecexpr::cancel id ?id ...?
+// Cancels jobs of vecexpr -async: their callbacks will not be called. A job
+// that is running stops before its next operator. Unknown ids (e.g. of jobs
+// already delivered) are ignored.
+static int obj_cancel(ClientData clientData, Tcl_Interp *interp, int argc, Tcl_Obj * const objv[])
+{
+  VecexprState *state = (VecexprState *) clientData;
+  AsyncQueue &  q = *state->async;
 
-  count_back = stack.back().size();
-  Tcl_Obj *tcl_result = Tcl_NewListObj(0, NULL);
-  for (size_t i = 0; i < count_back; i++) {
-    Tcl_ListObjAppendElement(interp, tcl_result, Tcl_NewDoubleObj(stack.back()[i]));
+  if (argc < 2) {
+    Tcl_WrongNumArgs(interp, 1, objv, (char *)"id ?id ...?");
+    return TCL_ERROR;
+  }
+  for (int a = 1; a < argc; a++) {
+    int id;
+    if (sscanf(Tcl_GetString(objv[a]), "vecexpr#%d", &id) != 1) continue;
+    std::map<int, AsyncJob *>::iterator i = q.jobs.find(id);
+    if (i == q.jobs.end()) continue;
+    AsyncJob *job = i->second;
+    Tcl_MutexLock(&q.mutex);
+    std::deque<AsyncJob *>::iterator w = std::find(q.waiting.begin(), q.waiting.end(), job);
+    const bool waiting = (w != q.waiting.end());
+    if (waiting) q.waiting.erase(w);
+    job->cancel = true;
+    Tcl_MutexUnlock(&q.mutex);
+    if (waiting) {
+      q.jobs.erase(i);
+      free_async_job(job);
+    }
   }
-  Tcl_SetObjResult(interp, tcl_result);
   return TCL_OK;
 }
 
+static void delete_state(ClientData clientData, Tcl_Interp *)
+{
+  VecexprState *state = (VecexprState *) clientData;
+  delete_async_queue(state->async);
+  delete state->pool;
+  for (size_t i = 0; i < state->machines.size(); i++) delete_machine(state->machines[i]);
+  for (size_t i = 0; i < state->map_workers.size(); i++) {
+    MapWorker *w = state->map_workers[i];
+    reset_machine(*w->m);
+    delete_machine(w->m);
+    delete w;
+  }
+  delete state;
+}
+
 extern "C" {
   int Vecexpr_Init(Tcl_Interp *interp) {
+    Tcl_RegisterObjType(&program_type);
+    Tcl_RegisterObjType(&vector_type);
+    select_kernels();
+    init_op_info();
+    init_text_tables();
+    Tcl_CreateNamespace(interp, "vecexpr", NULL, NULL);
+    Tcl_SetVar(interp, "vecexpr::isa", ew_kernel_isa, TCL_GLOBAL_ONLY);
+
+    VecexprState *state = new VecexprState;
+    state->threads = 1;
+    state->threshold = DEFAULT_THRESHOLD;
+    state->pool = NULL;
+    state->pool_threads = 0;
+    state->running = 0;
+    state->profiling = false;
+    profile_reset(state->profile);
+    state->async = new_async_queue(interp);
+    // The state lives as long as the interpreter
+    Tcl_SetAssocData(interp, "vecexpr", delete_state, state);
+
     Tcl_CreateObjCommand(interp, "vecexpr", obj_vecexpr,
-                    (ClientData) NULL, (Tcl_CmdDeleteProc *) NULL);
+                    (ClientData) state, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vecexpr::configure", obj_configure,
+                    (ClientData) state, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vecexpr::buffers", obj_buffers,
+                    (ClientData) state, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vecexpr::stats", obj_stats,
+                    (ClientData) state, (Tcl_CmdDeleteProc *) NULL);
+    Tcl_CreateObjCommand(interp, "vecexpr::cancel", obj_cancel,
+                    (ClientData) state, (Tcl_CmdDeleteProc *) NULL);
     return TCL_OK;
   }
 }